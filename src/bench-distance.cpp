@@ -0,0 +1,288 @@
+#include <cmath>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <vector>
+#include <iostream>
+#include <boost/format.hpp>
+#include <boost/program_options.hpp>
+#include "donkey-simd.h"
+
+// Micro benchmark of the distance kernels against the original
+// scalar loops, at the qbic (48) and text-lsa (2000) dimensions,
+// and of the Hamming kernels at the nise sketch size (128 bits).
+
+using namespace std;
+using namespace donkey;
+
+namespace po = boost::program_options;
+
+// the loops as they were before SIMD kernels were introduced
+namespace baseline {
+    float l1 (float const *v1, float const *v2, unsigned D) {
+        double v = 0;
+        for (unsigned i = 0; i < D; ++i) {
+            double a = std::abs(v1[i] - v2[i]);
+            v += a;
+        }
+        return v;
+    }
+
+    float l2 (float const *v1, float const *v2, unsigned D) {
+        double v = 0.0;
+        for (unsigned i = 0; i < D; ++i) {
+            double a = v1[i] - v2[i];
+            v += a * a;
+        }
+        return std::sqrt(v);
+    }
+
+    unsigned hamming (uint32_t const *v1, uint32_t const *v2, unsigned D) {
+        unsigned v = 0;
+        for (unsigned i = 0; i < D; ++i) {
+            v += __builtin_popcount(v1[i] ^ v2[i]);
+        }
+        return v;
+    }
+
+    float cosine (float const *v1, float const *v2, unsigned D) {
+        float v = 0.0f;
+        float m1 = 0.0f, m2 = 0.0f;
+        for (unsigned i = 0; i < D; ++i) {
+            v  += v1[i] * v2[i];
+            m1 += v1[i] * v1[i];
+            m2 += v2[i] * v2[i];
+        }
+        return v / (std::sqrt(m1) * std::sqrt(m2));
+    }
+}
+
+class Bench {
+    unsigned dim;
+    unsigned count;
+    unsigned rounds;
+    vector<float> query;
+    vector<float> data;
+public:
+    Bench (unsigned dim_, size_t bytes, unsigned rounds_)
+        : dim(dim_), count(std::max<size_t>(bytes / (sizeof(float) * dim), 1)), rounds(rounds_),
+        query(dim), data(size_t(count) * dim) {
+        std::mt19937 rng(2016);
+        std::normal_distribution<float> nd;
+        for (auto &v: query) v = nd(rng);
+        for (auto &v: data) v = nd(rng);
+    }
+
+    // return ns per distance evaluation, *check receives the sum of all
+    // distances so the work can't be optimized away, and kernels can be
+    // compared.
+    template <typename F>
+    double run (F const &fun, double *check) const {
+        double sum = 0;
+        auto begin = std::chrono::steady_clock::now();
+        for (unsigned r = 0; r < rounds; ++r) {
+            float const *p = &data[0];
+            for (unsigned i = 0; i < count; ++i, p += dim) {
+                sum += fun(&query[0], p, dim);
+            }
+        }
+        auto end = std::chrono::steady_clock::now();
+        *check = sum;
+        return std::chrono::duration<double, std::nano>(end - begin).count() / (double(rounds) * count);
+    }
+
+    // one query against all vectors visited in random order through
+    // a pointer array, as in graph search, using the batched kernel.
+    double run_many (void (*kernel) (float const *, float const *const *, unsigned, unsigned, float *),
+                     vector<float const *> const &ptrs, double *check) const {
+        static unsigned constexpr BATCH = 64;
+        float out[BATCH];
+        double sum = 0;
+        auto begin = std::chrono::steady_clock::now();
+        for (unsigned r = 0; r < rounds; ++r) {
+            for (unsigned i = 0; i < count; i += BATCH) {
+                unsigned m = count - i;
+                if (m > BATCH) m = BATCH;
+                kernel(&query[0], &ptrs[i], m, dim, out);
+                for (unsigned j = 0; j < m; ++j) {
+                    sum += out[j];
+                }
+            }
+        }
+        auto end = std::chrono::steady_clock::now();
+        *check = sum;
+        return std::chrono::duration<double, std::nano>(end - begin).count() / (double(rounds) * count);
+    }
+
+    // same access pattern, one pair kernel call per vector
+    double run_each (float (*kernel) (float const *, float const *, unsigned),
+                     vector<float const *> const &ptrs, double *check) const {
+        double sum = 0;
+        auto begin = std::chrono::steady_clock::now();
+        for (unsigned r = 0; r < rounds; ++r) {
+            for (unsigned i = 0; i < count; ++i) {
+                sum += kernel(&query[0], ptrs[i], dim);
+            }
+        }
+        auto end = std::chrono::steady_clock::now();
+        *check = sum;
+        return std::chrono::duration<double, std::nano>(end - begin).count() / (double(rounds) * count);
+    }
+
+    void report (char const *metric, char const *kernel, double ns, double base, double check) const {
+        cout << boost::format("%5d %-8s %-9s %10.2f ns %8.2fx  %g") % dim % metric % kernel % ns % (base / ns) % check << endl;
+    }
+
+    void operator () (vector<string> const &kernels) const {
+        double check;
+        double l1 = run(baseline::l1, &check);
+        report("l1", "baseline", l1, l1, check);
+        double l2 = run(baseline::l2, &check);
+        report("l2", "baseline", l2, l2, check);
+        double cos = run(baseline::cosine, &check);
+        report("cosine", "baseline", cos, cos, check);
+        vector<float const *> ptrs(count);
+        for (unsigned i = 0; i < count; ++i) {
+            ptrs[i] = &data[size_t(i) * dim];
+        }
+        std::shuffle(ptrs.begin(), ptrs.end(), std::mt19937(2016));
+        for (auto const &name: kernels) {
+            simd::Kernels const *k = simd::lookup(name.c_str());
+            if (!k) {
+                cout << "kernel " << name << " not supported." << endl;
+                continue;
+            }
+            double t = run(k->l1, &check);
+            report("l1", k->name, t, l1, check);
+            t = run([k](float const *a, float const *b, unsigned n) {
+                        return std::sqrt(k->l2sqr(a, b, n));
+                    }, &check);
+            report("l2", k->name, t, l2, check);
+            t = run([k](float const *a, float const *b, unsigned n) {
+                        float r[3];
+                        k->dot_norms(a, b, n, r);
+                        return r[0] / (std::sqrt(r[1]) * std::sqrt(r[2]));
+                    }, &check);
+            report("cosine", k->name, t, cos, check);
+            double each = run_each(k->l2sqr, ptrs, &check);
+            report("l2sqr/1", k->name, each, each, check);
+            t = run_many(k->l2sqr_many, ptrs, &check);
+            report("l2sqr/N", k->name, t, each, check);
+        }
+    }
+};
+
+// one query against sketches visited in random order, as in graph
+// search; words is the sketch size in 32-bit words
+class HammingBench {
+    unsigned words;
+    unsigned count;
+    unsigned rounds;
+    vector<uint32_t> query;
+    vector<uint32_t> data;
+    vector<uint32_t const *> ptrs;
+public:
+    HammingBench (unsigned bits, size_t bytes, unsigned rounds_)
+        : words((bits + 31) / 32), count(std::max<size_t>(bytes / (sizeof(uint32_t) * words), 1)), rounds(rounds_),
+        query(words), data(size_t(count) * words), ptrs(count) {
+        std::mt19937 rng(2016);
+        for (auto &v: query) v = rng();
+        for (auto &v: data) v = rng();
+        for (unsigned i = 0; i < count; ++i) {
+            ptrs[i] = &data[size_t(i) * words];
+        }
+        std::shuffle(ptrs.begin(), ptrs.end(), std::mt19937(2016));
+    }
+
+    double run_each (double *check) const {
+        double sum = 0;
+        auto begin = std::chrono::steady_clock::now();
+        for (unsigned r = 0; r < rounds; ++r) {
+            for (unsigned i = 0; i < count; ++i) {
+                sum += baseline::hamming(&query[0], ptrs[i], words);
+            }
+        }
+        auto end = std::chrono::steady_clock::now();
+        *check = sum;
+        return std::chrono::duration<double, std::nano>(end - begin).count() / (double(rounds) * count);
+    }
+
+    double run_many (simd::Kernels const *k, double *check) const {
+        static unsigned constexpr BATCH = 64;
+        float out[BATCH];
+        double sum = 0;
+        auto begin = std::chrono::steady_clock::now();
+        for (unsigned r = 0; r < rounds; ++r) {
+            for (unsigned i = 0; i < count; i += BATCH) {
+                unsigned m = count - i;
+                if (m > BATCH) m = BATCH;
+                k->hamming_many(&query[0], &ptrs[i], m, words, out);
+                for (unsigned j = 0; j < m; ++j) {
+                    sum += out[j];
+                }
+            }
+        }
+        auto end = std::chrono::steady_clock::now();
+        *check = sum;
+        return std::chrono::duration<double, std::nano>(end - begin).count() / (double(rounds) * count);
+    }
+
+    void report (char const *kernel, double ns, double base, double check) const {
+        cout << boost::format("%5d %-8s %-9s %10.2f ns %8.2fx  %g") % (words * 32) % "hamming" % kernel % ns % (base / ns) % check << endl;
+    }
+
+    void operator () (vector<string> const &kernels) const {
+        double check;
+        double base = run_each(&check);
+        report("baseline", base, base, check);
+        for (auto const &name: kernels) {
+            simd::Kernels const *k = simd::lookup(name.c_str());
+            if (!k) continue;
+            double t = run_many(k, &check);
+            report(k->name, t, base, check);
+        }
+    }
+};
+
+int main (int argc, char *argv[]) {
+    vector<unsigned> dims;
+    vector<unsigned> bits;
+    vector<string> kernels;
+    size_t bytes;
+    unsigned rounds;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()
+    ("help,h", "produce help message.")
+    ("dim", po::value(&dims), "dimensions, default to 48 (qbic) and 2000 (text-lsa)")
+    ("bits", po::value(&bits), "sketch bits for Hamming, default to 128 (nise) and 1024 (text-rand)")
+    ("kernel", po::value(&kernels), "kernels, default to all")
+    ("bytes", po::value(&bytes)->default_value(16 * 1024 * 1024), "size of data to scan")
+    ("rounds", po::value(&rounds)->default_value(10), "")
+    ;
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).options(desc).run(), vm);
+    po::notify(vm);
+
+    if (vm.count("help")) {
+        std::cerr << "usage: bench-distance [--dim D]... [--kernel K]..." << std::endl;
+        std::cerr << desc;
+        return 1;
+    }
+
+    if (dims.empty()) dims = {48, 2000};
+    if (bits.empty()) bits = {128, 1024};
+    if (kernels.empty()) kernels = {"scalar", "sse", "avx2", "avx512"};
+
+    cout << "auto-selected kernel: " << simd::active->name << endl;
+    for (unsigned dim: dims) {
+        Bench bench(dim, bytes, rounds);
+        bench(kernels);
+    }
+    for (unsigned b: bits) {
+        HammingBench bench(b, bytes, rounds);
+        bench(kernels);
+    }
+    return 0;
+}
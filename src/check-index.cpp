@@ -0,0 +1,453 @@
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <random>
+#include <iostream>
+#include <boost/log/expressions.hpp>
+#include "donkey.h"
+#include "donkey-pool.h"
+
+// Consistency checks of the indexes, on random features of the
+// plugin's type.  Run by make check, the exit status is the number of
+// failed checks.
+
+using namespace std;
+using namespace donkey;
+
+namespace {
+
+    unsigned failures = 0;
+
+    void check (bool ok, string const &what) {
+        if (!ok) {
+            cerr << "FAILED: " << what << endl;
+            ++failures;
+        }
+    }
+
+    // Random values of the feature's own type: normally distributed
+    // for floating point, random bits otherwise.
+    template <typename T, unsigned D>
+    void randomize (VectorFeature<T, D> *f, std::mt19937 &rng, std::true_type) {
+        std::normal_distribution<float> nd;
+        for (auto &v: f->data) v = T(nd(rng));
+    }
+
+    template <typename T, unsigned D>
+    void randomize (VectorFeature<T, D> *f, std::mt19937 &rng, std::false_type) {
+        for (auto &v: f->data) v = T(rng());
+    }
+
+    template <typename T, unsigned D>
+    void randomize (VectorFeature<T, D> *f, std::mt19937 &rng) {
+        randomize(f, rng, std::is_floating_point<T>());
+    }
+
+    void random_features (size_t n, uint32_t seed, vector<Feature> *features) {
+        std::mt19937 rng(seed);
+        features->resize(n);
+        for (auto &f: *features) {
+            randomize(&f, rng);
+        }
+    }
+
+    SearchRequest request (int K) {
+        SearchRequest sp;
+        sp.db = 0;
+        sp.K = sp.hint_K = K;
+        sp.R = default_R();
+        sp.hint_R = default_hint_R();
+        sp.hint_P = 0;
+        return sp;
+    }
+
+    // Objects of a single feature can be made up, others not.
+    bool make_object (Feature const &feature, SingleFeatureObject<Feature> *object) {
+        object->feature = feature;
+        return true;
+    }
+
+    inline bool make_object (Feature const &, void *) {
+        return false;
+    }
+
+    // The index, or null if it does not support this feature.
+    Index *create (string const &name, Index *(*create_index)(Config const &), Config const &config) {
+        try {
+            return create_index(config);
+        }
+        catch (ConfigError const &) {
+            cerr << name << ": not applicable, skipped." << endl;
+            return nullptr;
+        }
+    }
+
+    // Three quarters before rebuild, the rest after.
+    void load (Index *index, vector<Feature> const &features) {
+        size_t n = features.size() * 3 / 4;
+        for (size_t i = 0; i < features.size(); ++i) {
+            if (i == n) index->rebuild();
+            index->insert(i, 0, &features[i]);
+        }
+    }
+
+    string temp_path () {
+        return (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path()).string();
+    }
+
+    // An exact index must report the K best distances of a linear scan.
+    void check_exact (string const &name, Index *(*create_index)(Config const &), Config const &config) {
+        static unsigned constexpr N = 5000;
+        static unsigned constexpr Q = 50;
+        static unsigned constexpr K = 10;
+        std::unique_ptr<Index> index(create(name, create_index, config));
+        if (!index) return;
+        vector<Feature> features, queries;
+        random_features(N, 1, &features);
+        random_features(Q, 2, &queries);
+        load(index.get(), features);
+        SearchRequest sp = request(K);
+        vector<Index::Match> matches;
+        vector<float> best(N);
+        unsigned wrong = 0;
+        for (auto const &query: queries) {
+            index->search(query, sp, &matches);
+            for (unsigned i = 0; i < N; ++i) {
+                best[i] = FeatureSimilarity::apply(features[i], query, sp.params_l1);
+            }
+            if (FeatureSimilarity::POLARITY > 0) {
+                std::sort(best.begin(), best.end(), std::greater<float>());
+            }
+            else {
+                std::sort(best.begin(), best.end());
+            }
+            bool ok = matches.size() == K;
+            for (unsigned i = 0; ok && i < K; ++i) {
+                ok = std::abs(matches[i].distance - best[i]) <= 1e-4 * std::max(1.0f, std::abs(best[i]));
+            }
+            if (!ok) ++wrong;
+        }
+        check(wrong == 0, name + ": " + std::to_string(wrong) + " searches differ from a linear scan");
+    }
+
+    // An index recovered from a snapshot must answer as the one
+    // saved.  The recovered one is configured with another seed, so
+    // that building it again would not do.  The queries are features
+    // of the index, so that even hashing finds something.
+    void check_recover (string const &name, Index *(*create_index)(Config const &), Config config, char const *seed) {
+        static unsigned constexpr N = 5000;
+        static unsigned constexpr Q = 50;
+        static unsigned constexpr K = 10;
+        std::unique_ptr<Index> saved(create(name, create_index, config));
+        if (!saved) return;
+        if (seed) config.put(seed, 1234);
+        std::unique_ptr<Index> recovered(create_index(config));
+        vector<Feature> features;
+        random_features(N, 3, &features);
+        load(saved.get(), features);
+        string path = temp_path();
+        saved->snapshot(path);
+        for (size_t i = 0; i < features.size(); ++i) {
+            recovered->insert(i, 0, &features[i]);
+        }
+        recovered->recover(path);
+        boost::filesystem::remove(path);
+        SearchRequest sp = request(K);
+        vector<Index::Match> m1, m2;
+        unsigned wrong = 0, empty = 0;
+        for (unsigned q = 0; q < Q; ++q) {
+            Feature const &query = features[q * (N / Q)];
+            saved->search(query, sp, &m1);
+            recovered->search(query, sp, &m2);
+            if (m1.empty()) ++empty;
+            bool ok = m1.size() == m2.size();
+            for (unsigned i = 0; ok && i < m1.size(); ++i) {
+                ok = m1[i].object == m2[i].object && m1[i].distance == m2[i].distance;
+            }
+            if (!ok) ++wrong;
+        }
+        check(empty == 0, name + ": nothing found before snapshot");
+        check(wrong == 0, name + ": " + std::to_string(wrong) + " searches differ after recover");
+    }
+
+    // The header of an LSH snapshot must give back the configured w
+    // exactly, or recover would hash every entry again.
+    void check_lsh_width () {
+        static float constexpr W = 0.123456789f;
+        Config config;
+        config.put("donkey.lsh.w", W);
+        std::unique_ptr<Index> index(create("lsh.w", create_lsh_index, config));
+        if (!index) return;
+        vector<Feature> features;
+        random_features(100, 8, &features);
+        load(index.get(), features);
+        string path = temp_path();
+        index->snapshot(path);
+        std::ifstream is(path.c_str());
+        string magic, family;
+        uint32_t seed;
+        unsigned K;
+        float w = 0;
+        is >> magic >> family >> seed >> K >> w;
+        is.close();
+        boost::filesystem::remove(path);
+        check(w == W, "lsh.w: snapshot does not keep w exactly");
+    }
+
+    // One thread inserts while others search: every match must be an
+    // entry inserted before, and each feature must find itself once
+    // all are in.
+    void check_hnsw_concurrent () {
+        static unsigned constexpr N = 10000;
+        static unsigned constexpr SEARCHERS = 3;
+        Config config;
+        std::unique_ptr<Index> index(create_hnsw_index(config));
+        BOOST_VERIFY(index->concurrent_insert());
+        index->rebuild();   // link on insert
+        vector<Feature> features;
+        random_features(N, 2016, &features);
+        std::atomic<unsigned> inserted(0);
+        std::atomic<unsigned> bad(0);
+        std::atomic<bool> done(false);
+        vector<std::thread> searchers;
+        for (unsigned t = 0; t < SEARCHERS; ++t) {
+            searchers.emplace_back([&, t]() {
+                SearchRequest sp = request(10);
+                std::mt19937 rng(t);
+                vector<Index::Match> matches;
+                while (!done.load()) {
+                    unsigned n = inserted.load();
+                    index->search(features[rng() % N], sp, &matches);
+                    unsigned m = inserted.load();
+                    for (auto const &match: matches) {
+                        // the one being inserted may be published already
+                        if (match.object > m || match.tag != 0) ++bad;
+                    }
+                    if (n > 0 && matches.empty()) ++bad;
+                    // requests arrive, they don't spin: back-to-back
+                    // readers of a boost::shared_mutex can hold off
+                    // the writer growing the storage
+                    std::this_thread::sleep_for(std::chrono::microseconds(50));
+                }
+            });
+        }
+        for (unsigned i = 0; i < N; ++i) {
+            index->insert(i, 0, &features[i]);
+            inserted.store(i + 1);
+        }
+        done.store(true);
+        for (auto &t: searchers) t.join();
+        check(bad.load() == 0, "hnsw: concurrent search returned unknown entries");
+        SearchRequest sp = request(1);
+        vector<Index::Match> matches;
+        unsigned found = 0;
+        for (unsigned i = 0; i < N; i += 10) {
+            index->search(features[i], sp, &matches);
+            if (matches.size() && matches[0].object == i) ++found;
+        }
+        check(found * 10 >= N * 9 / 10, "hnsw: features not found after concurrent insertion");
+    }
+
+    // A part of a pool job throwing must not take the process down:
+    // the exception comes out of run() once every part has ended, and
+    // the pool goes on working.
+    void check_pool_exception () {
+        static unsigned constexpr N = 1000;
+        WorkerPool pool(3);
+        std::atomic<unsigned> started(0);
+        bool thrown = false;
+        try {
+            pool.run(N, [&](unsigned i) {
+                ++started;
+                if (i == 10) throw std::runtime_error("part 10");
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            });
+        }
+        catch (std::runtime_error const &e) {
+            thrown = string(e.what()) == "part 10";
+        }
+        check(thrown, "pool: exception of a part not rethrown");
+        check(started.load() < N, "pool: parts not skipped after an exception");
+        std::atomic<unsigned> done(0);
+        pool.run(N, [&](unsigned) { ++done; });
+        check(done.load() == N, "pool: parts lost after an exception");
+    }
+
+    // A clear while the merger builds a segment does not wait for the
+    // build, which must then be dropped rather than cover the entries
+    // inserted after the clear.
+    void check_kgraph_clear_during_merge () {
+        static unsigned constexpr SEGMENT = 2000;
+        static unsigned constexpr M = 100;      // inserted after the clear
+        Config config;
+        config.put("donkey.kgraph.segment", SEGMENT);
+        std::unique_ptr<Index> index(create("kgraph.segment", create_kgraph_index, config));
+        if (!index) return;
+        index->rebuild();   // segments are built as entries come
+        vector<Feature> features;
+        random_features(SEGMENT + M, 7, &features);
+        for (unsigned i = 0; i < SEGMENT; ++i) {
+            index->insert(i, 0, &features[i]);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        index->clear();
+        for (unsigned i = SEGMENT; i < SEGMENT + M; ++i) {
+            index->insert(i, 0, &features[i]);
+        }
+        SearchRequest sp = request(1);
+        vector<Index::Match> matches;
+        unsigned wrong = 0;
+        // the build dropped ends meanwhile
+        for (unsigned round = 0; round < 20; ++round) {
+            for (unsigned i = SEGMENT; i < SEGMENT + M; ++i) {
+                index->search(features[i], sp, &matches);
+                if (matches.size() != 1 || matches[0].object != i) ++wrong;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+        check(wrong == 0, "kgraph.segment: " + std::to_string(wrong) + " searches found entries cleared or missed new ones");
+    }
+
+    // A clear while a background reindex is running must not let the
+    // reindex swap in the entries cleared.
+    void check_clear_during_reindex () {
+        static unsigned constexpr N = 20000;
+        static unsigned constexpr M = 100;      // inserted after each clear
+        static unsigned constexpr ROUNDS = 5;
+        Object object;
+        vector<Feature> features;
+        random_features(N + M * ROUNDS, 5, &features);
+        if (!make_object(features[0], &object)) {
+            cerr << "reindex: objects are not single features, skipped." << endl;
+            return;
+        }
+        string dir = temp_path();
+        boost::filesystem::create_directories(dir);
+        {
+            Config config;
+            config.put("donkey.index.algorithm", "hnsw");
+            DB db(config, dir, false);
+            for (unsigned i = 0; i < N; ++i) {
+                make_object(features[i], &object);
+                db.insert("old-" + std::to_string(i), "", &object);
+            }
+            for (unsigned r = 0; r < ROUNDS; ++r) {
+                db.reindex();
+                std::this_thread::sleep_for(std::chrono::milliseconds(r * 50));
+                db.clear();
+                for (unsigned i = 0; i < M; ++i) {
+                    make_object(features[N + r * M + i], &object);
+                    db.insert(std::to_string(r) + "-" + std::to_string(i), "", &object);
+                }
+                StatRequest stat_request;
+                StatResponse stat;
+                do {    // wait for the reindex to give up
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                    db.stat(stat_request, &stat);
+                } while (stat.rebuild == "loading" || stat.rebuild == "building");
+                check(stat.size == int(M), "reindex: entries cleared came back");
+                string prefix = std::to_string(r) + "-";
+                SearchRequest sp = request(1);
+                SearchResponse response;
+                unsigned wrong = 0;
+                for (unsigned i = 0; i < M; ++i) {
+                    make_object(features[N + r * M + i], &object);
+                    db.search(object, sp, &response);
+                    if (response.hits.size() != 1 || response.hits[0].key != prefix + std::to_string(i)) ++wrong;
+                }
+                check(wrong == 0, "reindex: " + std::to_string(wrong) + " searches found entries cleared or missed new ones");
+                if (r + 1 < ROUNDS) {   // start again with N entries
+                    db.clear();
+                    for (unsigned i = 0; i < N; ++i) {
+                        make_object(features[i], &object);
+                        db.insert("old-" + std::to_string(r) + "-" + std::to_string(i), "", &object);
+                    }
+                }
+            }
+        }
+        boost::filesystem::remove_all(dir);
+    }
+
+    // A sync while a background reindex is running saves the index
+    // serving then, the new one must still be saved once swapped in.
+    // The file saved by sync is removed, so that it is there in the
+    // end only if the reindex saved its own.
+    void check_sync_during_reindex () {
+        static unsigned constexpr N = 20000;
+        Object object;
+        vector<Feature> features;
+        random_features(N, 6, &features);
+        if (!make_object(features[0], &object)) {
+            cerr << "sync: objects are not single features, skipped." << endl;
+            return;
+        }
+        string dir = temp_path();
+        boost::filesystem::create_directories(dir);
+        {
+            Config config;
+            config.put("donkey.index.algorithm", "hnsw");
+            DB db(config, dir, false);
+            for (unsigned i = 0; i < N; ++i) {
+                make_object(features[i], &object);
+                db.insert(std::to_string(i), "", &object);
+            }
+            db.reindex();
+            check(!db.sync(), "sync: reported no reindex running");
+            boost::filesystem::remove(dir + "/index");
+            StatRequest stat_request;
+            StatResponse stat;
+            db.stat(stat_request, &stat);
+            if (stat.rebuild == "loading" || stat.rebuild == "building") {
+                do {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                    db.stat(stat_request, &stat);
+                } while (stat.rebuild == "loading" || stat.rebuild == "building");
+                check(stat.rebuild == "done", "sync: reindex " + stat.rebuild);
+                check(boost::filesystem::exists(dir + "/index"), "sync: reindexed index not saved");
+            }
+            else {
+                cerr << "sync: reindex too fast to check, skipped." << endl;
+            }
+        }
+        boost::filesystem::remove_all(dir);
+    }
+}
+
+int main () {
+    logging::core::get()->set_filter(logging::trivial::severity >= logging::trivial::error);
+    {
+        Config config;
+        check_exact("linear", create_linear_index, config);
+        config.put("donkey.linear.pivots", 16);
+        check_exact("linear.pivots", create_linear_index, config);
+        check_exact("mih", create_mih_index, Config());
+        check_exact("vptree", create_vptree_index, Config());
+    }
+    {
+        Config config;
+        config.put("donkey.ivf.min", 1000);
+        config.put("donkey.ivf.lists", 32);
+        config.put("donkey.pq.min", 1000);
+        config.put("donkey.kgraph.min", 1000);
+        check_recover("hnsw", create_hnsw_index, config, "donkey.hnsw.seed");
+        check_recover("ivf", create_ivf_index, config, "donkey.ivf.train.seed");
+        check_recover("pq", create_pq_index, config, "donkey.pq.train.seed");
+        check_recover("lsh", create_lsh_index, config, "donkey.lsh.seed");
+        check_recover("sketch", create_sketch_index, config, nullptr);
+        check_recover("vptree", create_vptree_index, config, "donkey.vptree.seed");
+        check_recover("kgraph", create_kgraph_index, config, "donkey.kgraph.index.seed");
+    }
+    check_lsh_width();
+    check_pool_exception();
+    check_hnsw_concurrent();
+    check_kgraph_clear_during_merge();
+    check_clear_during_reindex();
+    check_sync_during_reindex();
+    if (failures) {
+        cerr << failures << " check(s) failed." << endl;
+    }
+    else {
+        cerr << "all checks passed." << endl;
+    }
+    return failures;
+}
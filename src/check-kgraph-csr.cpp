@@ -0,0 +1,184 @@
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <vector>
+#include <string>
+#include <limits>
+#include <algorithm>
+#include <unistd.h>
+#include "kgraph.h"
+#include "kgraph-batch.h"
+
+// A graph saved as CSR by kgraph_lite, plain, packed or reordered,
+// must be searched exactly as the KNNGRAPH file it comes from: same
+// start points, same matches in the same order.  Run by make check,
+// the exit status is the number of failed checks.
+
+using namespace std;
+
+namespace {
+
+    static unsigned constexpr N = 4000;
+    static unsigned constexpr DIM = 8;
+    static unsigned constexpr DEGREE = 16;  // neighbors saved per node
+    static unsigned constexpr CORE = 4;     // the M of each node
+    static unsigned constexpr QUERIES = 200;
+    static unsigned constexpr K = 10;
+    static unsigned constexpr INIT = 5;     // start points given to search
+
+    unsigned failures = 0;
+
+    void check (bool ok, string const &what) {
+        if (!ok) {
+            cerr << "FAILED: " << what << endl;
+            ++failures;
+        }
+    }
+
+    typedef vector<float> Point;
+
+    float l2sqr (Point const &a, Point const &b) {
+        float s = 0;
+        for (unsigned i = 0; i < DIM; ++i) {
+            float d = a[i] - b[i];
+            s += d * d;
+        }
+        return s;
+    }
+
+    // Distance of the query to the points, node i being point
+    // order[i] if the graph was renumbered.
+    class Oracle: public kgraph::SearchOracle {
+        vector<Point> const &points;
+        Point const &query;
+        unsigned const *order;
+    public:
+        Oracle (vector<Point> const &p, Point const &q, unsigned const *o): points(p), query(q), order(o) {
+        }
+        virtual unsigned size () const {
+            return points.size();
+        }
+        virtual float operator () (unsigned i) const {
+            return l2sqr(query, points[order ? order[i] : i]);
+        }
+    };
+
+    // The exact DEGREE nearest of every point, in distance order, as a
+    // KNNGRAPH file without distances.
+    void write_knngraph (vector<Point> const &points, string const &path) {
+        ofstream os(path.c_str(), ios::binary);
+        uint32_t header[] = {2, kgraph::KGraph::FORMAT_NO_DIST, uint32_t(points.size())};
+        os.write("KNNGRAPH", 8);
+        os.write(reinterpret_cast<char const *>(header), sizeof(header));
+        vector<pair<float, uint32_t>> all(points.size());
+        for (uint32_t i = 0; i < points.size(); ++i) {
+            for (uint32_t j = 0; j < points.size(); ++j) {
+                all[j] = make_pair(i == j ? numeric_limits<float>::max() : l2sqr(points[i], points[j]), j);
+            }
+            partial_sort(all.begin(), all.begin() + DEGREE, all.end());
+            uint32_t list[2 + DEGREE] = {CORE, DEGREE};
+            for (unsigned k = 0; k < DEGREE; ++k) {
+                list[2 + k] = all[k].second;
+            }
+            os.write(reinterpret_cast<char const *>(list), sizeof(list));
+        }
+    }
+
+    // matches of all queries, one search each with the M given and
+    // the same start points, ids as in the original graph
+    vector<unsigned> search_all (kgraph::KGraph const &graph, vector<Point> const &points,
+                                 vector<Point> const &queries, unsigned M) {
+        unsigned const *order = kgraph::kgraph_lite_order(&graph);
+        vector<unsigned> node(points.size());     // of each point
+        for (unsigned i = 0; i < points.size(); ++i) {
+            node[order ? order[i] : i] = i;
+        }
+        kgraph::KGraph::SearchParams params;
+        params.K = K;
+        params.M = M;
+        params.S = 10;
+        params.T = 1;
+        params.P = 100;
+        params.epsilon = numeric_limits<float>::max();
+        params.seed = 1;
+        params.init = INIT;
+        vector<unsigned> all;
+        std::mt19937 rng(2016);
+        for (auto const &q: queries) {
+            unsigned ids[K];
+            float dists[K];
+            for (unsigned l = 0; l < INIT; ++l) {
+                ids[l] = node[rng() % points.size()];
+            }
+            Oracle oracle(points, q, order);
+            unsigned L = graph.search(oracle, params, ids, dists, nullptr);
+            for (unsigned l = 0; l < K; ++l) {
+                all.push_back(l < L ? (order ? order[ids[l]] : ids[l]) : unsigned(-1));
+            }
+        }
+        return all;
+    }
+}
+
+int main () {
+    std::mt19937 rng(2016);
+    std::normal_distribution<float> nd;
+    vector<Point> points(N, Point(DIM));
+    vector<Point> queries(QUERIES, Point(DIM));
+    for (auto &p: points) for (auto &v: p) v = nd(rng);
+    for (auto &p: queries) for (auto &v: p) v = nd(rng);
+
+    string prefix = "check-kgraph-csr." + std::to_string(getpid());
+    string knngraph = prefix + ".knngraph";
+    string csr = prefix + ".csr";
+    write_knngraph(points, knngraph);
+
+    std::unique_ptr<kgraph::KGraph> reference(kgraph::create_kgraph_lite(false));
+    reference->load(knngraph.c_str());
+
+    struct Variant {
+        char const *name;
+        bool compress;
+        bool reorder;
+        bool save;
+    } variants[] = {
+        {"packed", true, false, false},
+        {"csr", false, false, true},
+        {"packed csr", true, false, true},
+        {"reordered csr", false, true, true},
+        {"packed reordered csr", true, true, true},
+    };
+    try {
+        for (auto const &v: variants) {
+            std::unique_ptr<kgraph::KGraph> graph(kgraph::create_kgraph_lite(v.compress));
+            graph->load(knngraph.c_str());
+            if (v.reorder) kgraph::reorder_kgraph_lite(graph.get());
+            if (v.save) {
+                graph->save(csr.c_str(), kgraph::KGraph::FORMAT_NO_DIST);
+                graph.reset(kgraph::create_kgraph_lite(false));
+                graph->load(csr.c_str());
+            }
+            // M of 0 expands the core of each list only, larger ones
+            // part or all of the rest
+            for (unsigned M: {0u, CORE + 3, DEGREE}) {
+                check(search_all(*graph, points, queries, M) == search_all(*reference, points, queries, M),
+                      string(v.name) + " search differs from KNNGRAPH with M = " + std::to_string(M));
+            }
+        }
+    }
+    catch (std::exception const &e) {
+        check(false, e.what());
+    }
+    remove(knngraph.c_str());
+    remove(csr.c_str());
+    if (failures) {
+        cerr << failures << " check(s) failed." << endl;
+    }
+    else {
+        cerr << "all checks passed." << endl;
+    }
+    return failures;
+}
@@ -128,6 +128,7 @@ int main (int argc, char *argv[]) {
         (",R", po::value(&search.R)->default_value(NAN), "")
         ("hint_K", po::value(&search.hint_K)->default_value(-1), "")
         ("hint_R", po::value(&search.hint_R)->default_value(NAN), "")
+        ("hint_P", po::value(&search.hint_P)->default_value(-1), "probe budget")
         ("rfmt", po::value(&rfmt)->default_value("%k\t%s\t%m"), "response format")
         ("hfmt", po::value(&hfmt)->default_value("%K => %k\t%s\t%m"), "hit format")
         ("embed", "")
@@ -323,6 +324,9 @@ int main (int argc, char *argv[]) {
         req.db = db;
         client->stat(req, &resp);
         cout << "size: " << resp.size << endl;
+        if (resp.rebuild.size()) {  // only the HTTP protocol carries it
+            cout << "rebuild: " << resp.rebuild << ' ' << resp.rebuild_progress << ' ' << resp.rebuild_time << 's' << endl;
+        }
         cout << "last: " << endl;
         for (auto const &s: resp.last) {
             cout << '\t' << s << endl;
@@ -0,0 +1,368 @@
+#ifndef AAALGO_DONKEY_ARENA
+#define AAALGO_DONKEY_ARENA
+
+#include <stdlib.h>
+#include <string.h>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <type_traits>
+#include "donkey-simd.h"
+
+namespace donkey {
+
+    static constexpr size_t ARENA_ALIGNMENT = 64;
+
+    // smallest power of two >= bytes if below the alignment,
+    // otherwise bytes rounded up to a multiple of the alignment
+    static constexpr size_t arena_stride (size_t bytes, size_t s = 1) {
+        return s >= bytes ? s
+             : s >= ARENA_ALIGNMENT ? (bytes + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT
+             : arena_stride(bytes, s * 2);
+    }
+
+    // Index-owned contiguous storage of features.
+    //
+    // Features are copied into slots assigned in insertion order, so a
+    // slot number doubles as the index's entry id.  The matrix is
+    // 64-byte aligned and rows never straddle a cache line more than
+    // necessary: the row stride is sizeof(T) rounded up to a multiple of
+    // 64, or to a power of two for small features.  Linear scans thus
+    // stream through memory and graph walks can prefetch by id.
+    //
+    // Each slot also caches one float computed once at insert time,
+    // the squared norm <x,x> for vector features (see the similarity
+    // norm() functions in donkey-common.h), so that cosine and L2
+    // can be evaluated from a single dot product.
+    //
+    // Growing the arena moves it, so pointers into it are only valid
+    // until the next append; keep slot numbers instead.
+    template <typename T>
+    class FeatureArena {
+        static_assert(std::is_pod<T>::value, "features must be plain data");
+        char *base;
+        float *norms;
+        size_t n;
+        size_t cap;
+        size_t min_rows;    // first allocation by append
+
+        void grow (size_t c) {
+            void *mem = nullptr;
+            void *nmem = nullptr;
+            if (posix_memalign(&mem, ALIGNMENT, c * STRIDE) != 0) {
+                throw OutOfMemoryError("cannot allocate feature arena");
+            }
+            if (posix_memalign(&nmem, ALIGNMENT, c * sizeof(float)) != 0) {
+                free(mem);
+                throw OutOfMemoryError("cannot allocate feature arena");
+            }
+            if (n) {
+                memcpy(mem, base, n * STRIDE);
+                memcpy(nmem, norms, n * sizeof(float));
+            }
+            free(base);
+            free(norms);
+            base = reinterpret_cast<char *>(mem);
+            norms = reinterpret_cast<float *>(nmem);
+            cap = c;
+        }
+
+    public:
+        static size_t constexpr ALIGNMENT = ARENA_ALIGNMENT;
+        static size_t constexpr STRIDE = arena_stride(sizeof(T));
+
+        // An index keeping many small arenas passes a smaller min_rows
+        // and reserves what it knows it will append.
+        explicit FeatureArena (size_t min_rows_ = 64): base(nullptr), norms(nullptr), n(0), cap(0), min_rows(min_rows_) {
+        }
+
+        ~FeatureArena () {
+            free(base);
+            free(norms);
+        }
+
+        FeatureArena (FeatureArena const &) = delete;
+        FeatureArena &operator = (FeatureArena const &) = delete;
+
+        size_t size () const {
+            return n;
+        }
+
+        bool empty () const {
+            return n == 0;
+        }
+
+        size_t capacity () const {
+            return cap;
+        }
+
+        // bytes held by the arena
+        size_t memory () const {
+            return cap * (STRIDE + sizeof(float));
+        }
+
+        void reserve (size_t c) {
+            if (c > cap) grow(c);
+        }
+
+        // return the slot of the new feature
+        uint32_t append (T const &v, float norm = 0) {
+            if (n >= cap) {
+                grow(cap ? cap * 2 : min_rows);
+            }
+            memcpy(base + n * STRIDE, &v, sizeof(T));
+            norms[n] = norm;
+            return n++;
+        }
+
+        T const &operator [] (size_t i) const {
+            return *reinterpret_cast<T const *>(base + i * STRIDE);
+        }
+
+        T const *at (size_t i) const {
+            return reinterpret_cast<T const *>(base + i * STRIDE);
+        }
+
+        float norm (size_t i) const {
+            return norms[i];
+        }
+
+        void set_norm (size_t i, float norm) {
+            norms[i] = norm;
+        }
+
+        void prefetch (size_t i) const {
+            __builtin_prefetch(base + i * STRIDE);
+        }
+
+        // drop all features and give memory back
+        void clear () {
+            free(base);
+            free(norms);
+            base = nullptr;
+            norms = nullptr;
+            n = cap = 0;
+        }
+
+        // slot i <- slot slots[i] for i < m, the m slots being a
+        // permutation of [0, m)
+        void permute (uint32_t const *slots, size_t m) {
+            FeatureArena a(min_rows);
+            a.reserve(cap);
+            for (size_t i = 0; i < n; ++i) {
+                size_t j = i < m ? slots[i] : i;
+                a.append((*this)[j], norms[j]);
+            }
+            swap(a);
+        }
+
+        void swap (FeatureArena &a) {
+            std::swap(base, a.base);
+            std::swap(norms, a.norms);
+            std::swap(n, a.n);
+            std::swap(cap, a.cap);
+            std::swap(min_rows, a.min_rows);
+        }
+    };
+
+    // Index-owned quantized copies of float vectors of dimension D:
+    // half precision with C = uint16_t, or one byte per dimension with
+    // C = uint8_t.  Bytes are scaled per dimension between the minimum
+    // and maximum of the features train() has seen, x = lo + step * c,
+    // and values out of that range are clamped.  Rows live in a
+    // FeatureArena, which caches <x,x> of the decoded vector.
+    //
+    // Queries stay at full precision; a query is prepared once per
+    // search and evaluated against rows by raw dot products or L1
+    // sums, which the callers turn into similarities.
+    template <typename C, unsigned D>
+    class QuantizedArena {
+        static_assert(std::is_same<C, uint16_t>::value || std::is_same<C, uint8_t>::value,
+                      "rows are half precision or bytes");
+        static unsigned constexpr BATCH = 64;
+
+        struct Row {
+            C data[D];
+        };
+
+        FeatureArena<Row> rows;
+        vector<float> lo, step;     // bytes only, empty until trained
+
+        static C encode (float v, float, float, uint16_t const *) {
+            return simd::float_to_half(v);
+        }
+
+        static C encode (float v, float l, float s, uint8_t const *) {
+            if (!(s > 0)) return 0;
+            float c = std::round((v - l) / s);
+            return c < 0 ? 0 : c > 255 ? 255 : C(c);
+        }
+
+        static void dot_many (float const *q, uint16_t const *const *x, unsigned n, float *out) {
+            simd::active->f16_dot_many(q, x, n, D, out);
+        }
+
+        static void dot_many (float const *q, uint8_t const *const *x, unsigned n, float *out) {
+            simd::active->u8_dot_many(q, x, n, D, out);
+        }
+
+        static void l1_many (float const *q, float const *, uint16_t const *const *x, unsigned n, float *out) {
+            simd::active->f16_l1_many(q, x, n, D, out);
+        }
+
+        static void l1_many (float const *q, float const *w, uint8_t const *const *x, unsigned n, float *out) {
+            simd::active->u8_l1_many(q, w, x, n, D, out);
+        }
+
+    public:
+        static bool constexpr HALF = std::is_same<C, uint16_t>::value;
+
+        // the query in the coordinates of the rows
+        struct Query {
+            float v[D];
+            float w[D];     // per dimension L1 weights, bytes only
+            float bias;     // added to every result
+        };
+
+        size_t size () const {
+            return rows.size();
+        }
+
+        // bytes held by the arena
+        size_t memory () const {
+            return rows.memory() + (lo.size() + step.size()) * sizeof(float);
+        }
+
+        // half precision needs no training
+        bool trained () const {
+            return HALF || lo.size();
+        }
+
+        // set the byte ranges from x[0..n)
+        void train (float const *const *x, size_t n) {
+            if (HALF) return;
+            lo.assign(D, std::numeric_limits<float>::max());
+            vector<float> hi(D, -std::numeric_limits<float>::max());
+            for (size_t i = 0; i < n; ++i) {
+                for (unsigned d = 0; d < D; ++d) {
+                    lo[d] = std::min(lo[d], x[i][d]);
+                    hi[d] = std::max(hi[d], x[i][d]);
+                }
+            }
+            step.resize(D);
+            for (unsigned d = 0; d < D; ++d) {
+                if (n == 0) lo[d] = hi[d] = 0;
+                step[d] = (hi[d] - lo[d]) / 255;
+            }
+        }
+
+        float decode (size_t i, unsigned d) const {
+            C c = rows[i].data[d];
+            return HALF ? simd::half_to_float(c) : lo[d] + step[d] * c;
+        }
+
+        // return the slot of the new row, the arena must be trained
+        uint32_t append (float const *x) {
+            Row row;
+            float norm = 0;
+            for (unsigned d = 0; d < D; ++d) {
+                row.data[d] = encode(x[d], HALF ? 0 : lo[d], HALF ? 0 : step[d], static_cast<C const *>(nullptr));
+            }
+            uint32_t slot = rows.append(row);
+            for (unsigned d = 0; d < D; ++d) {
+                float v = decode(slot, d);
+                norm += v * v;
+            }
+            rows.set_norm(slot, norm);
+            return slot;
+        }
+
+        // <x,x> of the decoded row
+        float norm (size_t i) const {
+            return rows.norm(i);
+        }
+
+        void prefetch (size_t i) const {
+            rows.prefetch(i);
+        }
+
+        // for dot(): <q, lo> + <q * step, c>
+        void prepare_dot (float const *q, Query *out) const {
+            out->bias = 0;
+            for (unsigned d = 0; d < D; ++d) {
+                if (HALF) {
+                    out->v[d] = q[d];
+                }
+                else {
+                    out->v[d] = q[d] * step[d];
+                    out->bias += q[d] * lo[d];
+                }
+            }
+        }
+
+        // for l1(): sum of step |(q - lo) / step - c|, constant
+        // dimensions go to the bias
+        void prepare_l1 (float const *q, Query *out) const {
+            out->bias = 0;
+            for (unsigned d = 0; d < D; ++d) {
+                if (HALF) {
+                    out->v[d] = q[d];
+                }
+                else if (step[d] > 0) {
+                    out->v[d] = (q[d] - lo[d]) / step[d];
+                    out->w[d] = step[d];
+                }
+                else {
+                    out->v[d] = out->w[d] = 0;
+                    out->bias += std::abs(q[d] - lo[d]);
+                }
+            }
+        }
+
+        // out[i] = <query, decoded row slots[i]>
+        void dot (Query const &q, uint32_t const *slots, unsigned n, float *out) const {
+            C const *ptrs[BATCH];
+            for (unsigned i = 0; i < n; i += BATCH) {
+                unsigned m = n - i;
+                if (m > BATCH) m = BATCH;
+                for (unsigned j = 0; j < m; ++j) {
+                    ptrs[j] = rows.at(slots[i + j])->data;
+                }
+                dot_many(q.v, ptrs, m, out + i);
+            }
+            for (unsigned i = 0; i < n; ++i) {
+                out[i] += q.bias;
+            }
+        }
+
+        // out[i] = L1 distance of the query to decoded row slots[i]
+        void l1 (Query const &q, uint32_t const *slots, unsigned n, float *out) const {
+            C const *ptrs[BATCH];
+            for (unsigned i = 0; i < n; i += BATCH) {
+                unsigned m = n - i;
+                if (m > BATCH) m = BATCH;
+                for (unsigned j = 0; j < m; ++j) {
+                    ptrs[j] = rows.at(slots[i + j])->data;
+                }
+                l1_many(q.v, q.w, ptrs, m, out + i);
+            }
+            for (unsigned i = 0; i < n; ++i) {
+                out[i] += q.bias;
+            }
+        }
+
+        // row i <- row slots[i] for i < m, see FeatureArena::permute
+        void permute (uint32_t const *slots, size_t m) {
+            rows.permute(slots, m);
+        }
+
+        // drop all rows and ranges, give memory back
+        void clear () {
+            rows.clear();
+            vector<float>().swap(lo);
+            vector<float>().swap(step);
+        }
+    };
+}
+
+#endif
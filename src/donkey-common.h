@@ -2,19 +2,25 @@
 #define AAALGO_DONKEY_COMMON
 
 #include <array>
+#include <cmath>
+#include <limits>
 #include <algorithm>
 #include <iostream>
 #include <type_traits>
+#include "donkey-simd.h"
 // common feature and objects
 
 namespace donkey {
 
+    // rank maps similarity values to the domain indexes rank in,
+    // see the cached-norm forms below.
     struct PositiveSimilarity {
         static constexpr int POLARITY = 1;
         struct Params {
             void decode (string const &) {}
             string encode () const {return "";}
         };
+        static float rank (float v) { return v; }
     };
 
     struct NegativeSimilarity {
@@ -23,6 +29,7 @@ namespace donkey {
             void decode (string const &) {}
             string encode () const {return "";}
         };
+        static float rank (float v) { return v; }
     };
 
     template <typename T, unsigned D>
@@ -46,20 +53,342 @@ namespace donkey {
         static unsigned constexpr BITS = B;
     };
 
+    // Vector kernels used by the similarities below.
+    // The generic version is plain scalar code; float vectors are
+    // routed to the SIMD kernels picked at startup (see donkey-simd.h).
+    template <typename T>
+    struct VectorKernels {
+        static float l1 (T const *v1, T const *v2, unsigned D) {
+            double v = 0;
+            for (unsigned i = 0; i < D; ++i) {
+                double a = std::abs(v1[i] - v2[i]);
+                v += a;
+            }
+            return v;
+        }
+
+        static float l2sqr (T const *v1, T const *v2, unsigned D) {
+            double v = 0.0;
+            for (unsigned i = 0; i < D; ++i) {
+                double a = v1[i] - v2[i];
+                v += a * a;
+            }
+            return v;
+        }
+
+        // early abandoning forms, see the SIMD kernels
+        static float l1_bounded (T const *v1, T const *v2, unsigned D, float bound) {
+            double v = 0;
+            for (unsigned i = 0; i < D; ++i) {
+                v += std::abs(v1[i] - v2[i]);
+                if (i % 128 == 127 && v > bound) break;
+            }
+            return v;
+        }
+
+        static float l2sqr_bounded (T const *v1, T const *v2, unsigned D, float bound) {
+            double v = 0.0;
+            for (unsigned i = 0; i < D; ++i) {
+                double a = v1[i] - v2[i];
+                v += a * a;
+                if (i % 128 == 127 && v > bound) break;
+            }
+            return v;
+        }
+
+        static float dot (T const *v1, T const *v2, unsigned D) {
+            float v = 0.0f;
+            for (unsigned i = 0; i < D; ++i) {
+                v += v1[i] * v2[i];
+            }
+            return v;
+        }
+
+        static void dot_norms (T const *v1, T const *v2, unsigned D, float *out) {
+            float v = 0.0f;
+            float m1 = 0.0f, m2 = 0.0f;
+            for (unsigned i = 0; i < D; ++i) {
+                v  += v1[i] * v2[i];
+                m1 += v1[i] * v1[i];
+                m2 += v2[i] * v2[i];
+            }
+            out[0] = v;
+            out[1] = m1;
+            out[2] = m2;
+        }
+
+        // batched forms: one query against the features x[0..n)
+        template <typename F>
+        static void l1_many (T const *q, F const *const *x, unsigned n, unsigned D, float *out) {
+            for (unsigned i = 0; i < n; ++i) {
+                out[i] = l1(q, &x[i]->data[0], D);
+            }
+        }
+
+        template <typename F>
+        static void l2sqr_many (T const *q, F const *const *x, unsigned n, unsigned D, float *out) {
+            for (unsigned i = 0; i < n; ++i) {
+                out[i] = l2sqr(q, &x[i]->data[0], D);
+            }
+        }
+
+        template <typename F>
+        static void dot_many (T const *q, F const *const *x, unsigned n, unsigned D, float *out) {
+            for (unsigned i = 0; i < n; ++i) {
+                out[i] = dot(q, &x[i]->data[0], D);
+            }
+        }
+
+        // raw cosine, not checked for degenerated vectors
+        template <typename F>
+        static void cosine_many (T const *q, F const *const *x, unsigned n, unsigned D, float *out) {
+            for (unsigned i = 0; i < n; ++i) {
+                float r[3];
+                dot_norms(q, &x[i]->data[0], D, r);
+                out[i] = r[0] / (std::sqrt(r[1]) * std::sqrt(r[2]));
+            }
+        }
+    };
+
+    template <>
+    struct VectorKernels<float> {
+        // feature pointers are translated to data pointers
+        // in chunks of this size for the batched kernels
+        static unsigned constexpr BATCH = 64;
+
+        template <typename F>
+        static void batch (void (*kernel) (float const *, float const *const *, unsigned, unsigned, float *),
+                           float const *q, F const *const *x, unsigned n, unsigned D, float *out) {
+            float const *ptrs[BATCH];
+            for (unsigned i = 0; i < n; i += BATCH) {
+                unsigned m = n - i;
+                if (m > BATCH) m = BATCH;
+                for (unsigned j = 0; j < m; ++j) {
+                    ptrs[j] = &x[i + j]->data[0];
+                }
+                kernel(q, ptrs, m, D, out + i);
+            }
+        }
+
+        static float l1 (float const *v1, float const *v2, unsigned D) {
+            return simd::active->l1(v1, v2, D);
+        }
+
+        static float l2sqr (float const *v1, float const *v2, unsigned D) {
+            return simd::active->l2sqr(v1, v2, D);
+        }
+
+        static float l1_bounded (float const *v1, float const *v2, unsigned D, float bound) {
+            return simd::active->l1_bounded(v1, v2, D, bound);
+        }
+
+        static float l2sqr_bounded (float const *v1, float const *v2, unsigned D, float bound) {
+            return simd::active->l2sqr_bounded(v1, v2, D, bound);
+        }
+
+        static float dot (float const *v1, float const *v2, unsigned D) {
+            return simd::active->dot(v1, v2, D);
+        }
+
+        static void dot_norms (float const *v1, float const *v2, unsigned D, float *out) {
+            simd::active->dot_norms(v1, v2, D, out);
+        }
+
+        template <typename F>
+        static void l1_many (float const *q, F const *const *x, unsigned n, unsigned D, float *out) {
+            batch(simd::active->l1_many, q, x, n, D, out);
+        }
+
+        template <typename F>
+        static void l2sqr_many (float const *q, F const *const *x, unsigned n, unsigned D, float *out) {
+            batch(simd::active->l2sqr_many, q, x, n, D, out);
+        }
+
+        template <typename F>
+        static void dot_many (float const *q, F const *const *x, unsigned n, unsigned D, float *out) {
+            batch(simd::active->dot_many, q, x, n, D, out);
+        }
+
+        template <typename F>
+        static void cosine_many (float const *q, F const *const *x, unsigned n, unsigned D, float *out) {
+            batch(simd::active->cosine_many, q, x, n, D, out);
+        }
+    };
+
+    // Every similarity provides, besides the pairwise
+    //
+    //      static float apply (feature_type const &, feature_type const &, Params const &);
+    //
+    // a batched form used by the index scan loops:
+    //
+    //      template <typename F>
+    //      static void apply_many (feature_type const &query, F const *const *features,
+    //                              unsigned n, Params const &, float *dists);
+    //
+    // where F is feature_type or a type derived from it.
+    //
+    // Indexes cache one float per stored feature, computed by
+    //
+    //      static float norm (feature_type const &);
+    //
+    // (<x,x> for vector spaces, 0 where it is of no use), and evaluate
+    // with the cached values through
+    //
+    //      static float apply (feature_type const &, float norm1,
+    //                          feature_type const &, float norm2, Params const &);
+    //      template <typename F>
+    //      static void apply_many (feature_type const &query, float query_norm,
+    //                              F const *const *features, float const *norms,
+    //                              unsigned n, Params const &, float *dists);
+    //
+    // The query norm is computed once per search.
+    //
+    // The cached-norm forms return rank(value), where rank is a
+    // monotone map chosen by the similarity (identity unless said
+    // otherwise).  Index search compares, thresholds (after rank(R))
+    // and selects top K in the rank domain; only the reported matches
+    // are evaluated again with the exact pairwise apply().
+    //
+    // Distances summed over the dimensions (L1, L2, Hamming and
+    // TypeHamming) can also abandon an evaluation early:
+    //
+    //      static float apply_bounded (feature_type const &, feature_type const &,
+    //                                  Params const &, float bound);
+    //      static float apply_bounded (feature_type const &, float norm1,
+    //                                  feature_type const &, float norm2,
+    //                                  Params const &, float bound);
+    //
+    // return the exact value if it is <= bound, and otherwise some
+    // value > bound as soon as the partial sum exceeds it.  The
+    // cached-norm form takes and returns the rank domain.  See
+    // apply_many_bounded for the scan loops.
+    //
+    // Only the pairwise apply is required, plugin similarities may
+    // leave out the other forms.  Indexes call them through
+    // SimilarityOps<S>, which falls back to apply_each, a norm of 0 and
+    // rank(apply) where S doesn't have them.
+    template <typename S, typename F>
+    void apply_each (typename S::feature_type const &query, F const *const *features, unsigned n, typename S::Params const &params, float *dists) {
+        for (unsigned i = 0; i < n; ++i) {
+            dists[i] = S::apply(*features[i], query, params);
+        }
+    }
+
+    template <typename S>
+    class SimilarityOps {
+        typedef typename S::feature_type feature_type;
+        typedef typename S::Params Params;
+
+        // the int overloads are preferred, and dropped if S lacks the
+        // form; T is S, as a parameter of the overload for SFINAE
+        template <typename T, typename F>
+        static auto apply_many (int, feature_type const &query, F const *const *features, unsigned n, Params const &params, float *dists)
+            -> decltype(T::apply_many(query, features, n, params, dists), void()) {
+            T::apply_many(query, features, n, params, dists);
+        }
+
+        template <typename T, typename F>
+        static void apply_many (long, feature_type const &query, F const *const *features, unsigned n, Params const &params, float *dists) {
+            apply_each<S>(query, features, n, params, dists);
+        }
+
+        template <typename T>
+        static auto norm (int, feature_type const &v) -> decltype(float(T::norm(v))) {
+            return T::norm(v);
+        }
+
+        template <typename T>
+        static float norm (long, feature_type const &) {
+            return 0;
+        }
+
+        template <typename T>
+        static auto apply (int, feature_type const &v1, float norm1, feature_type const &v2, float norm2, Params const &params)
+            -> decltype(float(T::apply(v1, norm1, v2, norm2, params))) {
+            return T::apply(v1, norm1, v2, norm2, params);
+        }
+
+        template <typename T>
+        static float apply (long, feature_type const &v1, float, feature_type const &v2, float, Params const &params) {
+            return S::rank(S::apply(v1, v2, params));
+        }
+
+        template <typename T, typename F>
+        static auto apply_many (int, feature_type const &query, float query_norm, F const *const *features, float const *norms, unsigned n, Params const &params, float *dists)
+            -> decltype(T::apply_many(query, query_norm, features, norms, n, params, dists), void()) {
+            T::apply_many(query, query_norm, features, norms, n, params, dists);
+        }
+
+        template <typename T, typename F>
+        static void apply_many (long, feature_type const &query, float, F const *const *features, float const *, unsigned n, Params const &params, float *dists) {
+            apply_many<S>(0, query, features, n, params, dists);
+            for (unsigned i = 0; i < n; ++i) {
+                dists[i] = S::rank(dists[i]);
+            }
+        }
+
+    public:
+        static float apply (feature_type const &v1, feature_type const &v2, Params const &params) {
+            return S::apply(v1, v2, params);
+        }
+
+        template <typename F>
+        static void apply_many (feature_type const &query, F const *const *features, unsigned n, Params const &params, float *dists) {
+            apply_many<S>(0, query, features, n, params, dists);
+        }
+
+        static float norm (feature_type const &v) {
+            return norm<S>(0, v);
+        }
+
+        static float apply (feature_type const &v1, float norm1, feature_type const &v2, float norm2, Params const &params) {
+            return apply<S>(0, v1, norm1, v2, norm2, params);
+        }
+
+        template <typename F>
+        static void apply_many (feature_type const &query, float query_norm, F const *const *features, float const *norms, unsigned n, Params const &params, float *dists) {
+            apply_many<S>(0, query, query_norm, features, norms, n, params, dists);
+        }
+    };
+
     template <typename T, unsigned D>
     struct Cosine: public PositiveSimilarity {
         typedef VectorFeature<T,D> feature_type;
         static float apply (feature_type const &v1, feature_type const &v2, Params const &params) {
-            float v = 0.0f;
-            float m1 = 0.0f, m2 = 0.0f;
-            for (unsigned i = 0; i < D; ++i) {
-                v  += v1.data[i] * v2.data[i];
-                m1 += v1.data[i] * v1.data[i];
-                m2 += v2.data[i] * v2.data[i];
-             }
-             v /= (std::sqrt(m1) * std::sqrt(m2));
-             if(std::isnormal(v)) return v;
-             else return -1.0f;
+            float r[3];
+            VectorKernels<T>::dot_norms(&v1.data[0], &v2.data[0], D, r);
+            float v = r[0] / (std::sqrt(r[1]) * std::sqrt(r[2]));
+            if(std::isnormal(v)) return v;
+            else return -1.0f;
+        }
+
+        template <typename F>
+        static void apply_many (feature_type const &query, F const *const *features, unsigned n, Params const &, float *dists) {
+            VectorKernels<T>::cosine_many(&query.data[0], features, n, D, dists);
+            for (unsigned i = 0; i < n; ++i) {
+                if (!std::isnormal(dists[i])) dists[i] = -1.0f;
+            }
+        }
+
+        static float norm (feature_type const &v) {
+            return VectorKernels<T>::dot(&v.data[0], &v.data[0], D);
+        }
+
+        // with cached norms cosine is a single dot product
+        static float apply (feature_type const &v1, float norm1, feature_type const &v2, float norm2, Params const &) {
+            float v = VectorKernels<T>::dot(&v1.data[0], &v2.data[0], D) / (std::sqrt(norm1) * std::sqrt(norm2));
+            if(std::isnormal(v)) return v;
+            else return -1.0f;
+        }
+
+        template <typename F>
+        static void apply_many (feature_type const &query, float query_norm, F const *const *features, float const *norms, unsigned n, Params const &, float *dists) {
+            VectorKernels<T>::dot_many(&query.data[0], features, n, D, dists);
+            float q = std::sqrt(query_norm);
+            for (unsigned i = 0; i < n; ++i) {
+                float v = dists[i] / (q * std::sqrt(norms[i]));
+                dists[i] = std::isnormal(v) ? v : -1.0f;
+            }
         }
     };
 
@@ -71,26 +400,105 @@ namespace donkey {
         struct L1: public Distance {
             typedef VectorFeature<T,D> feature_type;
             static float apply (feature_type const &v1, feature_type const &v2, Params const &params) {
-                double v = 0;
-                for (unsigned i = 0; i < D; ++i) {
-                    double a = std::abs(v1.data[i] - v2.data[i]);
-                    v += a;
-                }
-                return v;
+                return VectorKernels<T>::l1(&v1.data[0], &v2.data[0], D);
+            }
+
+            template <typename F>
+            static void apply_many (feature_type const &query, F const *const *features, unsigned n, Params const &params, float *dists) {
+                VectorKernels<T>::l1_many(&query.data[0], features, n, D, dists);
+            }
+
+            static float norm (feature_type const &) {
+                return 0;
+            }
+
+            static float apply (feature_type const &v1, float, feature_type const &v2, float, Params const &params) {
+                return apply(v1, v2, params);
+            }
+
+            template <typename F>
+            static void apply_many (feature_type const &query, float, F const *const *features, float const *, unsigned n, Params const &params, float *dists) {
+                apply_many(query, features, n, params, dists);
+            }
+
+            static float apply_bounded (feature_type const &v1, feature_type const &v2, Params const &params, float bound) {
+                return VectorKernels<T>::l1_bounded(&v1.data[0], &v2.data[0], D, bound);
+            }
+
+            static float apply_bounded (feature_type const &v1, float, feature_type const &v2, float, Params const &params, float bound) {
+                return apply_bounded(v1, v2, params, bound);
             }
         };
 
-        template <typename T, unsigned D>
+        // With SQUARED (default) L2 ranks by the squared distance, so
+        // searching never takes a square root except for the reported
+        // matches.  Ordering, and thus search results, are unaffected.
+        template <typename T, unsigned D, bool SQUARED = true>
         struct L2: public Distance {
             typedef VectorFeature<T,D> feature_type;
             static float apply (feature_type const &v1, feature_type const &v2, Params const &params) {
-                double v = 0.0;
-                for (unsigned i = 0; i < D; ++i) {
-                    double a = v1.data[i] - v2.data[i];
-                    v += a * a;
+                return std::sqrt(VectorKernels<T>::l2sqr(&v1.data[0], &v2.data[0], D));
+            }
+
+            template <typename F>
+            static void apply_many (feature_type const &query, F const *const *features, unsigned n, Params const &, float *dists) {
+                VectorKernels<T>::l2sqr_many(&query.data[0], features, n, D, dists);
+                for (unsigned i = 0; i < n; ++i) {
+                    dists[i] = std::sqrt(dists[i]);
+                }
+            }
+
+            static float norm (feature_type const &v) {
+                return VectorKernels<T>::dot(&v.data[0], &v.data[0], D);
+            }
+
+            // sign is kept so negative thresholds still reject everything
+            static float rank (float v) {
+                return SQUARED ? v * std::abs(v) : v;
+            }
+
+            // pairwise evaluation doesn't gain from the norms
+            static float apply (feature_type const &v1, float, feature_type const &v2, float, Params const &) {
+                float v = VectorKernels<T>::l2sqr(&v1.data[0], &v2.data[0], D);
+                return SQUARED ? v : std::sqrt(v);
+            }
+
+            // nor does the batched one, unless simd::l2_dot_expansion
+            // is set: expanding |q-x|^2 into |q|^2 + |x|^2 - 2<q,x>
+            // loses the small distances to cancellation, and thus may
+            // change which are the nearest
+            template <typename F>
+            static void apply_many (feature_type const &query, float query_norm, F const *const *features, float const *norms, unsigned n, Params const &, float *dists) {
+                if (simd::l2_dot_expansion) {
+                    VectorKernels<T>::dot_many(&query.data[0], features, n, D, dists);
+                    for (unsigned i = 0; i < n; ++i) {
+                        float v = query_norm + norms[i] - 2 * dists[i];
+                        if (!(v > 0)) v = 0;    // clamped against rounding
+                        dists[i] = SQUARED ? v : std::sqrt(v);
+                    }
+                    return;
+                }
+                VectorKernels<T>::l2sqr_many(&query.data[0], features, n, D, dists);
+                if (!SQUARED) {
+                    for (unsigned i = 0; i < n; ++i) {
+                        dists[i] = std::sqrt(dists[i]);
+                    }
+                }
+            }
+
+            static float apply_bounded (feature_type const &v1, feature_type const &v2, Params const &params, float bound) {
+                float b = bound > 0 ? bound * bound : 0;
+                float v = VectorKernels<T>::l2sqr_bounded(&v1.data[0], &v2.data[0], D, b);
+                if (v > b) {    // rounding must not bring it back to bound
+                    return std::max(std::sqrt(v), std::nextafter(bound, std::numeric_limits<float>::infinity()));
                 }
                 return std::sqrt(v);
             }
+
+            static float apply_bounded (feature_type const &v1, float, feature_type const &v2, float, Params const &params, float bound) {
+                if (!SQUARED) return apply_bounded(v1, v2, params, bound);
+                return VectorKernels<T>::l2sqr_bounded(&v1.data[0], &v2.data[0], D, bound);
+            }
         };
 
 
@@ -112,12 +520,63 @@ namespace donkey {
             return v;
         }
 
+        // Batched Hamming distance with the SIMD kernel, which sees the
+        // features as arrays of 32-bit words whatever the chunk type.
+        template <typename T, unsigned D, typename F>
+        void hamming_many (VectorFeature<T, D> const &query, F const *const *x, unsigned n, float *out) {
+            static_assert(sizeof(T) * D % sizeof(uint32_t) == 0, "bit vector must be made of 32-bit words");
+            unsigned constexpr WORDS = sizeof(T) * D / sizeof(uint32_t);
+            unsigned constexpr BATCH = 64;
+            uint32_t const *q = reinterpret_cast<uint32_t const *>(&query.data[0]);
+            uint32_t const *ptrs[BATCH];
+            for (unsigned i = 0; i < n; i += BATCH) {
+                unsigned m = n - i;
+                if (m > BATCH) m = BATCH;
+                for (unsigned j = 0; j < m; ++j) {
+                    ptrs[j] = reinterpret_cast<uint32_t const *>(&x[i + j]->data[0]);
+                }
+                simd::active->hamming_many(q, ptrs, m, WORDS, out + i);
+            }
+        }
+
         template <typename T, unsigned D>
         struct Hamming: public Distance {
             typedef VectorFeature<T, D> feature_type;
             static float apply (feature_type const &v1, feature_type const &v2, Params const &params) {
                 return hamming_with_popcount<D>(&v1.data[0], &v2.data[0]);
             }
+
+            template <typename F>
+            static void apply_many (feature_type const &query, F const *const *features, unsigned n, Params const &, float *dists) {
+                hamming_many(query, features, n, dists);
+            }
+
+            static float norm (feature_type const &) {
+                return 0;
+            }
+
+            static float apply (feature_type const &v1, float, feature_type const &v2, float, Params const &params) {
+                return apply(v1, v2, params);
+            }
+
+            template <typename F>
+            static void apply_many (feature_type const &query, float, F const *const *features, float const *, unsigned n, Params const &params, float *dists) {
+                apply_many(query, features, n, params, dists);
+            }
+
+            static float apply_bounded (feature_type const &v1, feature_type const &v2, Params const &params, float bound) {
+                unsigned constexpr BITS = sizeof(T) * 8;
+                int v = 0;
+                for (unsigned i = 0; i < D; ++i) {
+                    v += hamming_with_popcount<1>(&v1.data[i], &v2.data[i]);
+                    if (i % (1024 / BITS) == 1024 / BITS - 1 && v > bound) break;
+                }
+                return v;
+            }
+
+            static float apply_bounded (feature_type const &v1, float, feature_type const &v2, float, Params const &params, float bound) {
+                return apply_bounded(v1, v2, params, bound);
+            }
         };
 
         template <typename T, unsigned D>
@@ -132,9 +591,104 @@ namespace donkey {
                 }
                 return v;
             }
+
+            template <typename F>
+            static void apply_many (feature_type const &query, F const *const *features, unsigned n, Params const &params, float *dists) {
+                apply_each<TypeHamming<T, D>>(query, features, n, params, dists);
+            }
+
+            static float norm (feature_type const &) {
+                return 0;
+            }
+
+            static float apply (feature_type const &v1, float, feature_type const &v2, float, Params const &params) {
+                return apply(v1, v2, params);
+            }
+
+            template <typename F>
+            static void apply_many (feature_type const &query, float, F const *const *features, float const *, unsigned n, Params const &params, float *dists) {
+                apply_many(query, features, n, params, dists);
+            }
+
+            static float apply_bounded (feature_type const &v1, feature_type const &v2, Params const &params, float bound) {
+                int v = 0;
+                for (unsigned i = 0; i < D; ++i) {
+                    if (v1.data[i] != v2.data[i]) {
+                        ++v;
+                    }
+                    if (i % 128 == 127 && v > bound) break;
+                }
+                return v;
+            }
+
+            static float apply_bounded (feature_type const &v1, float, feature_type const &v2, float, Params const &params, float bound) {
+                return apply_bounded(v1, v2, params, bound);
+            }
         };
     }
 
+    // Float vector similarities by kind, for indexes working on
+    // approximations of the vectors (quantization, product codes).
+    // Only used in decltype, dispatch is by overloading on the
+    // similarity type like the LSH families.
+    enum {
+        VECTOR_NONE = 0,
+        VECTOR_L2 = 1,
+        VECTOR_L1 = 2,
+        VECTOR_COSINE = 3
+    };
+
+    template <unsigned D, bool S>
+    std::integral_constant<int, VECTOR_L2> vector_metric (distance::L2<float, D, S> const *);
+    template <unsigned D>
+    std::integral_constant<int, VECTOR_L1> vector_metric (distance::L1<float, D> const *);
+    template <unsigned D>
+    std::integral_constant<int, VECTOR_COSINE> vector_metric (Cosine<float, D> const *);
+    std::integral_constant<int, VECTOR_NONE> vector_metric (void const *);
+
+    // Early abandoning only pays off for long sums, shorter ones are
+    // faster with the batched kernels across features.  Only used in
+    // decltype.
+    static constexpr unsigned EARLY_ABANDON_MIN_DIM = 128;
+
+    template <unsigned D, bool S>
+    std::integral_constant<bool, (D >= EARLY_ABANDON_MIN_DIM)> early_abandon (distance::L2<float, D, S> const *);
+    template <unsigned D>
+    std::integral_constant<bool, (D >= EARLY_ABANDON_MIN_DIM)> early_abandon (distance::L1<float, D> const *);
+    std::false_type early_abandon (void const *);
+
+    template <typename S, typename F>
+    void apply_many_bounded (typename S::feature_type const &query, float, F const *const *features, float const *,
+                             unsigned n, typename S::Params const &params, float bound, float *dists, std::true_type) {
+        for (unsigned i = 0; i < n; ++i) {
+            if (i + 1 < n) {    // the head of the next row, abandoned rows leave no stream to follow
+                char const *p = reinterpret_cast<char const *>(features[i + 1]);
+                __builtin_prefetch(p);
+                __builtin_prefetch(p + 64);
+                __builtin_prefetch(p + 128);
+                __builtin_prefetch(p + 192);
+            }
+            dists[i] = S::apply_bounded(query, 0, *features[i], 0, params, bound);
+        }
+    }
+
+    template <typename S, typename F>
+    void apply_many_bounded (typename S::feature_type const &query, float query_norm, F const *const *features, float const *norms,
+                             unsigned n, typename S::Params const &params, float, float *dists, std::false_type) {
+        SimilarityOps<S>::apply_many(query, query_norm, features, norms, n, params, dists);
+    }
+
+    // The cached-norm apply_many of S for scans with a running rank
+    // domain bound: dists[i] is exact if <= bound, otherwise some value
+    // > bound.  Where early_abandon says so the features are evaluated
+    // one by one with apply_bounded, else all in full.
+    template <typename S, typename F>
+    void apply_many_bounded (typename S::feature_type const &query, float query_norm, F const *const *features, float const *norms,
+                             unsigned n, typename S::Params const &params, float bound, float *dists) {
+        apply_many_bounded<S>(query, query_norm, features, norms, n, params, bound, dists,
+                              decltype(early_abandon(static_cast<S const *>(nullptr)))());
+    }
+
     template <typename T>
     struct SingleFeatureObject: public ObjectBase {
         typedef T feature_type;
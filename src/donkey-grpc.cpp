@@ -56,6 +56,7 @@ public:
         req.R = request->r();
         req.hint_K = request->hint_k();
         req.hint_R = request->hint_r();
+        req.hint_P = request->hint_p();
 
         SearchResponse resp;
 
@@ -167,6 +168,7 @@ public:
         req.set_r(request.R);
         req.set_hint_k(request.hint_K);
         req.set_hint_r(request.hint_R);
+        req.set_hint_p(request.hint_P);
         stub->search(&context, req, &resp);
         response->time = resp.time();
         response->load_time = resp.load_time();
@@ -90,6 +90,7 @@ class DonkeyHandler: public SimpleWeb::Multiplexer {
                 LOAD_PARAM(request, req, R, number_value, NAN);
                 LOAD_PARAM(request, req, hint_K, int_value, -1);
                 LOAD_PARAM(request, req, hint_R, number_value, NAN);
+                LOAD_PARAM(request, req, hint_P, int_value, -1);
                 string params_l1;
                 LOAD_PARAM1(request, params_l1, params_l1, string_value, "");
                 req.params_l1.decode(params_l1);
@@ -129,7 +130,10 @@ class DonkeyHandler: public SimpleWeb::Multiplexer {
                 server->stat(req, &resp);
                 response = Json::object{
                     {"size", resp.size},
-                    {"last", resp.last}};
+                    {"last", resp.last},
+                    {"rebuild", resp.rebuild},
+                    {"rebuild_progress", resp.rebuild_progress},
+                    {"rebuild_time", resp.rebuild_time}};
           });
         add_json_api("/fetch", "POST", [this](Json &response, Json &request) {
                 FetchRequest req;
@@ -195,6 +199,7 @@ class DonkeyHandler: public SimpleWeb::Multiplexer {
                 LOAD_PARAM(request, req, R, number_value, NAN);
                 LOAD_PARAM(request, req, hint_K, int_value, -1);
                 LOAD_PARAM(request, req, hint_R, number_value, NAN);
+                LOAD_PARAM(request, req, hint_P, int_value, -1);
                 string params_l1;
                 LOAD_PARAM1(request, params_l1, params_l1, string_value, "");
                 req.params_l1.decode(params_l1);
@@ -404,6 +409,9 @@ public:
                     };
             invoke("/stat", input, &output);
             LOAD_PARAM(output, (*response), size, int_value, 0);
+            LOAD_PARAM(output, (*response), rebuild, string_value, "");
+            LOAD_PARAM(output, (*response), rebuild_progress, number_value, 0);
+            LOAD_PARAM(output, (*response), rebuild_time, number_value, 0);
             response->last.clear();
             for (auto const &h: output["last"].array_items()) {
                 response->last.push_back(h.string_value());
@@ -426,6 +434,7 @@ public:
                     {"R", request.R},
                     {"hint_K", request.hint_K},
                     {"hint_R", request.hint_R},
+                    {"hint_P", request.hint_P},
                     {"params_l1", request.params_l1.encode()}
                     //{"params_l2", request.params_l2}
                     };
@@ -0,0 +1,140 @@
+#ifndef AAALGO_DONKEY_POOL
+#define AAALGO_DONKEY_POOL
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <exception>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <condition_variable>
+
+namespace donkey {
+
+    // Worker threads shared by all requests for intra-query
+    // parallelism.  run() posts a job of n parts and works on it too,
+    // so a job always makes progress even with every worker busy on
+    // the jobs of other requests, and the number of threads stays
+    // bounded however many requests run at once.
+    class WorkerPool {
+        struct Job {
+            std::function<void (unsigned)> const *fn;
+            unsigned n;
+            std::atomic<unsigned> next;     // next part to claim
+            std::atomic<unsigned> done;     // parts finished
+            unsigned users;                 // workers on the job, under mutex
+            std::atomic<bool> failed;       // parts left are skipped
+            std::exception_ptr error;       // the first thrown, set once
+        };
+
+        std::mutex mutex;
+        std::condition_variable work_cv;
+        std::condition_variable done_cv;
+        std::deque<Job *> jobs;
+        std::vector<std::thread> threads;
+        bool stop;
+
+        static void work (Job *job) {
+            for (;;) {
+                unsigned i = job->next++;
+                if (i >= job->n) break;
+                if (!job->failed) {
+                    try {
+                        (*job->fn)(i);
+                    }
+                    catch (...) {
+                        if (!job->failed.exchange(true)) {
+                            job->error = std::current_exception();
+                        }
+                    }
+                }
+                ++job->done;
+            }
+        }
+
+        void loop () {
+            std::unique_lock<std::mutex> lock(mutex);
+            for (;;) {
+                work_cv.wait(lock, [this]() { return stop || !jobs.empty(); });
+                if (stop) return;
+                Job *job = jobs.front();
+                if (job->next >= job->n) {  // all parts claimed
+                    jobs.pop_front();
+                    continue;
+                }
+                ++job->users;
+                lock.unlock();
+                work(job);
+                lock.lock();
+                --job->users;
+                done_cv.notify_all();
+            }
+        }
+
+    public:
+        WorkerPool (unsigned n): stop(false) {
+            for (unsigned i = 0; i < n; ++i) {
+                threads.emplace_back([this]() { loop(); });
+            }
+        }
+
+        ~WorkerPool () {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+            }
+            work_cv.notify_all();
+            for (auto &t: threads) {
+                t.join();
+            }
+        }
+
+        WorkerPool (WorkerPool const &) = delete;
+        WorkerPool &operator = (WorkerPool const &) = delete;
+
+        // threads working on a job, the caller included
+        unsigned concurrency () const {
+            return threads.size() + 1;
+        }
+
+        // Call fn(0), ..., fn(n - 1) on the workers and the calling
+        // thread, return when all are done.  If one throws, the parts
+        // not started are skipped and the first exception is rethrown
+        // here once every part has ended.
+        void run (unsigned n, std::function<void (unsigned)> const &fn) {
+            if (threads.empty() || n <= 1) {
+                for (unsigned i = 0; i < n; ++i) fn(i);
+                return;
+            }
+            Job job;
+            job.fn = &fn;
+            job.n = n;
+            job.next = 0;
+            job.done = 0;
+            job.users = 0;
+            job.failed = false;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                jobs.push_back(&job);
+            }
+            work_cv.notify_all();
+            work(&job);
+            std::unique_lock<std::mutex> lock(mutex);
+            done_cv.wait(lock, [&job]() { return job.done == job.n && job.users == 0; });
+            auto it = std::find(jobs.begin(), jobs.end(), &job);
+            if (it != jobs.end()) jobs.erase(it);
+            if (job.error) std::rethrow_exception(job.error);
+        }
+
+        // The process-wide pool, with threads - 1 workers as created by
+        // the first call.
+        static WorkerPool &shared (unsigned threads) {
+            static WorkerPool pool(threads > 1 ? threads - 1 : 0);
+            return pool;
+        }
+    };
+}
+
+#endif
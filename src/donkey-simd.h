@@ -0,0 +1,128 @@
+#ifndef AAALGO_DONKEY_SIMD
+#define AAALGO_DONKEY_SIMD
+
+// SIMD distance kernels.
+//
+// Each supported instruction set provides a full table of kernels;
+// the best table the CPU supports is picked once at startup and
+// installed in simd::active.  All kernels take unaligned pointers and
+// handle any dimension n.
+
+#include <stdint.h>
+#include <string.h>
+
+namespace donkey {
+    namespace simd {
+
+        struct Kernels {
+            char const *name;
+            float (*l1) (float const *, float const *, unsigned n);
+            float (*l2sqr) (float const *, float const *, unsigned n);
+            float (*dot) (float const *, float const *, unsigned n);
+            // out[0] = <a,b>, out[1] = <a,a>, out[2] = <b,b>, in one pass
+            void (*dot_norms) (float const *a, float const *b, unsigned n, float *out);
+            // early abandoning l1 and l2sqr: blocks of dimensions are
+            // summed until the sum exceeds bound, so the result is exact
+            // if <= bound and some value > bound otherwise
+            float (*l1_bounded) (float const *, float const *, unsigned n, float bound);
+            float (*l2sqr_bounded) (float const *, float const *, unsigned n, float bound);
+            // batched forms, one query q against m vectors x[0..m),
+            // out[i] = f(q, x[i]).  The query stays in cache/registers and
+            // upcoming vectors are prefetched.
+            void (*l1_many) (float const *q, float const *const *x, unsigned m, unsigned n, float *out);
+            void (*l2sqr_many) (float const *q, float const *const *x, unsigned m, unsigned n, float *out);
+            void (*dot_many) (float const *q, float const *const *x, unsigned m, unsigned n, float *out);
+            // raw cosine <q,x>/(|q||x|), no check for degenerated vectors
+            void (*cosine_many) (float const *q, float const *const *x, unsigned m, unsigned n, float *out);
+            // Hamming distance of bit vectors of n 32-bit words, one query
+            // against m sketches.  Only the bits matter, so features made
+            // of 64-bit chunks are passed as 2n words.
+            void (*hamming_many) (uint32_t const *q, uint32_t const *const *x, unsigned m, unsigned n, float *out);
+            // 4-bit product quantization scan.  Codes come in blocks of
+            // 32 vectors, a block is m groups of 16 bytes, byte j of group
+            // k holding the code of sub-quantizer k for vector j in the low
+            // nibble and for vector j + 16 in the high one.  luts has 16
+            // entries per sub-quantizer; out[32 b + j] = sum over k of
+            // luts[16 k + code], m <= 257 so it never overflows.
+            void (*pq4_scan) (uint8_t const *codes, unsigned blocks, unsigned m, uint8_t const *luts, uint16_t *out);
+            // Quantized storage: a float query against m vectors of n
+            // half precision (IEEE binary16) or byte values.
+            void (*f16_dot_many) (float const *q, uint16_t const *const *x, unsigned m, unsigned n, float *out);
+            void (*f16_l1_many) (float const *q, uint16_t const *const *x, unsigned m, unsigned n, float *out);
+            // out[i] = sum of q[j] x[i][j]
+            void (*u8_dot_many) (float const *q, uint8_t const *const *x, unsigned m, unsigned n, float *out);
+            // out[i] = sum of w[j] |q[j] - x[i][j]|
+            void (*u8_l1_many) (float const *q, float const *w, uint8_t const *const *x, unsigned m, unsigned n, float *out);
+            // StreamVByte: out[i] <- the i-th of n 32-bit values stored
+            // little endian in 1 to 4 bytes each, consecutively from
+            // data, their lengths - 1 in the 2-bit fields of ctrl, four
+            // per byte from the low bits.  Return the number of data
+            // bytes used.  Up to SVB_PADDING bytes past them may be read.
+            unsigned (*svb_decode) (uint8_t const *ctrl, uint8_t const *data, unsigned n, uint32_t *out);
+        };
+
+        static constexpr unsigned SVB_PADDING = 16;
+
+        // binary16 conversion, rounding to nearest even
+        static inline uint16_t float_to_half (float f) {
+            uint32_t x;
+            memcpy(&x, &f, sizeof(x));
+            uint32_t sign = (x >> 16) & 0x8000;
+            uint32_t m = x & 0x7fffff;
+            int e = int((x >> 23) & 0xff) - 127 + 15;
+            if (e == 0xff - 127 + 15) {     // inf, nan
+                return sign | 0x7c00 | (m ? 0x200 : 0);
+            }
+            if (e >= 31) return sign | 0x7c00;
+            unsigned shift = 13;
+            uint32_t h;
+            if (e <= 0) {                   // subnormal
+                if (e < -10) return sign;
+                m |= 0x800000;
+                shift = 14 - e;
+                h = m >> shift;
+            }
+            else {
+                h = (uint32_t(e) << 10) | (m >> 13);
+            }
+            uint32_t rem = m & ((1u << shift) - 1);
+            uint32_t half = 1u << (shift - 1);
+            if (rem > half || (rem == half && (h & 1))) ++h;    // may carry into inf
+            return sign | h;
+        }
+
+        static inline float half_to_float (uint16_t h) {
+            uint32_t sign = uint32_t(h & 0x8000) << 16;
+            uint32_t e = (h >> 10) & 0x1f;
+            uint32_t m = h & 0x3ff;
+            if (e == 0) {
+                float v = m * (1.0f / 16777216);
+                return sign ? -v : v;
+            }
+            uint32_t x = sign | (e == 31 ? 0x7f800000 : (e + 112) << 23) | (m << 13);
+            float f;
+            memcpy(&f, &x, sizeof(f));
+            return f;
+        }
+
+        // kernel table selected by CPU detection, never null
+        extern Kernels const *active;
+
+        // L2 scans with cached norms evaluate |q|^2 + |x|^2 - 2<q,x>
+        // instead of the sum of squares (donkey.l2.dot_expansion, off
+        // by default).  Faster for long vectors, but the rounding may
+        // reorder the nearest neighbors.
+        extern bool l2_dot_expansion;
+
+        // return the kernel table of the given name
+        // ("scalar", "sse", "avx2", "avx512"), or nullptr if the name is
+        // unknown or not supported by this CPU.
+        Kernels const *lookup (char const *name);
+
+        // force a kernel table, mainly for benchmarking,
+        // return false if not supported.
+        bool select (char const *name);
+    }
+}
+
+#endif
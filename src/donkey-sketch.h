@@ -0,0 +1,281 @@
+#ifndef AAALGO_DONKEY_SKETCH
+#define AAALGO_DONKEY_SKETCH
+
+#include <random>
+#include <vector>
+#include <istream>
+#include <ostream>
+#include <algorithm>
+
+// Binary sketches of float vectors as a Hamming prefilter, included
+// after donkey.h by the indexes using it.
+
+namespace donkey {
+
+    // Bit b of the sketch of x is the sign of <a_b, x - c> for a
+    // Gaussian random a_b (Charikar, STOC 2002), so the Hamming distance
+    // of two sketches estimates the angle between the vectors seen
+    // from c.  c is the origin for cosine and the mean of the training
+    // features for L2 and L1, whose features are often all positive.
+    // A query ranks the sketches by Hamming distance with the SIMD
+    // kernel and only the best pool of them are left for exact
+    // evaluation.
+    //
+    // Features get their sketches in id order.  Appended features are
+    // held until the center is trained on the first donkey.sketch.train
+    // of them, or until finish() if the filter is deferred or there are
+    // fewer; held features are always candidates.  The feature data
+    // must stay valid while held.
+    //
+    // METRIC is a VECTOR_* kind of donkey-common.h; VECTOR_NONE gets a
+    // filter that keeps every feature, see below.
+    template <int METRIC, typename F>
+    class SketchFilter {
+        static unsigned constexpr D = F::DIM;
+        static unsigned constexpr BATCH = 64;
+        static uint64_t constexpr MAGIC = 0x31484b53;   // "SKH1"
+
+        unsigned words;             // 32-bit words per sketch
+        uint32_t seed;
+        size_t min_train;
+        std::vector<float> proj;    // words * 32 rows of D
+        std::vector<float> center;  // empty until trained
+        std::vector<uint32_t> sketches;
+        std::vector<float const *> held;    // features [sketched(), size())
+
+        bool trained () const {
+            return METRIC == VECTOR_COSINE || center.size();
+        }
+
+        void sketch (float const *x, uint32_t *out) const {
+            float y[D];
+            for (unsigned d = 0; d < D; ++d) {
+                y[d] = center.size() ? x[d] - center[d] : x[d];
+            }
+            for (unsigned w = 0; w < words; ++w) {
+                uint32_t v = 0;
+                for (unsigned b = 0; b < 32; ++b) {
+                    if (simd::active->dot(&proj[size_t(w * 32 + b) * D], y, D) >= 0) {
+                        v |= uint32_t(1) << b;
+                    }
+                }
+                out[w] = v;
+            }
+        }
+
+        void train () {
+            if (METRIC == VECTOR_COSINE) return;
+            std::vector<double> sum(D, 0);
+            for (auto x: held) {
+                for (unsigned d = 0; d < D; ++d) {
+                    sum[d] += x[d];
+                }
+            }
+            center.resize(D);
+            for (unsigned d = 0; d < D; ++d) {
+                center[d] = held.empty() ? 0 : sum[d] / held.size();
+            }
+        }
+
+        void flush () {
+            size_t first = sketches.size();
+            sketches.resize(first + held.size() * words);
+#pragma omp parallel for schedule(dynamic, 256)
+            for (size_t i = 0; i < held.size(); ++i) {
+                sketch(held[i], &sketches[first + i * words]);
+            }
+            std::vector<float const *>().swap(held);
+        }
+
+    public:
+        SketchFilter (Config const &config):
+            words(config.get<unsigned>("donkey.sketch.bits", 256) / 32),
+            seed(config.get<uint32_t>("donkey.sketch.seed", 2016)),
+            min_train(config.get<size_t>("donkey.sketch.train", 10000)),
+            proj(size_t(words) * 32 * D) {
+            if (words == 0) throw ConfigError("invalid sketch.bits, at least 32");
+            std::mt19937 rng(seed);
+            std::normal_distribution<float> dist;
+            for (auto &v: proj) v = dist(rng);
+        }
+
+        static bool constexpr ENABLED = true;
+
+        size_t size () const {
+            return sketched() + held.size();
+        }
+
+        size_t sketched () const {
+            return sketches.size() / words;
+        }
+
+        // bytes held
+        size_t memory () const {
+            return (proj.capacity() + center.capacity()) * sizeof(float)
+                 + sketches.capacity() * sizeof(uint32_t) + held.capacity() * sizeof(float const *);
+        }
+
+        void append (float const *x, bool defer) {
+            held.push_back(x);
+            if (defer) return;
+            if (trained() || held.size() >= min_train) {
+                finish();
+            }
+        }
+
+        // train if not yet and sketch the held features
+        void finish () {
+            if (held.empty()) return;
+            if (!trained()) train();
+            flush();
+        }
+
+        // sketch i <- sketch slots[i] for i < m, the m slots being a
+        // permutation of [0, m) and the features all sketched
+        void permute (uint32_t const *slots, size_t m) {
+            std::vector<uint32_t> s(sketches);
+            for (size_t i = 0; i < m; ++i) {
+                std::copy(&sketches[size_t(slots[i]) * words], &sketches[size_t(slots[i]) * words] + words,
+                          &s[i * words]);
+            }
+            sketches.swap(s);
+        }
+
+        void clear () {
+            std::vector<float>().swap(center);
+            std::vector<uint32_t>().swap(sketches);
+            std::vector<float const *>().swap(held);
+        }
+
+        // ids[] <- features of [begin, end) whose sketches are among
+        // the pool nearest to the query's, plus the held ones
+        void select (F const &query, size_t begin, size_t end, unsigned pool, std::vector<uint32_t> *ids) const {
+            typedef std::pair<float, uint32_t> Candidate;
+            ids->clear();
+            size_t mid = std::min(end, std::max(begin, sketched()));
+            if (begin < mid && pool) {
+                std::vector<uint32_t> q(words);
+                sketch(&query.data[0], q.data());
+                std::vector<Candidate> heap;    // max-heap of the pool so far
+                heap.reserve(pool + 1);
+                uint32_t const *ptrs[BATCH];
+                float dists[BATCH];
+                for (size_t i = begin; i < mid; i += BATCH) {
+                    unsigned m = std::min<size_t>(mid - i, BATCH);
+                    for (unsigned j = 0; j < m; ++j) {
+                        ptrs[j] = &sketches[(i + j) * words];
+                    }
+                    simd::active->hamming_many(q.data(), ptrs, m, words, dists);
+                    for (unsigned j = 0; j < m; ++j) {
+                        if (heap.size() >= pool) {
+                            if (!(dists[j] < heap.front().first)) continue;
+                            std::pop_heap(heap.begin(), heap.end());
+                            heap.pop_back();
+                        }
+                        heap.emplace_back(dists[j], i + j);
+                        std::push_heap(heap.begin(), heap.end());
+                    }
+                }
+                for (auto const &c: heap) {
+                    ids->push_back(c.second);
+                }
+                // exact evaluation is faster in memory order
+                std::sort(ids->begin(), ids->end());
+            }
+            for (size_t i = std::max(begin, mid); i < end; ++i) {
+                ids->push_back(i);
+            }
+        }
+
+        // Save the center and the sketches, the projections are
+        // regenerated from the seed.
+        void save (std::ostream &os) const {
+            uint64_t header[] = {MAGIC, D, words, seed, center.size(), sketched()};
+            os.write(reinterpret_cast<char const *>(header), sizeof(header));
+            os.write(reinterpret_cast<char const *>(center.data()), center.size() * sizeof(float));
+            os.write(reinterpret_cast<char const *>(sketches.data()), sketches.size() * sizeof(uint32_t));
+        }
+
+        // Load what save() wrote, before anything is sketched; the
+        // saved sketches replace the first held features, the caller
+        // having checked they are the same.  False and unchanged if the
+        // parameters differ, there are too many or the stream is short.
+        bool load (std::istream &is) {
+            uint64_t header[6];
+            if (sketched() || !is.read(reinterpret_cast<char *>(header), sizeof(header))
+                    || header[0] != MAGIC || header[1] != D || header[2] != words
+                    || header[3] != seed || (header[4] != 0 && header[4] != D)
+                    || header[5] > held.size()) {
+                return false;
+            }
+            std::vector<float> c(header[4]);
+            std::vector<uint32_t> s(header[5] * words);
+            if (!is.read(reinterpret_cast<char *>(c.data()), c.size() * sizeof(float))
+                    || !is.read(reinterpret_cast<char *>(s.data()), s.size() * sizeof(uint32_t))) {
+                return false;
+            }
+            center.swap(c);
+            sketches.swap(s);
+            held.erase(held.begin(), held.begin() + header[5]);
+            return true;
+        }
+    };
+
+    // Features other than float vectors are never filtered.
+    template <typename F>
+    class SketchFilter<VECTOR_NONE, F> {
+        size_t n;
+    public:
+        static bool constexpr ENABLED = false;
+
+        SketchFilter (Config const &): n(0) {
+        }
+
+        size_t size () const {
+            return n;
+        }
+
+        size_t sketched () const {
+            return 0;
+        }
+
+        size_t memory () const {
+            return 0;
+        }
+
+        void append (void const *, bool) {
+            ++n;
+        }
+
+        void finish () {
+        }
+
+        void permute (uint32_t const *, size_t) {
+        }
+
+        void clear () {
+            n = 0;
+        }
+
+        void select (F const &, size_t begin, size_t end, unsigned, std::vector<uint32_t> *ids) const {
+            ids->clear();
+            for (size_t i = begin; i < end; ++i) {
+                ids->push_back(i);
+            }
+        }
+
+        void save (std::ostream &) const {
+        }
+
+        bool load (std::istream &) {
+            return false;
+        }
+    };
+
+    template <typename S, typename F>
+    struct SketchFilterOf {
+        typedef SketchFilter<decltype(vector_metric(static_cast<S const *>(nullptr)))::value, F> type;
+    };
+}
+
+#endif
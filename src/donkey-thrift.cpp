@@ -86,6 +86,7 @@ class DonkeyHandler : virtual public api::DonkeyIf {
             req.R = request.__isset.R ? request.R : NAN;
             req.hint_K = request.__isset.hint_K ? request.hint_K: -1;
             req.hint_R = request.__isset.hint_R ? request.hint_R: NAN;
+            req.hint_P = request.__isset.hint_P ? request.hint_P: -1;
 
             SearchResponse resp;
 
@@ -263,6 +264,7 @@ public:
             req.__set_R(request.R);
             req.__set_hint_K(request.hint_K);
             req.__set_hint_R(request.hint_R);
+            req.__set_hint_P(request.hint_P);
             client.search(resp, req);
             response->time = resp.time;
             response->load_time = resp.load_time;
@@ -13,6 +13,7 @@
 #include <vector>
 #include <unordered_map>
 #include <mutex>
+#include <thread>
 #include <limits>
 #include <functional>
 #include <boost/thread/locks.hpp>
@@ -228,6 +229,7 @@ namespace donkey {
 
 
 }
+#include "donkey-arena.h"
 // data-type-specific configuration
 #include "config.h"
 
@@ -238,6 +240,10 @@ namespace donkey {
 
 namespace donkey {
 
+    // indexes evaluate FeatureSimilarity through this, so plugins
+    // only need the pairwise apply
+    typedef SimilarityOps<FeatureSimilarity> FeatureSimilarityOps;
+
     static inline float default_R () {
         if (Matcher::POLARITY >= 0) {
             return -numeric_limits<float>::max();
@@ -273,6 +279,7 @@ namespace donkey {
         float R;
         int32_t hint_K;
         float hint_R;
+        int32_t hint_P;     // probe budget of the index (LSH buckets per table, IVF lists), <= 0 for default
         string expect_key;  // for benchmarking only, not included in API
         FeatureSimilarity::Params params_l1;  // only in HTTP for now
         //string params_l2;  // only in HTTP for now
@@ -326,6 +333,11 @@ namespace donkey {
     struct StatResponse {
         int32_t size;
         vector<string> last;
+        string rebuild;             // state of the last reindex: idle, loading,
+                                    // building, done, failed or cancelled;
+                                    // empty if the protocol does not carry it
+        float rebuild_progress;     // fraction of the entries loaded into the new index
+        double rebuild_time;        // seconds spent by the running or last reindex
     };
 
     struct MiscRequest {
@@ -363,12 +375,23 @@ namespace donkey {
         }
         virtual void snapshot (string const &) const {
         }
+        // If true, DB lets insert run concurrently with search and other
+        // inserts, and the index synchronizes itself.
+        virtual bool concurrent_insert () const {
+            return false;
+        }
     };
 
     Index *create_linear_index (Config const &);
     Index *create_kgraph_index (Config const &);
     Index *create_kgraph_lite_index (Config const &);
     Index *create_lsh_index (Config const &);
+    Index *create_hnsw_index (Config const &);
+    Index *create_ivf_index (Config const &);
+    Index *create_pq_index (Config const &);
+    Index *create_sketch_index (Config const &);
+    Index *create_mih_index (Config const &);
+    Index *create_vptree_index (Config const &);
     // utility functions
     
     // append & sync are protected.
@@ -513,6 +536,7 @@ namespace donkey {
             }
         };
         bool readonly;
+        Config config;
         Index *index;
         string dir, algo;
         Journal journal;
@@ -531,6 +555,162 @@ namespace donkey {
 
         size_t allocated;
 
+        // Reindex builds a new index on a background thread and swaps
+        // it in.  generation is bumped, under the unique lock, whenever
+        // index or records are replaced, so work started before can
+        // tell it is stale.
+        bool background_rebuild;
+        uint64_t generation;
+        std::thread rebuild_thread;
+        std::mutex rebuild_mutex;           // protects the fields below
+        bool rebuild_running;
+        bool rebuild_cancel;
+        string rebuild_state;
+        float rebuild_progress;
+        boost::timer::cpu_timer rebuild_timer;
+
+        Index *create_index () const {
+            Index *index = nullptr;
+            if (algo == "linear") {
+                index = create_linear_index(config);
+            }
+            else if (algo == "lsh") {
+                index = create_lsh_index(config);
+            }
+            else if (algo == "kgraph") {
+                index = create_kgraph_index(config);
+            }
+            else if (algo == "kgraph_lite") {
+                index = create_kgraph_lite_index(config);
+            }
+            else if (algo == "hnsw") {
+                index = create_hnsw_index(config);
+            }
+            else if (algo == "ivf") {
+                index = create_ivf_index(config);
+            }
+            else if (algo == "pq") {
+                index = create_pq_index(config);
+            }
+            else if (algo == "sketch") {
+                index = create_sketch_index(config);
+            }
+            else if (algo == "mih") {
+                index = create_mih_index(config);
+            }
+            else if (algo == "vptree") {
+                index = create_vptree_index(config);
+            }
+#ifdef AAALGO_DONKEY_TEXT
+            else if (algo == "inverted") {
+                index = create_inverted_index(config);
+            }
+#endif
+            else throw ConfigError("unknown index algorithm");
+            BOOST_VERIFY(index);
+            return index;
+        }
+
+        void set_rebuild_state (string const &state, float progress) {
+            std::lock_guard<std::mutex> lock(rebuild_mutex);
+            rebuild_state = state;
+            rebuild_progress = progress;
+        }
+
+        bool rebuild_cancelled () {
+            std::lock_guard<std::mutex> lock(rebuild_mutex);
+            return rebuild_cancel;
+        }
+
+        // Body of the reindex thread.  Records are append-only until a
+        // clear, so the first n of them taken at the start are a
+        // consistent snapshot.  They are fed to a fresh index in chunks,
+        // each under the shared lock so inserts are never held up for
+        // long, and the index is built with no lock at all.  The unique
+        // lock is only taken to feed the records inserted meanwhile,
+        // swap the indexes and save the new one.
+        void background_rebuild_index () {
+            static constexpr size_t CHUNK = 4096;
+            Index *fresh = nullptr;
+            float progress = 0;
+            try {
+                uint64_t gen;
+                size_t n;
+                {
+                    shared_lock<shared_mutex> lock(mutex);
+                    gen = generation;
+                    n = records.size();
+                }
+                fresh = create_index();
+                auto feed = [this, fresh](size_t begin, size_t end) {
+                    for (size_t id = begin; id < end; ++id) {
+                        records[id]->object.enumerate([fresh, id](unsigned tag, Feature const *ft) {
+                            fresh->insert(id, tag, ft);
+                        });
+                    }
+                };
+                bool swapped = false;
+                bool stale = false;
+                for (size_t begin = 0; begin < n && !stale && !rebuild_cancelled(); begin += CHUNK) {
+                    shared_lock<shared_mutex> lock(mutex);
+                    if (generation != gen) {
+                        stale = true;
+                        break;
+                    }
+                    size_t end = std::min(n, begin + CHUNK);
+                    feed(begin, end);
+                    progress = 1.0 * end / n;
+                    set_rebuild_state("loading", progress);
+                }
+                if (!stale && !rebuild_cancelled()) {
+                    set_rebuild_state("building", progress = 1);
+                    fresh->rebuild();
+                    if (algo == "kgraph_lite") {
+                        // see the synchronous path of reindex
+                        fresh->recover(dir + "/index");
+                    }
+                    unique_lock<shared_mutex> lock(mutex);
+                    if (generation == gen && !rebuild_cancelled()) {
+                        feed(n, records.size());
+                        std::swap(index, fresh);
+                        ++generation;
+                        swapped = true;
+                    }
+                }
+                if (swapped) {
+                    // a sync meanwhile saved the index replaced
+                    journal.sync();
+                    __snapshot_index(dir + "/index");
+                    LOG(info) << "reindexed " << dir;
+                    set_rebuild_state("done", 1);
+                }
+                else {  // cleared meanwhile, or shutting down
+                    set_rebuild_state("cancelled", progress);
+                }
+            }
+            catch (std::exception const &e) {
+                LOG(error) << "reindex of " << dir << " failed: " << e.what();
+                set_rebuild_state("failed", progress);
+            }
+            if (fresh) {    // the replaced or abandoned index
+                fresh->clear();
+                delete fresh;
+            }
+            std::lock_guard<std::mutex> lock(rebuild_mutex);
+            rebuild_timer.stop();
+            rebuild_running = false;
+        }
+
+        // wait for a running reindex
+        void join_rebuild () {
+            std::thread t;
+            {
+                std::lock_guard<std::mutex> lock(rebuild_mutex);
+                t.swap(rebuild_thread);
+            }
+            if (t.joinable()) t.join();
+        }
+
         Record *create_record (string const &k, string const &m, Object *o) {
             Record *mem = record_allocator.allocate(1);
             if (!mem) throw OutOfMemoryError("cannot allocate record");
@@ -540,6 +720,7 @@ namespace donkey {
     public:
         DB (Config const &config, string const &dir_, bool ro) 
             : readonly(ro),
+            config(config),
             index(nullptr),
             dir(dir_),
             journal(dir + "/journal", ro),
@@ -550,7 +731,13 @@ namespace donkey {
             record_allocator(&record_memory_resource),
             last(config.get<int>("donkey.last_size", 500)),
             last_index(0),
-            allocated(0)
+            allocated(0),
+            background_rebuild(config.get<int>("donkey.rebuild.background", 1)),
+            generation(0),
+            rebuild_running(false),
+            rebuild_cancel(false),
+            rebuild_state("idle"),
+            rebuild_progress(0)
 
         {
             if (!(last.size()>0)) throw ConfigError("invalid last size");
@@ -562,25 +749,8 @@ namespace donkey {
 #else
             algo = config.get<string>("donkey.index.algorithm", "kgraph");
 #endif
-            if (algo == "linear") {
-                index = create_linear_index(config);
-            }
-            else if (algo == "lsh") {
-                index = create_lsh_index(config);
-            }
-            else if (algo == "kgraph") {
-                index = create_kgraph_index(config);
-            }
-            else if (algo == "kgraph_lite") {
-                index = create_kgraph_lite_index(config);
-            }
-#ifdef AAALGO_DONKEY_TEXT
-            else if (algo == "inverted") {
-                index = create_inverted_index(config);
-            }
-#endif
-            else throw ConfigError("unknown index algorithm");
-            BOOST_VERIFY(index);
+            index = create_index();
+            rebuild_timer.stop();
 
             // recover journal 
             journal.recover([this](uint16_t, string const &key, string const &meta, Object *object){
@@ -597,6 +767,11 @@ namespace donkey {
         }
 
         ~DB () {
+            {
+                std::lock_guard<std::mutex> lock(rebuild_mutex);
+                rebuild_cancel = true;
+            }
+            join_rebuild();
             index->clear();
             records.clear();
             record_memory_resource.release();
@@ -626,11 +801,23 @@ namespace donkey {
             }
             Record *rec = create_record(key, meta, object);
             records.push_back(rec);
+            uint64_t gen = generation;
+            last[last_index] = key;
+            last_index = (last_index + 1) % last.size();
+            if (index->concurrent_insert()) {
+                // searches go on while the index takes the features
+                lock.unlock();
+                shared_lock<shared_mutex> shared(mutex);
+                if (generation == gen) {  // not cleared or reindexed meanwhile
+                    rec->object.enumerate([this, id](unsigned tag, Feature const *ft) {
+                    index->insert(id, tag, ft);
+                    });
+                }
+                return;
+            }
             rec->object.enumerate([this, id](unsigned tag, Feature const *ft) {
             index->insert(id, tag, ft);
             });
-            last[last_index] = key;
-            last_index = (last_index + 1) % last.size();
         }
 
         void search (Object const &object, SearchRequest const &params, SearchResponse *response) const {
@@ -729,6 +916,10 @@ namespace donkey {
                 ll = (ll + 1) % last.size();
                 if (ll == last_index) break;
             }
+            std::lock_guard<std::mutex> lock2(rebuild_mutex);
+            response->rebuild = rebuild_state;
+            response->rebuild_progress = rebuild_progress;
+            response->rebuild_time = rebuild_timer.elapsed().wall / 1e9;
         }
 
         void clear () {
@@ -736,6 +927,7 @@ namespace donkey {
                 throw PermissionError("database is readonly");
             }
             unique_lock<shared_mutex> lock(mutex);
+            ++generation;   // a running reindex drops its index
             index->clear();
             /*
             for (auto record: records) {
@@ -743,6 +935,7 @@ namespace donkey {
             }
             */
             records.clear();
+            lookup.clear();
             record_memory_resource.release();
         }
 
@@ -751,13 +944,31 @@ namespace donkey {
             __snapshot_index(dir + "/index");
         }
 
+        // Start rebuilding the index on a background thread, searches go
+        // on with the current index until the new one is swapped in.
+        // Does nothing if a reindex is already running.  With
+        // donkey.rebuild.background = 0 the index is rebuilt in place
+        // under the unique lock instead.
         void reindex () {
             if (readonly) {
                 throw PermissionError("database is readonly");
             }
+            if (background_rebuild) {
+                std::lock_guard<std::mutex> lock(rebuild_mutex);
+                if (rebuild_running) {
+                    LOG(info) << "reindex of " << dir << " already running";
+                    return;
+                }
+                if (rebuild_thread.joinable()) rebuild_thread.join();
+                rebuild_running = true;
+                rebuild_cancel = false;
+                rebuild_state = "loading";
+                rebuild_progress = 0;
+                rebuild_timer.start();
+                rebuild_thread = std::thread([this]() { background_rebuild_index(); });
+                return;
+            }
             unique_lock<shared_mutex> lock(mutex);
-            // TODO: this can be improved
-            // The index building part doesn't requires read-lock only
             index->rebuild();
             if (algo == "kgraph_lite") {
                 // this is a patch
@@ -767,12 +978,21 @@ namespace donkey {
             }
         }
 
-        void sync (void) {
+        // Saves the journal and the index serving now, without waiting
+        // for a running reindex.  Returns false if one is running: it
+        // saves its index itself once swapped in.
+        bool sync (void) {
             if (readonly) {
                 throw PermissionError("database is readonly");
             }
+            bool running;
+            {
+                std::lock_guard<std::mutex> lock(rebuild_mutex);
+                running = rebuild_running;
+            }
             journal.sync();
             __snapshot_index(dir + "/index");
+            return !running;
         }
 
         void __snapshot_index (string const &path) {
@@ -787,6 +1007,11 @@ namespace donkey {
             if (records.size()) {
                 index->recover(path);
             }
+            else {
+                // nothing to recover, the index may still need to know
+                // the journal has been replayed
+                index->rebuild();
+            }
         }
     };
 
@@ -905,6 +1130,8 @@ namespace donkey {
             idmap(root + "/idmap", dbs.size()),
             xtor(config)
         {
+            simd::l2_dot_expansion = config.get<int>("donkey.l2.dot_expansion", 0);
+            LOG(info) << "distance kernels: " << simd::active->name;
             // create empty dbs
             for (unsigned i = 0; i < dbs.size(); ++i) {
                 string dir = format("%s/%d", root, i);
@@ -986,8 +1213,13 @@ namespace donkey {
             }
             else if (request.method == "sync") {
                 if (readonly) throw PermissionError("readonly journal");
+                unsigned pending = 0;
                 for (unsigned i = 0; i < dbs.size(); ++i) {
-                    dbs[i]->sync();
+                    if (!dbs[i]->sync()) ++pending;
+                }
+                if (pending) {
+                    response->text = "reindex running on " + std::to_string(pending)
+                                   + " db(s), their new index is saved once swapped in";
                 }
             }
             response->code = 0;
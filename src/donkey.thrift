@@ -20,6 +20,7 @@ struct SearchRequest {
     7:optional double R;
     8:optional i32 hint_K;
     9:optional double hint_R;
+    10:optional i32 hint_P;
 }
 
 struct Hit {
@@ -87,7 +87,12 @@ fixed_monotonic_buffer_resource::~fixed_monotonic_buffer_resource()
 {  this->release();  }
 
 void fixed_monotonic_buffer_resource::release() BOOST_NOEXCEPT
-{  m_memory_blocks.release();  }
+{
+   m_memory_blocks.release();
+   //The current buffer was one of the blocks
+   m_current_buffer = 0u;
+   m_current_buffer_size = 0u;
+}
 
 memory_resource* fixed_monotonic_buffer_resource::upstream_resource() const BOOST_NOEXCEPT
 {  return &m_memory_blocks.upstream_resource();   }
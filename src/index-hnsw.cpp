@@ -0,0 +1,521 @@
+#include <cmath>
+#include <atomic>
+#include <random>
+#include <queue>
+#include <memory>
+#include "donkey.h"
+
+namespace donkey {
+
+    // Hierarchical navigable small world graph (Malkov & Yashunin,
+    // arXiv:1603.09320).  Features are linked into the graph as they are
+    // inserted, so they are searchable at graph speed right away and
+    // there is no rebuild.
+    //
+    // Insert may run concurrently with search (see concurrent_insert):
+    // inserts are serialized among themselves, neighbor lists are read
+    // and written under striped locks, and the storage only grows
+    // under the exclusive storage lock.
+    class HNSWIndex: public Index {
+        struct Entry {
+            uint32_t object;
+            uint32_t tag;
+        };
+
+        // (distance, node), distance in the rank domain negated for
+        // positive similarities, so smaller is always better
+        typedef std::pair<float, uint32_t> Candidate;
+
+        // Epoch-tagged visited marks, reset is a counter bump instead
+        // of clearing a mark per node.
+        struct Visited {
+            vector<uint16_t> marks;
+            uint16_t epoch;
+
+            Visited (): epoch(0) {
+            }
+
+            void reset (size_t n) {
+                if (marks.size() < n) {
+                    marks.resize(n, epoch);
+                }
+                if (++epoch == 0) {
+                    std::fill(marks.begin(), marks.end(), 0);
+                    epoch = 1;
+                }
+            }
+
+            // return true if i was visited, and mark it
+            bool test_set (uint32_t i) {
+                if (marks[i] == epoch) return true;
+                marks[i] = epoch;
+                return false;
+            }
+        };
+
+        static unsigned constexpr BATCH = 64;
+        static unsigned constexpr LOCKS = 256;
+        static unsigned constexpr MAX_LEVEL = 16;
+        static uint64_t constexpr EMPTY = ~uint64_t(0);
+        static uint64_t constexpr MAGIC = 0x57534e48;     // "HNSW"
+
+        unsigned M;                 // links per node above level 0
+        unsigned M0;                // links per node at level 0
+        unsigned ef_construction;
+        unsigned ef_search;
+        double level_mult;
+        std::mt19937 rng;
+        FeatureSimilarity::Params index_params_l1;
+        FeatureSimilarity::Params search_params_l1;
+
+        size_t capacity;            // nodes the storage has room for
+        vector<Entry> entries;
+        FeatureArena<Feature> features;     // features[i] belongs to entries[i]
+        vector<uint8_t> levels;
+        // Links of node i at level 0 start at links0[i * (M0 + 1)], at
+        // level l > 0 at upper[i][(l - 1) * (M + 1)]: the count, then
+        // the neighbors.
+        vector<uint32_t> links0;
+        vector<vector<uint32_t>> upper;
+
+        std::atomic<uint32_t> published;    // nodes [0, published) can be read
+        std::atomic<uint32_t> linked;       // nodes [0, linked) are in the graph
+        std::atomic<uint64_t> entry;        // entry node << 8 | its level
+        // Features replayed from the journal are only stored until
+        // recover() has had a chance to load the graph.
+        bool deferred;
+
+        std::mutex insert_mutex;
+        mutable shared_mutex storage_mutex;
+        mutable std::mutex locks[LOCKS];
+        Visited build_visited;              // used with insert_mutex held
+        mutable std::mutex pool_mutex;
+        mutable vector<std::unique_ptr<Visited>> pool;
+
+        uint32_t *links (uint32_t i, unsigned level) {
+            return level ? &upper[i][(level - 1) * (M + 1)] : &links0[size_t(i) * (M0 + 1)];
+        }
+
+        uint32_t const *links (uint32_t i, unsigned level) const {
+            return level ? &upper[i][(level - 1) * (M + 1)] : &links0[size_t(i) * (M0 + 1)];
+        }
+
+        std::mutex &lock_of (uint32_t i) const {
+            return locks[i % LOCKS];
+        }
+
+        float distance (uint32_t i, uint32_t j) const {
+            return (-FeatureSimilarity::POLARITY) *
+                   FeatureSimilarityOps::apply(features[i], features.norm(i),
+                                               features[j], features.norm(j), index_params_l1);
+        }
+
+        // dists[i] <- distance of node ids[i] to the query, i < n
+        void distances (Feature const &query, float query_norm, uint32_t const *ids, unsigned n,
+                        FeatureSimilarity::Params const &params, float *dists) const {
+            Feature const *ptrs[BATCH];
+            float norms[BATCH];
+            for (unsigned i = 0; i < n; i += BATCH) {
+                unsigned m = n - i;
+                if (m > BATCH) m = BATCH;
+                for (unsigned j = 0; j < m; ++j) {
+                    ptrs[j] = features.at(ids[i + j]);
+                    norms[j] = features.norm(ids[i + j]);
+                }
+                FeatureSimilarityOps::apply_many(query, query_norm, ptrs, norms, m, params, dists + i);
+            }
+            if (FeatureSimilarity::POLARITY > 0) {
+                for (unsigned i = 0; i < n; ++i) {
+                    dists[i] = -dists[i];
+                }
+            }
+        }
+
+        // Best-first search of one level from the nodes in *W; on return
+        // *W holds the best ef nodes found, sorted.  Nodes >= n are
+        // not published yet and skipped.
+        void search_level (Feature const &query, float query_norm, unsigned level, unsigned ef, uint32_t n,
+                           FeatureSimilarity::Params const &params, Visited *visited, vector<Candidate> *W) const {
+            std::priority_queue<Candidate, vector<Candidate>, std::greater<Candidate>> todo;
+            std::priority_queue<Candidate> top;     // front is the worst kept
+            for (auto const &c: *W) {
+                visited->test_set(c.second);
+                todo.push(c);
+                top.push(c);
+                if (top.size() > ef) top.pop();
+            }
+            vector<uint32_t> ids(M0);
+            vector<float> dists(M0);
+            while (!todo.empty()) {
+                Candidate c = todo.top();
+                if (top.size() >= ef && c.first > top.top().first) break;
+                todo.pop();
+                unsigned m = 0;
+                {
+                    std::lock_guard<std::mutex> lock(lock_of(c.second));
+                    uint32_t const *l = links(c.second, level);
+                    for (unsigned i = 1; i <= l[0]; ++i) {
+                        uint32_t id = l[i];
+                        if (id < n && !visited->test_set(id)) {
+                            ids[m++] = id;
+                        }
+                    }
+                }
+                distances(query, query_norm, ids.data(), m, params, dists.data());
+                for (unsigned i = 0; i < m; ++i) {
+                    if (top.size() < ef || dists[i] < top.top().first) {
+                        Candidate e(dists[i], ids[i]);
+                        todo.push(e);
+                        top.push(e);
+                        if (top.size() > ef) top.pop();
+                    }
+                }
+            }
+            W->resize(top.size());
+            for (size_t i = W->size(); i > 0; --i) {
+                W->at(i - 1) = top.top();
+                top.pop();
+            }
+        }
+
+        // Neighbor selection heuristic (algorithm 4 of the paper): a
+        // candidate, in order of distance, is kept only if it is closer
+        // to the base than to every neighbor kept so far, so links
+        // spread out instead of clustering.
+        void select (vector<Candidate> const &cands, unsigned m, vector<uint32_t> *out) const {
+            out->clear();
+            for (auto const &c: cands) {
+                if (out->size() >= m) break;
+                bool good = true;
+                for (uint32_t r: *out) {
+                    if (distance(c.second, r) < c.first) {
+                        good = false;
+                        break;
+                    }
+                }
+                if (good) out->push_back(c.second);
+            }
+        }
+
+        void set_links (uint32_t i, unsigned level, vector<uint32_t> const &nb) {
+            std::lock_guard<std::mutex> lock(lock_of(i));
+            uint32_t *l = links(i, level);
+            std::copy(nb.begin(), nb.end(), l + 1);
+            l[0] = nb.size();
+        }
+
+        // add a link from node i to j, pruning i's links if full
+        void add_link (uint32_t i, uint32_t j, unsigned level) {
+            unsigned max_links = level ? M : M0;
+            uint32_t *l = links(i, level);
+            unsigned c = l[0];
+            if (c < max_links) {
+                std::lock_guard<std::mutex> lock(lock_of(i));
+                l[c + 1] = j;
+                l[0] = c + 1;
+                return;
+            }
+            vector<Candidate> cands;
+            cands.emplace_back(distance(i, j), j);
+            for (unsigned k = 1; k <= c; ++k) {
+                cands.emplace_back(distance(i, l[k]), l[k]);
+            }
+            std::sort(cands.begin(), cands.end());
+            vector<uint32_t> nb;
+            select(cands, max_links, &nb);
+            set_links(i, level, nb);
+        }
+
+        // Link node id, all nodes before it must be linked.
+        // Only the inserting thread writes links, so it reads them
+        // without locks.
+        void link (uint32_t id) {
+            unsigned level = levels[id];
+            uint64_t e = entry.load();
+            if (e == EMPTY) {
+                entry.store(uint64_t(id) << 8 | level);
+                return;
+            }
+            uint32_t ep = e >> 8;
+            unsigned top = e & 0xFF;
+            Feature const &feature = features[id];
+            float norm = features.norm(id);
+            vector<Candidate> W(1, Candidate(distance(ep, id), ep));
+            for (unsigned l = top; l > level; --l) {
+                build_visited.reset(id);
+                search_level(feature, norm, l, 1, id, index_params_l1, &build_visited, &W);
+            }
+            vector<uint32_t> nb;
+            for (int l = std::min(level, top); l >= 0; --l) {
+                build_visited.reset(id);
+                search_level(feature, norm, l, ef_construction, id, index_params_l1, &build_visited, &W);
+                select(W, M, &nb);
+                set_links(id, l, nb);
+                for (uint32_t n: nb) {
+                    add_link(n, id, l);
+                }
+            }
+            if (level > top) {
+                entry.store(uint64_t(id) << 8 | level);
+            }
+        }
+
+        void link_pending () {
+            for (uint32_t i = linked.load(); i < published.load(); ++i) {
+                link(i);
+                linked.store(i + 1);
+            }
+        }
+
+        unsigned random_level () {
+            std::uniform_real_distribution<double> dist(0, 1);
+            double l = -std::log(1.0 - dist(rng)) * level_mult;
+            return l < MAX_LEVEL ? unsigned(l) : MAX_LEVEL;
+        }
+
+        void grow () {  // with insert_mutex held
+            unique_lock<shared_mutex> lock(storage_mutex);
+            size_t cap = std::max<size_t>(capacity * 2, 1024);
+            entries.reserve(cap);
+            features.reserve(cap);
+            levels.resize(cap);
+            links0.resize(cap * (M0 + 1));
+            upper.resize(cap);
+            capacity = cap;
+        }
+
+        std::unique_ptr<Visited> acquire () const {
+            std::lock_guard<std::mutex> lock(pool_mutex);
+            if (pool.empty()) {
+                return std::unique_ptr<Visited>(new Visited);
+            }
+            std::unique_ptr<Visited> v(std::move(pool.back()));
+            pool.pop_back();
+            return v;
+        }
+
+        void release (std::unique_ptr<Visited> v) const {
+            std::lock_guard<std::mutex> lock(pool_mutex);
+            pool.push_back(std::move(v));
+        }
+
+        template <typename T>
+        static void write (ostream &os, T const *p, size_t n) {
+            os.write(reinterpret_cast<char const *>(p), n * sizeof(T));
+        }
+
+        template <typename T>
+        static bool read (istream &is, T *p, size_t n) {
+            return bool(is.read(reinterpret_cast<char *>(p), n * sizeof(T)));
+        }
+
+        // Load the graph saved by snapshot() if it covers a prefix of
+        // the features we have, with the insert lock held and nothing
+        // linked yet.
+        bool load (istream &is) {
+            uint64_t header[5];
+            if (!read(is, header, 5) || header[0] != MAGIC || header[1] != M || header[2] != M0) {
+                return false;
+            }
+            uint32_t n = header[3];
+            if (n == 0 || n > published.load()) return false;
+            vector<Entry> saved(n);
+            vector<uint8_t> saved_levels(n);
+            vector<uint32_t> saved_links0(size_t(n) * (M0 + 1));
+            vector<vector<uint32_t>> saved_upper(n);
+            if (!read(is, &saved[0], n) || !read(is, &saved_levels[0], n)
+                    || !read(is, &saved_links0[0], saved_links0.size())) {
+                return false;
+            }
+            for (uint32_t i = 0; i < n; ++i) {
+                if (saved[i].object != entries[i].object || saved[i].tag != entries[i].tag
+                        || saved_levels[i] > MAX_LEVEL) {
+                    return false;
+                }
+                saved_upper[i].resize(saved_levels[i] * (M + 1));
+                if (!read(is, saved_upper[i].data(), saved_upper[i].size())) {
+                    return false;
+                }
+            }
+            uint32_t ep = header[4] >> 8;
+            if (ep >= n || saved_levels[ep] != (header[4] & 0xFF)) return false;
+            std::copy(saved_levels.begin(), saved_levels.end(), levels.begin());
+            std::copy(saved_links0.begin(), saved_links0.end(), links0.begin());
+            for (uint32_t i = 0; i < n; ++i) {
+                upper[i].swap(saved_upper[i]);
+            }
+            entry.store(header[4]);
+            linked.store(n);
+            return true;
+        }
+
+    public:
+        HNSWIndex (Config const &config):
+            Index(config),
+            M(config.get<unsigned>("donkey.hnsw.M", 16)),
+            M0(config.get<unsigned>("donkey.hnsw.M0", M * 2)),
+            ef_construction(config.get<unsigned>("donkey.hnsw.index.ef", 200)),
+            ef_search(config.get<unsigned>("donkey.hnsw.search.ef", 64)),
+            level_mult(M > 1 ? 1.0 / std::log(double(M)) : 0),
+            rng(config.get<unsigned>("donkey.hnsw.seed", 2016)),
+            capacity(0),
+            published(0),
+            linked(0),
+            entry(EMPTY),
+            deferred(true) {
+            if (M < 2 || M0 < M) throw ConfigError("invalid hnsw.M or hnsw.M0");
+            if (ef_construction == 0 || ef_search == 0) throw ConfigError("invalid hnsw ef");
+            string l1 = config.get<string>("donkey.hnsw.index.params_l1", "");
+            index_params_l1.decode(l1);
+            l1 = config.get<string>("donkey.hnsw.search.params_l1", "");
+            search_params_l1.decode(l1);
+        }
+
+        virtual bool concurrent_insert () const {
+            return true;
+        }
+
+        virtual void search (Feature const &query, SearchRequest const &sp, std::vector<Match> *matches) const {
+            matches->clear();
+            int K = sp.hint_K;
+            float R = sp.hint_R;
+            if (K <= 0) K = default_K;
+            if (!isnormal(R)) R = default_R;
+            R = FeatureSimilarity::rank(R);
+            if (FeatureSimilarity::POLARITY >= 0) {
+                R *= -1;
+            }
+            shared_lock<shared_mutex> lock(storage_mutex);
+            // The entry first: a node is published before it can become
+            // the entry, so ep < n.  Without an entry nothing was linked
+            // when we looked, whatever linked says by now.
+            uint64_t e = entry.load();
+            uint32_t n = published.load();
+            uint32_t l = linked.load();
+            if (e == EMPTY || (e >> 8) >= n) {
+                e = EMPTY;
+                l = 0;
+            }
+            float query_norm = FeatureSimilarityOps::norm(query);
+            std::unique_ptr<Visited> visited = acquire();
+            vector<Candidate> W;
+            if (e != EMPTY) {
+                uint32_t ep = e >> 8;
+                float d;
+                distances(query, query_norm, &ep, 1, sp.params_l1, &d);
+                W.emplace_back(d, ep);
+                for (unsigned level = e & 0xFF; level > 0; --level) {
+                    visited->reset(n);
+                    search_level(query, query_norm, level, 1, n, sp.params_l1, visited.get(), &W);
+                }
+                visited->reset(n);
+                search_level(query, query_norm, 0, std::max<unsigned>(ef_search, K), n, sp.params_l1, visited.get(), &W);
+            }
+            else {
+                visited->reset(n);
+            }
+            // nodes not linked yet, or linked after the search started
+            uint32_t ids[BATCH];
+            float dists[BATCH];
+            for (uint32_t i = l; i < n; ) {
+                unsigned m = 0;
+                for (; i < n && m < BATCH; ++i) {
+                    if (!visited->test_set(i)) ids[m++] = i;
+                }
+                distances(query, query_norm, ids, m, sp.params_l1, dists);
+                for (unsigned j = 0; j < m; ++j) {
+                    W.emplace_back(dists[j], ids[j]);
+                }
+            }
+            release(std::move(visited));
+            std::sort(W.begin(), W.end());
+            for (auto const &c: W) {
+                if (matches->size() >= unsigned(K) || c.first > R) break;
+                Match m;
+                m.object = entries[c.second].object;
+                m.tag = entries[c.second].tag;
+                // exact value for the reported match
+                m.distance = FeatureSimilarity::apply(features[c.second], query, sp.params_l1);
+                matches->push_back(m);
+            }
+        }
+
+        virtual void insert (uint32_t object, uint32_t tag, Feature const *feature) {
+            std::lock_guard<std::mutex> ilock(insert_mutex);
+            uint32_t id = published.load();
+            if (id >= capacity) {
+                grow();
+            }
+            shared_lock<shared_mutex> lock(storage_mutex);
+            Entry e;
+            e.object = object;
+            e.tag = tag;
+            entries.push_back(e);
+            features.append(*feature, FeatureSimilarityOps::norm(*feature));
+            levels[id] = random_level();
+            links0[size_t(id) * (M0 + 1)] = 0;
+            upper[id].assign(levels[id] * (M + 1), 0);
+            published.store(id + 1);
+            if (!deferred) {
+                link_pending();
+            }
+        }
+
+        virtual void clear () {
+            std::lock_guard<std::mutex> ilock(insert_mutex);
+            unique_lock<shared_mutex> lock(storage_mutex);
+            vector<Entry>().swap(entries);
+            features.clear();
+            vector<uint8_t>().swap(levels);
+            vector<uint32_t>().swap(links0);
+            vector<vector<uint32_t>>().swap(upper);
+            build_visited = Visited();
+            capacity = 0;
+            published.store(0);
+            linked.store(0);
+            entry.store(EMPTY);
+        }
+
+        virtual void rebuild () {   // links what is not linked yet
+            std::lock_guard<std::mutex> ilock(insert_mutex);
+            shared_lock<shared_mutex> lock(storage_mutex);
+            deferred = false;
+            link_pending();
+        }
+
+        virtual void recover (string const &path) {
+            {
+                std::lock_guard<std::mutex> ilock(insert_mutex);
+                shared_lock<shared_mutex> lock(storage_mutex);
+                std::ifstream is(path.c_str(), std::ios::binary);
+                if (linked.load() == 0 && is && load(is)) {
+                    LOG(info) << "HNSW graph recovered for " << linked.load() << " of " << published.load() << " features.";
+                }
+                else {
+                    LOG(info) << "HNSW graph not recovered, linking " << published.load() << " features.";
+                }
+            }
+            rebuild();
+        }
+
+        // Node entries, levels and links as they are in memory.
+        virtual void snapshot (string const &path) const {
+            shared_lock<shared_mutex> lock(storage_mutex);
+            uint32_t n = linked.load();
+            if (n == 0) return;
+            std::ofstream os(path.c_str(), std::ios::binary);
+            uint64_t header[] = {MAGIC, M, M0, n, entry.load()};
+            write(os, header, 5);
+            write(os, &entries[0], n);
+            write(os, &levels[0], n);
+            write(os, &links0[0], size_t(n) * (M0 + 1));
+            for (uint32_t i = 0; i < n; ++i) {
+                write(os, upper[i].data(), upper[i].size());
+            }
+        }
+    };
+
+    Index *create_hnsw_index (Config const &config) {
+        return new HNSWIndex(config);
+    }
+}
@@ -0,0 +1,455 @@
+#include <random>
+#include <memory>
+#include <algorithm>
+#include "donkey.h"
+
+namespace donkey {
+
+    // k-means centers, picked by the similarity type like the LSH
+    // families: the mean for vector spaces, the bitwise majority for
+    // Hamming, the per-coordinate mode for TypeHamming and a medoid
+    // for anything else.
+    template <typename T, unsigned D, typename F>
+    static void ivf_mean (F const *const *members, unsigned n, F *center) {
+        double sum[D];
+        std::fill(sum, sum + D, 0.0);
+        for (unsigned i = 0; i < n; ++i) {
+            for (unsigned d = 0; d < D; ++d) {
+                sum[d] += members[i]->data[d];
+            }
+        }
+        for (unsigned d = 0; d < D; ++d) {
+            center->data[d] = T(sum[d] / n);
+        }
+    }
+
+    template <typename T, unsigned D, bool S, typename F>
+    static void ivf_center (distance::L2<T, D, S> const *, F const *const *members, unsigned n, F *center) {
+        ivf_mean<T, D>(members, n, center);
+    }
+
+    template <typename T, unsigned D, typename F>
+    static void ivf_center (distance::L1<T, D> const *, F const *const *members, unsigned n, F *center) {
+        ivf_mean<T, D>(members, n, center);
+    }
+
+    template <typename T, unsigned D, typename F>
+    static void ivf_center (Cosine<T, D> const *, F const *const *members, unsigned n, F *center) {
+        ivf_mean<T, D>(members, n, center);
+    }
+
+    template <typename T, unsigned D, typename F>
+    static void ivf_center (distance::Hamming<T, D> const *, F const *const *members, unsigned n, F *center) {
+        unsigned constexpr BITS = sizeof(T) * 8;
+        for (unsigned d = 0; d < D; ++d) {
+            T v = 0;
+            for (unsigned b = 0; b < BITS; ++b) {
+                unsigned c = 0;
+                for (unsigned i = 0; i < n; ++i) {
+                    c += (members[i]->data[d] >> b) & 1;
+                }
+                if (c * 2 > n) v |= T(1) << b;
+            }
+            center->data[d] = v;
+        }
+    }
+
+    template <typename T, unsigned D, typename F>
+    static void ivf_center (distance::TypeHamming<T, D> const *, F const *const *members, unsigned n, F *center) {
+        vector<T> v(n);
+        for (unsigned d = 0; d < D; ++d) {
+            for (unsigned i = 0; i < n; ++i) {
+                v[i] = members[i]->data[d];
+            }
+            std::sort(v.begin(), v.end());
+            unsigned best = 0;
+            for (unsigned i = 0, j; i < n; i = j) {
+                for (j = i + 1; j < n && v[j] == v[i]; ++j);
+                if (j - i > best) {
+                    best = j - i;
+                    center->data[d] = v[i];
+                }
+            }
+        }
+    }
+
+    // any other similarity: the medoid of the first MEDOID_SAMPLE
+    // members, which come in random order
+    static unsigned constexpr MEDOID_SAMPLE = 64;
+
+    template <typename F>
+    static void ivf_center (void const *, F const *const *members, unsigned n, F *center) {
+        FeatureSimilarity::Params params;
+        unsigned m = std::min(n, MEDOID_SAMPLE);
+        unsigned best = 0;
+        float best_sum = 0;
+        for (unsigned i = 0; i < m; ++i) {
+            float sum = 0;
+            for (unsigned j = 0; j < m; ++j) {
+                sum += FeatureSimilarity::apply(*members[i], *members[j], params);
+            }
+            sum *= -FeatureSimilarity::POLARITY;    // smaller is better
+            if (i == 0 || sum < best_sum) {
+                best = i;
+                best_sum = sum;
+            }
+        }
+        *center = *members[best];
+    }
+
+    // Inverted file over a k-means coarse quantizer: each feature is
+    // stored in the posting list of its nearest centroid, features of a
+    // list contiguous in its own arena, and a query scans the lists of
+    // its nearest P centroids.
+    //
+    // The quantizer is trained by rebuild() on a sample of the
+    // features (donkey.ivf.min of them at least); until then all
+    // features are in one list and search is a linear scan.  Once
+    // trained, inserts go straight into their list, so there is no
+    // unindexed tail.
+    //
+    // Index is not mutex-protected.
+    class IVFIndex: public Index {
+        struct Entry {
+            uint32_t object;
+            uint32_t tag;
+            uint32_t list;
+            uint32_t slot;      // in the arena of the list
+        };
+
+        struct List {
+            FeatureArena<Feature> features;
+            vector<uint32_t> ids;   // ids[i] is the entry of features[i]
+            List (): features(1) {  // lists are many and may be small
+            }
+        };
+
+        typedef std::pair<float, uint32_t> Candidate;
+
+        static unsigned constexpr BATCH = 64;
+        static uint64_t constexpr MAGIC = 0x31465649;    // "IVF1"
+
+        unsigned num_lists;
+        unsigned default_P;
+        size_t min_train;
+        size_t max_sample;
+        unsigned iterations;
+        uint32_t seed;
+        FeatureSimilarity::Params index_params_l1;
+        FeatureSimilarity::Params search_params_l1;
+
+        vector<Entry> entries;
+        FeatureArena<Feature> centroids;    // empty if not trained
+        vector<std::unique_ptr<List>> lists;
+        // Features replayed from the journal stay in list 0 until
+        // recover() has had a chance to load the quantizer.
+        bool deferred;
+
+        Feature const &feature (uint32_t id) const {
+            Entry const &e = entries[id];
+            return lists[e.list]->features[e.slot];
+        }
+
+        float feature_norm (uint32_t id) const {
+            Entry const &e = entries[id];
+            return lists[e.list]->features.norm(e.slot);
+        }
+
+        // dists[i] <- rank domain distance of features[i] to the query,
+        // negated for positive similarities so smaller is better
+        static void distances (Feature const &query, float query_norm, FeatureArena<Feature> const &features,
+                               size_t begin, unsigned n, FeatureSimilarity::Params const &params, float *dists) {
+            Feature const *ptrs[BATCH];
+            float norms[BATCH];
+            for (unsigned i = 0; i < n; i += BATCH) {
+                unsigned m = n - i;
+                if (m > BATCH) m = BATCH;
+                for (unsigned j = 0; j < m; ++j) {
+                    ptrs[j] = features.at(begin + i + j);
+                    norms[j] = features.norm(begin + i + j);
+                }
+                FeatureSimilarityOps::apply_many(query, query_norm, ptrs, norms, m, params, dists + i);
+            }
+            if (FeatureSimilarity::POLARITY > 0) {
+                for (unsigned i = 0; i < n; ++i) {
+                    dists[i] = -dists[i];
+                }
+            }
+        }
+
+        // the centroids ranked for the feature
+        void rank_centroids (Feature const &f, float norm, FeatureSimilarity::Params const &params, vector<Candidate> *out) const {
+            unsigned n = centroids.size();
+            vector<float> dists(n);
+            distances(f, norm, centroids, 0, n, params, dists.data());
+            out->resize(n);
+            for (unsigned i = 0; i < n; ++i) {
+                out->at(i) = Candidate(dists[i], i);
+            }
+        }
+
+        uint32_t nearest (Feature const &f, float norm) const {
+            if (centroids.empty()) return 0;
+            vector<Candidate> c;
+            rank_centroids(f, norm, index_params_l1, &c);
+            return std::min_element(c.begin(), c.end())->second;
+        }
+
+        void append (uint32_t id, uint32_t list, Feature const &f, float norm) {
+            List *l = lists[list].get();
+            entries[id].list = list;
+            entries[id].slot = l->features.append(f, norm);
+            l->ids.push_back(id);
+        }
+
+        // Move all entries to the lists of assign[], in entry order.
+        void distribute (vector<uint32_t> const &assign) {
+            vector<std::unique_ptr<List>> old;
+            old.swap(lists);
+            lists.resize(std::max<size_t>(centroids.size(), 1));
+            vector<size_t> counts(lists.size(), 0);
+            for (uint32_t list: assign) {
+                ++counts[list];
+            }
+            for (size_t k = 0; k < lists.size(); ++k) {
+                lists[k].reset(new List);
+                lists[k]->features.reserve(counts[k]);
+                lists[k]->ids.reserve(counts[k]);
+            }
+            for (uint32_t i = 0; i < entries.size(); ++i) {
+                Entry const &e = entries[i];
+                List const *from = old[e.list].get();
+                append(i, assign[i], from->features[e.slot], from->features.norm(e.slot));
+            }
+        }
+
+        void assign_all (vector<uint32_t> *assign) const {
+            assign->resize(entries.size());
+#pragma omp parallel for schedule(dynamic, 1024)
+            for (size_t i = 0; i < entries.size(); ++i) {
+                assign->at(i) = nearest(feature(i), feature_norm(i));
+            }
+        }
+
+        // Lloyd's k-means on a sample, empty clusters are re-seeded
+        // with random sample points.
+        void train () {
+            size_t N = entries.size();
+            vector<uint32_t> sample(N);
+            for (uint32_t i = 0; i < N; ++i) sample[i] = i;
+            std::mt19937 rng(seed);
+            std::shuffle(sample.begin(), sample.end(), rng);
+            if (sample.size() > max_sample) sample.resize(max_sample);
+            unsigned K = std::min<size_t>(num_lists, sample.size());
+            centroids.clear();
+            centroids.reserve(K);
+            for (unsigned k = 0; k < K; ++k) {
+                centroids.append(feature(sample[k]), feature_norm(sample[k]));
+            }
+            vector<uint32_t> assign(sample.size());
+            for (unsigned it = 0; it < iterations; ++it) {
+#pragma omp parallel for schedule(dynamic, 1024)
+                for (size_t i = 0; i < sample.size(); ++i) {
+                    assign[i] = nearest(feature(sample[i]), feature_norm(sample[i]));
+                }
+                vector<vector<Feature const *>> members(K);
+                for (size_t i = 0; i < sample.size(); ++i) {
+                    members[assign[i]].push_back(&feature(sample[i]));
+                }
+                vector<Feature> centers(K);
+#pragma omp parallel for schedule(dynamic, 1)
+                for (unsigned k = 0; k < K; ++k) {
+                    if (members[k].empty()) {
+                        continue;
+                    }
+                    ivf_center(static_cast<FeatureSimilarity const *>(nullptr), &members[k][0], members[k].size(), &centers[k]);
+                }
+                centroids.clear();
+                for (unsigned k = 0; k < K; ++k) {
+                    if (members[k].empty()) {
+                        centers[k] = feature(sample[rng() % sample.size()]);
+                    }
+                    centroids.append(centers[k], FeatureSimilarityOps::norm(centers[k]));
+                }
+            }
+        }
+
+    public:
+        IVFIndex (Config const &config):
+            Index(config),
+            num_lists(config.get<unsigned>("donkey.ivf.lists", 1024)),
+            default_P(config.get<unsigned>("donkey.ivf.probes", 8)),
+            min_train(config.get<size_t>("donkey.ivf.min", 10000)),
+            max_sample(config.get<size_t>("donkey.ivf.train.sample", 256 * 1024)),
+            iterations(config.get<unsigned>("donkey.ivf.train.iterations", 10)),
+            seed(config.get<uint32_t>("donkey.ivf.train.seed", 2016)),
+            deferred(true) {
+            if (num_lists == 0) throw ConfigError("invalid ivf.lists");
+            if (default_P == 0) throw ConfigError("invalid ivf.probes");
+            string l1 = config.get<string>("donkey.ivf.index.params_l1", "");
+            index_params_l1.decode(l1);
+            l1 = config.get<string>("donkey.ivf.search.params_l1", "");
+            search_params_l1.decode(l1);
+            lists.emplace_back(new List);
+        }
+
+        virtual void search (Feature const &query, SearchRequest const &sp, std::vector<Match> *matches) const {
+            matches->clear();
+            int K = sp.hint_K;
+            float R = sp.hint_R;
+            if (K <= 0) K = default_K;
+            if (!isnormal(R)) R = default_R;
+            R = FeatureSimilarity::rank(R);
+            if (FeatureSimilarity::POLARITY >= 0) {
+                R *= -1;
+            }
+            unsigned P = sp.hint_P > 0 ? sp.hint_P : default_P;
+            float query_norm = FeatureSimilarityOps::norm(query);
+            vector<Candidate> probes;
+            if (centroids.empty()) {
+                probes.emplace_back(0, 0);
+            }
+            else {
+                rank_centroids(query, query_norm, sp.params_l1, &probes);
+                if (P < probes.size()) {
+                    std::partial_sort(probes.begin(), probes.begin() + P, probes.end());
+                    probes.resize(P);
+                }
+            }
+            vector<Candidate> heap;     // max-heap of the best K so far
+            float dists[BATCH];
+            for (auto const &p: probes) {
+                List const *list = lists[p.second].get();
+                size_t n = list->features.size();
+                for (size_t begin = 0; begin < n; begin += BATCH) {
+                    unsigned m = std::min<size_t>(n - begin, BATCH);
+                    distances(query, query_norm, list->features, begin, m, sp.params_l1, dists);
+                    for (unsigned i = 0; i < m; ++i) {
+                        float d = dists[i];
+                        if (d > R) continue;
+                        if (heap.size() >= unsigned(K)) {
+                            if (!(d < heap.front().first)) continue;
+                            std::pop_heap(heap.begin(), heap.end());
+                            heap.pop_back();
+                        }
+                        heap.emplace_back(d, list->ids[begin + i]);
+                        std::push_heap(heap.begin(), heap.end());
+                    }
+                }
+            }
+            std::sort_heap(heap.begin(), heap.end());
+            matches->resize(heap.size());
+            for (unsigned i = 0; i < heap.size(); ++i) {
+                auto &m = matches->at(i);
+                auto const &e = entries[heap[i].second];
+                m.object = e.object;
+                m.tag = e.tag;
+                // exact value for the reported match
+                m.distance = FeatureSimilarity::apply(feature(heap[i].second), query, sp.params_l1);
+            }
+        }
+
+        virtual void insert (uint32_t object, uint32_t tag, Feature const *feature) {
+            Entry e;
+            e.object = object;
+            e.tag = tag;
+            uint32_t id = entries.size();
+            entries.push_back(e);
+            float norm = FeatureSimilarityOps::norm(*feature);
+            append(id, deferred ? 0 : nearest(*feature, norm), *feature, norm);
+        }
+
+        virtual void clear () {
+            vector<Entry>().swap(entries);
+            centroids.clear();
+            lists.clear();
+            lists.emplace_back(new List);
+        }
+
+        // Train the quantizer and redistribute all features.
+        virtual void rebuild () {   // insert must not happen at this time
+            deferred = false;
+            if (entries.size() < std::max<size_t>(min_train, 1)) {
+                if (entries.size() && centroids.empty()) {
+                    LOG(info) << "IVF not trained for " << entries.size() << " features, below ivf.min.";
+                }
+                return;     // a trained quantizer is kept
+            }
+            LOG(info) << "Training IVF quantizer for " << entries.size() << " features.";
+            train();
+            vector<uint32_t> assign;
+            assign_all(&assign);
+            distribute(assign);
+            LOG(info) << "IVF trained with " << centroids.size() << " lists.";
+        }
+
+        // Saved are the centroids and the list of each entry; lists
+        // are rebuilt from the features replayed from the journal.
+        // Without a usable snapshot the quantizer is trained again.
+        virtual void recover (string const &path) {
+            deferred = false;
+            std::ifstream is(path.c_str(), std::ios::binary);
+            uint64_t header[4];
+            if (!is.read(reinterpret_cast<char *>(header), sizeof(header))
+                    || header[0] != MAGIC || header[1] != sizeof(Feature)
+                    || header[2] == 0 || header[3] > entries.size()) {
+                LOG(info) << "IVF not recovered.";
+                rebuild();
+                return;
+            }
+            FeatureArena<Feature> saved;
+            saved.reserve(header[2]);
+            for (uint64_t k = 0; k < header[2]; ++k) {
+                Feature c;
+                if (!is.read(reinterpret_cast<char *>(&c), sizeof(c))) {
+                    LOG(info) << "IVF not recovered.";
+                    rebuild();
+                    return;
+                }
+                saved.append(c, FeatureSimilarityOps::norm(c));
+            }
+            vector<Entry> saved_entries(header[3]);
+            if (header[3] && !is.read(reinterpret_cast<char *>(&saved_entries[0]), header[3] * sizeof(Entry))) {
+                LOG(info) << "IVF not recovered.";
+                rebuild();
+                return;
+            }
+            vector<uint32_t> assign(entries.size());
+            for (size_t i = 0; i < saved_entries.size(); ++i) {
+                Entry const &a = saved_entries[i];
+                Entry const &b = entries[i];
+                if (a.object != b.object || a.tag != b.tag || a.list >= header[2]) {
+                    LOG(info) << "IVF not recovered.";
+                    rebuild();
+                    return;
+                }
+                assign[i] = a.list;
+            }
+            centroids.clear();
+            centroids.reserve(saved.size());
+            for (size_t k = 0; k < saved.size(); ++k) {
+                centroids.append(saved[k], saved.norm(k));
+            }
+            for (size_t i = saved_entries.size(); i < entries.size(); ++i) {
+                assign[i] = nearest(feature(i), feature_norm(i));
+            }
+            distribute(assign);
+            LOG(info) << "IVF recovered with " << centroids.size() << " lists, " << saved_entries.size() << " of " << entries.size() << " features assigned.";
+        }
+
+        virtual void snapshot (string const &path) const {
+            if (centroids.empty()) return;
+            std::ofstream os(path.c_str(), std::ios::binary);
+            uint64_t header[] = {MAGIC, sizeof(Feature), centroids.size(), entries.size()};
+            os.write(reinterpret_cast<char const *>(header), sizeof(header));
+            for (size_t k = 0; k < centroids.size(); ++k) {
+                os.write(reinterpret_cast<char const *>(centroids.at(k)), sizeof(Feature));
+            }
+            os.write(reinterpret_cast<char const *>(entries.data()), entries.size() * sizeof(Entry));
+        }
+    };
+
+    Index *create_ivf_index (Config const &config) {
+        return new IVFIndex(config);
+    }
+}
@@ -1,9 +1,9 @@
+#include <limits>
+#include <memory>
 #include <kgraph.h>
 #include "donkey.h"
-
-namespace kgraph {
-    KGraph *create_kgraph_lite ();
-}
+#include "kgraph-batch.h"
+#include "donkey-sketch.h"
 
 namespace donkey {
 
@@ -11,7 +11,7 @@ namespace donkey {
 
 
     bool operator < (Index::Match const &m1, Index::Match const &m2) {
-        if (Matcher::POLARITY > 0) {
+        if (FeatureSimilarity::POLARITY > 0) {
             return m1.distance > m2.distance;
         }
         else {
@@ -25,21 +25,339 @@ namespace donkey {
         KGRAPH_FULL = 2
     };
 
-    // Index is not mutex-protected.
+    // Feature storage of KGraphIndex, slot i holding the feature of
+    // entry i:
+    //
+    //  struct Storage {
+    //      static bool constexpr EXACT;    // whether distances are exact
+    //      Storage (Config const &);
+    //      void append (Feature const *);
+    //      void finish ();         // complete what append deferred
+    //      // slot i <- slot slots[i], i < m, a permutation of [0, m)
+    //      void permute (uint32_t const *slots, size_t m);
+    //      void clear ();
+    //      Feature const &feature (size_t i) const;    // full precision
+    //      // rank domain distances, negated for positive similarities
+    //      // so smaller is always better
+    //      float distance (size_t i, size_t j, Params const &) const;
+    //      struct Query;
+    //      void prepare (Feature const &, Query *) const;
+    //      void distances (Query const &, unsigned const *slots, unsigned n,
+    //                      Params const &, float *dists) const;
+    //      // same, a distance beyond bound may be any value > bound
+    //      void distances (Query const &, unsigned const *slots, unsigned n,
+    //                      Params const &, float bound, float *dists) const;
+    //  };
+
+    // full precision copies in a FeatureArena
+    class FloatStorage {
+        static unsigned constexpr BATCH = 64;
+        FeatureArena<Feature> features;
+    public:
+        static bool constexpr EXACT = true;
+
+        struct Query {
+            Feature const *feature;
+            float norm;
+        };
+
+        FloatStorage (Config const &) {
+        }
+
+        void append (Feature const *feature) {
+            features.append(*feature, FeatureSimilarityOps::norm(*feature));
+        }
+
+        void finish () {
+        }
+
+        void permute (uint32_t const *slots, size_t m) {
+            features.permute(slots, m);
+        }
+
+        void clear () {
+            features.clear();
+        }
+
+        Feature const &feature (size_t i) const {
+            return features[i];
+        }
+
+        float distance (size_t i, size_t j, FeatureSimilarity::Params const &params) const {
+            return (-FeatureSimilarity::POLARITY) *
+                   FeatureSimilarityOps::apply(features[i], features.norm(i),
+                            features[j], features.norm(j), params);
+        }
+
+        void prepare (Feature const &query, Query *q) const {
+            q->feature = &query;
+            q->norm = FeatureSimilarityOps::norm(query);
+        }
+
+        void distances (Query const &q, unsigned const *slots, unsigned n, FeatureSimilarity::Params const &params, float *dists) const {
+            distances(q, slots, n, params, std::numeric_limits<float>::infinity(), dists);
+        }
+
+        void distances (Query const &q, unsigned const *slots, unsigned n, FeatureSimilarity::Params const &params, float bound, float *dists) const {
+            Feature const *ptrs[BATCH];
+            float norms[BATCH];
+            for (unsigned i = 0; i < n; i += BATCH) {
+                unsigned m = n - i;
+                if (m > BATCH) m = BATCH;
+                for (unsigned j = 0; j < m; ++j) {
+                    ptrs[j] = features.at(slots[i + j]);
+                    norms[j] = features.norm(slots[i + j]);
+                }
+                // similarities are never abandoned, the bound needs no negation
+                apply_many_bounded<FeatureSimilarity>(*q.feature, q.norm, ptrs, norms, m, params, bound, dists + i);
+            }
+            if (FeatureSimilarity::POLARITY > 0) {
+                for (unsigned i = 0; i < n; ++i) {
+                    dists[i] = -dists[i];
+                }
+            }
+        }
+    };
+
+    // Half precision or byte copies in a QuantizedArena (donkey.storage
+    // = float16 or int8), the full precision features staying in the
+    // DB records.  Search distances are approximate, the graph is built
+    // and reported matches are evaluated with the full features.
+    //
+    // The copies come on top of a pointer to the record's feature, so
+    // an entry takes D or 2D bytes more than one that only points at
+    // it; what they save is the memory read per distance, and the
+    // memory of float storage, which copies the full feature.
+    //
+    // Byte ranges are trained on the first donkey.storage.int8.train
+    // features, or on all of them by finish() if there are fewer; until
+    // then distances are exact.
+    template <typename C, int METRIC>
+    class QuantizedStorage {
+        static unsigned constexpr D = Feature::DIM;
+        static unsigned constexpr BATCH = 64;
+        vector<Feature const *> originals;
+        QuantizedArena<C, D> codes;     // empty or one row per original
+        size_t min_train;
+
+        void train () {
+            vector<float const *> x(originals.size());
+            for (size_t i = 0; i < x.size(); ++i) {
+                x[i] = &originals[i]->data[0];
+            }
+            codes.train(&x[0], x.size());
+            for (auto f: originals) {
+                codes.append(&f->data[0]);
+            }
+        }
+
+    public:
+        static bool constexpr EXACT = false;
+
+        struct Query {
+            Feature const *feature;
+            float norm;
+            typename QuantizedArena<C, D>::Query q;
+        };
+
+        QuantizedStorage (Config const &config):
+            min_train(config.get<size_t>("donkey.storage.int8.train", 10000)) {
+        }
+
+        void append (Feature const *feature) {
+            originals.push_back(feature);
+            if (codes.size()) {
+                codes.append(&feature->data[0]);
+            }
+            else if (codes.trained() || originals.size() >= min_train) {
+                train();
+            }
+        }
+
+        void finish () {
+            if (codes.size() == 0 && originals.size()) {
+                train();
+            }
+        }
+
+        void permute (uint32_t const *slots, size_t m) {
+            vector<Feature const *> o(originals);
+            for (size_t i = 0; i < m; ++i) {
+                o[i] = originals[slots[i]];
+            }
+            originals.swap(o);
+            if (codes.size()) codes.permute(slots, m);
+        }
+
+        void clear () {
+            vector<Feature const *>().swap(originals);
+            codes.clear();
+        }
+
+        Feature const &feature (size_t i) const {
+            return *originals[i];
+        }
+
+        float distance (size_t i, size_t j, FeatureSimilarity::Params const &params) const {
+            return (-FeatureSimilarity::POLARITY) *
+                   FeatureSimilarity::rank(FeatureSimilarity::apply(*originals[i], *originals[j], params));
+        }
+
+        void prepare (Feature const &query, Query *q) const {
+            q->feature = &query;
+            q->norm = FeatureSimilarityOps::norm(query);
+            if (!codes.size()) return;
+            if (METRIC == VECTOR_L1) {
+                codes.prepare_l1(&query.data[0], &q->q);
+            }
+            else {
+                codes.prepare_dot(&query.data[0], &q->q);
+            }
+        }
+
+        // approximate distances are never abandoned
+        void distances (Query const &q, unsigned const *slots, unsigned n, FeatureSimilarity::Params const &params, float, float *dists) const {
+            distances(q, slots, n, params, dists);
+        }
+
+        void distances (Query const &q, unsigned const *slots, unsigned n, FeatureSimilarity::Params const &params, float *dists) const {
+            if (!codes.size()) {    // not trained
+                Feature const *ptrs[BATCH];
+                for (unsigned i = 0; i < n; i += BATCH) {
+                    unsigned m = n - i;
+                    if (m > BATCH) m = BATCH;
+                    for (unsigned j = 0; j < m; ++j) {
+                        ptrs[j] = originals[slots[i + j]];
+                    }
+                    FeatureSimilarityOps::apply_many(*q.feature, ptrs, m, params, dists + i);
+                }
+                for (unsigned i = 0; i < n; ++i) {
+                    dists[i] = FeatureSimilarity::rank(dists[i]);
+                }
+            }
+            else if (METRIC == VECTOR_L1) {
+                codes.l1(q.q, slots, n, dists);
+            }
+            else {
+                codes.dot(q.q, slots, n, dists);
+                for (unsigned i = 0; i < n; ++i) {
+                    float norm = codes.norm(slots[i]);
+                    if (METRIC == VECTOR_L2) {
+                        float v = q.norm + norm - 2 * dists[i];
+                        if (!(v > 0)) v = 0;
+                        dists[i] = FeatureSimilarity::rank(std::sqrt(v));
+                    }
+                    else {
+                        float v = dists[i] / (std::sqrt(q.norm) * std::sqrt(norm));
+                        dists[i] = std::isnormal(v) ? v : -1.0f;
+                    }
+                }
+            }
+            if (FeatureSimilarity::POLARITY > 0) {
+                for (unsigned i = 0; i < n; ++i) {
+                    dists[i] = -dists[i];
+                }
+            }
+        }
+    };
+
+    // Index is not mutex-protected, except for the segments, see below.
+    //
+    // Entries [0, indexed_size) are covered by consecutive graphs, the
+    // segments, and the rest, the tail, is scanned linearly.  Normally
+    // there is at most one segment, built over all entries by
+    // rebuild().  With donkey.kgraph.segment = S > 0 (full flavor only)
+    // the index is log-structured instead: a background merger seals
+    // every S entries of the tail into a new small graph, and merges
+    // donkey.kgraph.segment.fanout = F adjacent segments of the same
+    // tier, sizes in [S F^t, S F^(t+1)), into one graph over their
+    // union.  Segments of donkey.kgraph.segment.max entries or more
+    // are left alone (0 for no limit).  The tail is thus kept below S
+    // and there are O(F log N) segments to search, all in parallel.
+    //
+    // Graphs are immutable and shared, a search copies the segment list
+    // under segment_mutex and works on that, so the merger can swap
+    // segments at any time.  The merger reads the features through the
+    // pointers handed to insert, which stay valid until the DB clears
+    // its records; clear() waits for the build in progress.  Features
+    // replayed from the journal are not sealed until recover() or
+    // rebuild().
+    //
+    // A kgraph_lite snapshot renumbered by kgraph-csr --reorder carries
+    // the order of its nodes, and recover() permutes the entries, the
+    // features and the sketches it covers alike, so that the nodes and
+    // features a search visits together are close in memory.
+    template <typename Storage>
     class KGraphIndex: public Index {
         struct Entry {
             uint32_t object;
             uint32_t tag;
-            Feature const *feature;
+        };
+        struct Segment {
+            size_t begin, end;
+            std::shared_ptr<KGraph> graph;
         };
         int flavor;
+        bool lite_compress;     // KGRAPH_LITE: packed neighbor lists
         size_t min_index_size;
-        size_t indexed_size;
+        size_t indexed_size;    // end of the last segment
+        vector<Segment> segments;
+        size_t segment_size;
+        unsigned segment_fanout;
+        size_t segment_max;
+        mutable std::mutex segment_mutex;   // segments and the merger state below
+        std::condition_variable segment_cv;
+        vector<Feature const *> sources;    // segment_size > 0 only
+        std::thread merger;
+        bool merger_stop;
+        bool merger_busy;
+        unsigned merger_paused;
+        uint64_t segment_generation;        // bumped when segments are replaced wholesale
+        unsigned rerank;
+        // the range not in the graph is prefiltered by sketches if
+        // donkey.kgraph.sketch.pool > 0
+        unsigned sketch_pool;
         vector<Entry> entries;
+        // entry i was the reordered[i]-th inserted, for i below the
+        // size, which is 0 if the entries are in insertion order
+        vector<uint32_t> reordered;
+        Storage features;       // features.feature(i) belongs to entries[i]
+        typename SketchFilterOf<FeatureSimilarity, Feature>::type sketches;
+        // Features replayed from the journal are not sketched until
+        // recover() or rebuild().
+        bool deferred;
+        // LAESA pivots of the linear flavor (donkey.linear.pivots, 0 to
+        // disable): row i of pivot_table holds the distances of entry i
+        // to the pivots, for the entries [0, pivot_table.size() / P).
+        // They pay off when a distance costs more than P bound checks
+        // and the data is of low intrinsic dimension.
+        unsigned num_pivots;
+        vector<uint32_t> pivots;
+        vector<float> pivot_table;
+        // linear scans of more than donkey.search.parallel.min entries
+        // are split over the shared pool of donkey.search.threads
+        unsigned parallel_min;
+        WorkerPool *pool;
 
         friend class IndexOracle;
         friend class SearchOracle;
 
+        // Builds the graph of a segment from the DB's features.
+        class SegmentOracle: public kgraph::IndexOracle {
+            vector<Feature> const &features;
+            FeatureSimilarity::Params params_l1;
+        public:
+            SegmentOracle (vector<Feature> const &f, FeatureSimilarity::Params const p1): features(f), params_l1(p1) {
+            }
+            virtual unsigned size () const {
+                return features.size();
+            }
+            virtual float operator () (unsigned i, unsigned j) const {
+                return (-FeatureSimilarity::POLARITY) *
+                       FeatureSimilarity::rank(FeatureSimilarity::apply(features[i], features[j], params_l1));
+            }
+        };
+
         class IndexOracle: public kgraph::IndexOracle {
             KGraphIndex *parent;
             FeatureSimilarity::Params params_l1;
@@ -50,41 +368,333 @@ namespace donkey {
                 return parent->entries.size();
             }   
             virtual float operator () (unsigned i, unsigned j) const {
-                return (-FeatureSimilarity::POLARITY) *
-                       FeatureSimilarity::apply(*parent->entries[i].feature,
-                                *parent->entries[j].feature, params_l1);
+                return parent->features.distance(i, j, params_l1);
             }   
         };  
 
-        class SearchOracle: public kgraph::SearchOracle {
+        // Like IndexOracle, distances are negated for positive similarities
+        // so smaller is always better.  Both work in the rank domain of
+        // the similarity.
+        class SearchOracle: public kgraph::BatchSearchOracle {
             KGraphIndex const *parent;
-            Feature const &query;
+            typename Storage::Query query;
             unsigned offset, sz;
             FeatureSimilarity::Params params_l1;
         public:
-            SearchOracle (KGraphIndex const *p, Feature const &q, unsigned begin, unsigned end, FeatureSimilarity::Params params): parent(p), query(q), offset(begin), sz(end-begin), params_l1(params) {
+            SearchOracle (KGraphIndex const *p, Feature const &q, unsigned begin, unsigned end, FeatureSimilarity::Params params): parent(p), offset(begin), sz(end-begin), params_l1(params) {
+                parent->features.prepare(q, &query);
             }   
             virtual unsigned size () const {
                 return sz;
             }   
             virtual float operator () (unsigned i) const {
-                return FeatureSimilarity::apply(*parent->entries[offset+i].feature, query, params_l1);
+                float d;
+                (*this)(&i, 1, &d);
+                return d;
             }   
+            virtual void operator () (unsigned const *ids, unsigned n, float *dists) const {
+                (*this)(ids, n, std::numeric_limits<float>::infinity(), dists);
+            }
+            virtual void operator () (unsigned const *ids, unsigned n, float bound, float *dists) const {
+                unsigned slots[BATCH];
+                for (unsigned i = 0; i < n; i += BATCH) {
+                    unsigned m = n - i;
+                    if (m > BATCH) m = BATCH;
+                    for (unsigned j = 0; j < m; ++j) {
+                        slots[j] = offset + ids[i + j];
+                    }
+                    parent->features.distances(query, slots, m, params_l1, bound, dists + i);
+                }
+            }
         };
 
+        float pivot_distance (Feature const &f, uint32_t pivot) const {
+            return FeatureSimilarity::apply(f, features.feature(pivot), index_params_l1);
+        }
+
+        // Pick the pivots by farthest-first traversal from entry 0, or
+        // fill the rows of the entries added since.
+        void update_pivots () {
+            size_t N = entries.size();
+            if (num_pivots == 0 || N == 0) return;
+            if (pivots.empty()) {
+                unsigned P = std::min<size_t>(num_pivots, N);
+                vector<float> table(N * P);
+                vector<float> nearest(N, std::numeric_limits<float>::max());
+                uint32_t next = 0;
+                for (unsigned p = 0; p < P; ++p) {
+                    pivots.push_back(next);
+#pragma omp parallel for schedule(dynamic, 1024)
+                    for (size_t i = 0; i < N; ++i) {
+                        float d = pivot_distance(features.feature(i), next);
+                        table[i * P + p] = d;
+                        if (d < nearest[i]) nearest[i] = d;
+                    }
+                    next = std::max_element(nearest.begin(), nearest.end()) - nearest.begin();
+                }
+                pivot_table.swap(table);
+                LOG(info) << "Linear index has " << P << " pivots.";
+                return;
+            }
+            unsigned P = pivots.size();
+            size_t covered = pivot_table.size() / P;
+            pivot_table.resize(N * P);
+#pragma omp parallel for schedule(dynamic, 1024)
+            for (size_t i = covered; i < N; ++i) {
+                for (unsigned p = 0; p < P; ++p) {
+                    pivot_table[i * P + p] = pivot_distance(features.feature(i), pivots[p]);
+                }
+            }
+        }
+
+        // Linear scan that skips the entries whose lower bound
+        // max_p |d(q, p) - d(x, p)| is already beyond the K-th best or
+        // epsilon; same contract as BatchSearchOracle::search.
+        unsigned pivot_search (SearchOracle const &oracle, Feature const &query, FeatureSimilarity::Params const &params,
+                               unsigned K, float epsilon, unsigned *ids, float *dists) const {
+            typedef std::pair<float, unsigned> Pair;
+            unsigned constexpr BATCH = kgraph::BatchSearchOracle::BATCH;
+            unsigned P = pivots.size();
+            size_t N = entries.size();
+            size_t covered = pivot_table.size() / P;
+            vector<float> qp(P);
+            for (unsigned p = 0; p < P; ++p) {
+                qp[p] = FeatureSimilarity::apply(query, features.feature(pivots[p]), params);
+            }
+            vector<Pair> heap;      // max-heap of the best K so far
+            heap.reserve(K + 1);
+            float threshold = epsilon;
+            unsigned batch_ids[BATCH];
+            float batch_dists[BATCH];
+            unsigned m = 0;
+            auto flush = [&]() {
+                oracle(batch_ids, m, threshold, batch_dists);
+                for (unsigned i = 0; i < m; ++i) {
+                    float d = batch_dists[i];
+                    if (d > epsilon) continue;
+                    if (heap.size() >= K) {
+                        if (!(d < heap.front().first)) continue;
+                        std::pop_heap(heap.begin(), heap.end());
+                        heap.pop_back();
+                    }
+                    heap.push_back(std::make_pair(d, batch_ids[i]));
+                    std::push_heap(heap.begin(), heap.end());
+                }
+                if (heap.size() >= K) threshold = std::min(epsilon, heap.front().first);
+                m = 0;
+            };
+            for (size_t i = 0; i < N; ++i) {
+                if (i < covered) {
+                    float const *row = &pivot_table[i * P];
+                    unsigned p = 0;
+                    while (p < P && !(FeatureSimilarity::rank(std::abs(qp[p] - row[p])) > threshold)) ++p;
+                    if (p < P) continue;
+                }
+                batch_ids[m] = i;
+                if (++m == BATCH) flush();
+            }
+            flush();
+            std::sort_heap(heap.begin(), heap.end());
+            for (unsigned i = 0; i < heap.size(); ++i) {
+                ids[i] = heap[i].second;
+                dists[i] = heap[i].first;
+            }
+            return heap.size();
+        }
+
+        // Put the first n entries in the given order, entry i becoming
+        // the order[i]-th inserted, or back in insertion order if order
+        // is null; throw and leave everything unchanged if order is not
+        // a permutation of [0, n).
+        void reorder (unsigned const *order, size_t n) {
+            size_t m = std::max(n, reordered.size());
+            if (m > entries.size()) throw InternalError("reordering beyond the entries");
+            vector<uint32_t> where(m);      // current slot of the i-th inserted
+            for (size_t j = 0; j < m; ++j) {
+                where[j < reordered.size() ? reordered[j] : j] = j;
+            }
+            vector<uint32_t> target(m);
+            vector<bool> seen(m, false);
+            bool identity = true;
+            for (size_t i = 0; i < m; ++i) {
+                target[i] = order && i < n ? order[i] : i;
+                if (target[i] >= m || seen[target[i]]) throw InternalError("invalid entry order");
+                seen[target[i]] = true;
+                identity = identity && target[i] == i;
+            }
+            vector<uint32_t> slots(m);
+            bool unchanged = true;
+            for (size_t i = 0; i < m; ++i) {
+                slots[i] = where[target[i]];
+                unchanged = unchanged && slots[i] == i;
+            }
+            if (identity) {
+                vector<uint32_t>().swap(reordered);
+            }
+            else {
+                reordered.swap(target);
+            }
+            if (unchanged) return;
+            vector<Entry> e(entries);
+            for (size_t i = 0; i < m; ++i) {
+                e[i] = entries[slots[i]];
+            }
+            entries.swap(e);
+            features.permute(slots.data(), m);
+            if (sketch_pool) sketches.permute(slots.data(), m);
+            LOG(info) << "Reordered " << m << " entries.";
+        }
+
+        // tier of a segment for merging
+        unsigned tier (size_t size) const {
+            unsigned t = 0;
+            for (size_t s = segment_size * segment_fanout; s <= size; s *= segment_fanout) ++t;
+            return t;
+        }
+
+        // Next job of the merger, under segment_mutex: build [*begin,
+        // *end) to replace segments [*first, *last).  Sealing the tail
+        // comes first, then merging the oldest run of fanout segments
+        // of a tier, which keeps segment sizes non-increasing from old
+        // to new.
+        bool plan (size_t *begin, size_t *end, size_t *first, size_t *last) const {
+            if (merger_paused || deferred) return false;
+            if (sources.size() - indexed_size >= segment_size) {
+                *begin = indexed_size;
+                *end = indexed_size + segment_size;
+                *first = *last = segments.size();
+                return true;
+            }
+            for (size_t j = 0; j + segment_fanout <= segments.size(); ++j) {
+                size_t i = j + segment_fanout;
+                unsigned t = tier(segments[j].end - segments[j].begin);
+                bool same = true;
+                for (size_t k = j; k < i && same; ++k) {
+                    size_t size = segments[k].end - segments[k].begin;
+                    same = tier(size) == t && !(segment_max && size >= segment_max);
+                }
+                if (same) {
+                    *begin = segments[j].begin;
+                    *end = segments[i - 1].end;
+                    *first = j;
+                    *last = i;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void merge_loop () {
+            unsigned backoff = 1;   // seconds before retrying a failed build
+            std::unique_lock<std::mutex> lock(segment_mutex);
+            for (;;) {
+                size_t begin, end, first, last;
+                segment_cv.wait(lock, [&]() { return merger_stop || plan(&begin, &end, &first, &last); });
+                if (merger_stop) return;
+                // a copy: a clear does not wait for the build, and the
+                // features it points at go with the records
+                vector<Feature> src;
+                src.reserve(end - begin);
+                for (size_t i = begin; i < end; ++i) {
+                    src.push_back(*sources[i]);
+                }
+                uint64_t generation = segment_generation;
+                merger_busy = true;
+                lock.unlock();
+                std::shared_ptr<KGraph> kg;
+                try {
+                    kg.reset(KGraph::create());
+                    SegmentOracle oracle(src, index_params_l1);
+                    kg->build(oracle, index_params, NULL);
+                }
+                catch (std::exception const &e) {
+                    LOG(error) << "Building segment [" << begin << ", " << end << ") failed: " << e.what()
+                               << ", retrying in " << backoff << "s.";
+                    kg.reset();
+                }
+                lock.lock();
+                merger_busy = false;
+                segment_cv.notify_all();
+                if (!kg) {  // the tail is left to linear scans meanwhile
+                    segment_cv.wait_for(lock, std::chrono::seconds(backoff), [this]() { return merger_stop; });
+                    backoff = std::min(backoff * 2, 64u);
+                    continue;
+                }
+                backoff = 1;
+                if (generation != segment_generation) continue;
+                Segment seg;
+                seg.begin = begin;
+                seg.end = end;
+                seg.graph = kg;
+                segments.erase(segments.begin() + first, segments.begin() + last);
+                segments.insert(segments.begin() + first, seg);
+                indexed_size = segments.back().end;
+                LOG(info) << "Segment [" << begin << ", " << end << ") built, "
+                          << segments.size() << " segments.";
+            }
+        }
+
+        // stop the merger after its current build until resume_merger()
+        void pause_merger () {
+            std::unique_lock<std::mutex> lock(segment_mutex);
+            ++merger_paused;
+            segment_cv.wait(lock, [this]() { return !merger_busy; });
+        }
+
+        void resume_merger () {
+            std::lock_guard<std::mutex> lock(segment_mutex);
+            --merger_paused;
+            segment_cv.notify_all();
+        }
+
+        // replace all segments, under the paused merger
+        void set_segment (KGraph *kg, size_t size) {
+            std::lock_guard<std::mutex> lock(segment_mutex);
+            ++segment_generation;
+            segments.clear();
+            if (kg) {
+                Segment seg;
+                seg.begin = 0;
+                seg.end = size;
+                seg.graph.reset(kg);
+                segments.push_back(seg);
+            }
+            indexed_size = size;
+        }
+
         KGraph::IndexParams index_params;
         KGraph::SearchParams search_params;
         FeatureSimilarity::Params index_params_l1;
         FeatureSimilarity::Params search_params_l1;
-        KGraph *kg_index;
 
     public:
         KGraphIndex (Config const &config, int flavor_ = KGRAPH_FULL):
             Index(config),
             flavor(flavor_),
+            lite_compress(config.get<int>("donkey.kgraph.lite.compress", 0) != 0),
             min_index_size(config.get<size_t>("donkey.kgraph.min", 10000)),
             indexed_size(0),
-            kg_index(nullptr) {
+            segment_size(flavor_ == KGRAPH_FULL ? config.get<size_t>("donkey.kgraph.segment", 0) : 0),
+            segment_fanout(config.get<unsigned>("donkey.kgraph.segment.fanout", 4)),
+            segment_max(config.get<size_t>("donkey.kgraph.segment.max", 0)),
+            merger_stop(false),
+            merger_busy(false),
+            merger_paused(0),
+            segment_generation(0),
+            rerank(config.get<unsigned>("donkey.storage.rerank", 0)),
+            sketch_pool(config.get<unsigned>("donkey.kgraph.sketch.pool", 0)),
+            features(config),
+            sketches(config),
+            deferred(true),
+            num_pivots(flavor_ == KGRAPH_LINEAR ? config.get<unsigned>("donkey.linear.pivots", 0) : 0),
+            parallel_min(config.get<unsigned>("donkey.search.parallel.min", 16384)),
+            pool(&WorkerPool::shared(config.get<unsigned>("donkey.search.threads", std::thread::hardware_concurrency()))) {
+            if (sketch_pool && !sketches.ENABLED) {
+                throw ConfigError("kgraph.sketch needs float vector features with L1, L2 or cosine");
+            }
+            if (num_pivots && FeatureSimilarity::POLARITY > 0) {
+                throw ConfigError("linear.pivots needs a metric distance");
+            }
             index_params.iterations = config.get<unsigned>("donkey.kgraph.index.iterations", index_params.iterations);
             index_params.L = config.get<unsigned>("donkey.kgraph.index.L", index_params.L);
             index_params.K = config.get<unsigned>("donkey.kgraph.index.K", index_params.K);
@@ -108,11 +718,22 @@ namespace donkey {
 
             l1 = config.get<string>("donkey.kgraph.search.params_l1", "");
             search_params_l1.decode(l1);
+            if (segment_size) {
+                if (segment_size <= index_params.K || segment_fanout < 2) {
+                    throw ConfigError("kgraph.segment must exceed kgraph.index.K, and segment.fanout be at least 2");
+                }
+                merger = std::thread([this]() { merge_loop(); });
+            }
         }
 
         ~KGraphIndex () {
-            if (kg_index) {
-                delete kg_index;
+            if (merger.joinable()) {
+                {
+                    std::lock_guard<std::mutex> lock(segment_mutex);
+                    merger_stop = true;
+                }
+                segment_cv.notify_all();
+                merger.join();
             }
         }
 
@@ -124,74 +745,153 @@ namespace donkey {
             float R = sp.hint_R;
             if (K <= 0) K = default_K;
             if (!isnormal(R)) R = default_R;
+            R = FeatureSimilarity::rank(R);
             if (FeatureSimilarity::POLARITY >= 0) {
                 R *= -1;
             }
-            vector<unsigned> ids(K*2);
-            vector<float> dists(K*2);
-            unsigned L = 0;
-            params.K = K;
+            // with approximate distances, more candidates are evaluated
+            // exactly below and the best K kept
+            unsigned KK = K;
+            if (!Storage::EXACT && rerank > KK) KK = rerank;
+            params.K = KK;
             params.epsilon = R;
-            if (kg_index) {
-                SearchOracle oracle(this, query, 0, indexed_size, sp.params_l1);
-                // update search params
-                L += kg_index->search(oracle, params, &ids[L], &dists[L], nullptr);
+            vector<Segment> segs;
+            size_t sealed;
+            {
+                std::lock_guard<std::mutex> lock(segment_mutex);
+                segs = segments;
+                sealed = indexed_size;
             }
-            else {
-                BOOST_VERIFY(indexed_size == 0);
+            // one task per segment and one for the tail if any, each
+            // finding up to KK into its own part of ids and dists
+            unsigned tasks = segs.size() + (sealed < entries.size() ? 1 : 0);
+            vector<unsigned> ids(KK * tasks);
+            vector<float> dists(KK * tasks);
+            vector<unsigned> found(tasks, 0);
+            auto search_part = [&](unsigned t) {
+                unsigned *pids = &ids[t * KK];
+                float *pdists = &dists[t * KK];
+                unsigned L = 0;
+                size_t begin = sealed;
+                if (t < segs.size()) {
+                    Segment const &seg = segs[t];
+                    SearchOracle oracle(this, query, seg.begin, seg.end, sp.params_l1);
+                    L = seg.graph->search(oracle, params, pids, pdists, nullptr);
+                    begin = seg.begin;
+                }
+                else if (sealed < entries.size() && sketch_pool) {
+                    vector<uint32_t> cands;
+                    sketches.select(query, sealed, entries.size(), std::max(sketch_pool, KK), &cands);
+                    SearchOracle oracle(this, query, 0, entries.size(), sp.params_l1);
+                    L = oracle.search(*pool, parallel_min, cands.data(), cands.size(), params.K, params.epsilon, pids, pdists);
+                    begin = 0;
+                }
+                else if (sealed < entries.size() && pivots.size()) {
+                    BOOST_VERIFY(sealed == 0);
+                    SearchOracle oracle(this, query, 0, entries.size(), sp.params_l1);
+                    L = pivot_search(oracle, query, sp.params_l1, params.K, params.epsilon, pids, pdists);
+                }
+                else if (sealed < entries.size()) {
+                    SearchOracle oracle(this, query, sealed, entries.size(), sp.params_l1);
+                    L = oracle.search(*pool, parallel_min, nullptr, oracle.size(), params.K, params.epsilon, pids, pdists);
+                }
+                for (unsigned l = 0; l < L; ++l) {
+                    pids[l] += begin;
+                }
+                found[t] = L;
+            };
+            if (tasks >= 2) {
+                pool->run(tasks, search_part);
             }
-            if (indexed_size < entries.size()) {
-                SearchOracle oracle(this, query, indexed_size, entries.size(), sp.params_l1);
-                unsigned L0 = L;
-                L += oracle.search(params.K, params.epsilon, &ids[L0], &dists[L0]);
-                for (unsigned l = L0; l < L; ++l) {
-                    ids[l] += indexed_size;
+            else if (tasks == 1) {
+                search_part(0);
+            }
+            unsigned L = 0;
+            for (unsigned t = 0; t < tasks; ++t) {
+                for (unsigned l = 0; l < found[t]; ++l, ++L) {
+                    ids[L] = ids[t * KK + l];
                 }
             }
-            BOOST_VERIFY(L <= 2*K);
             matches->resize(L);
             for (unsigned i = 0; i < L; ++i) {
                 auto &m = matches->at(i);
                 auto const &e = entries[ids[i]];
                 m.object = e.object;
                 m.tag = e.tag;
-                m.distance = dists[i];
+                // exact value for the reported match
+                m.distance = FeatureSimilarity::apply(features.feature(ids[i]), query, sp.params_l1);
             }
             sort(matches->begin(),
                  matches->end());
             if (matches->size() > K) {
                 matches->resize(K);
             }
-            BOOST_VERIFY(indexed_size <= entries.size());
+            BOOST_VERIFY(sealed <= entries.size());
         }
 
         virtual void insert (uint32_t object, uint32_t tag, Feature const *feature) {
             Entry e;
             e.object = object;
             e.tag = tag;
-            e.feature = feature;
             entries.push_back(e);
+            features.append(feature);
+            if (segment_size) {
+                std::lock_guard<std::mutex> lock(segment_mutex);
+                sources.push_back(feature);
+                if (sources.size() - indexed_size >= segment_size) {
+                    segment_cv.notify_all();
+                }
+            }
+            if (sketch_pool) {
+                sketches.append(&feature->data[0], deferred);
+            }
+            if (pivots.size() && !deferred) {
+                for (auto p: pivots) {
+                    pivot_table.push_back(pivot_distance(*feature, p));
+                }
+            }
         }
 
+        // A build of the merger is not waited for, it is dropped when
+        // done as the generation has changed.
         virtual void clear () {
-            if (kg_index) {
-                delete kg_index;
-                kg_index = nullptr;
+            {
+                std::lock_guard<std::mutex> lock(segment_mutex);
+                ++segment_generation;
+                segments.clear();
+                indexed_size = 0;
+                sources.clear();
             }
             entries.clear();
+            reordered.clear();
+            features.clear();
+            sketches.clear();
+            pivots.clear();
+            pivot_table.clear();
         }
 
         virtual void rebuild () {   // insert must not happen at this time
+            features.finish();
+            sketches.finish();
             if (flavor == KGRAPH_LINEAR) {
+                deferred = false;
                 BOOST_VERIFY(indexed_size == 0);
+                update_pivots();
+                return;
+            }
+            pause_merger();
+            {
+                std::lock_guard<std::mutex> lock(segment_mutex);
+                deferred = false;
+            }
+            if (entries.size() == indexed_size) {
+                resume_merger();
                 return;
             }
-            if (entries.size() == indexed_size) return;
 
             if (flavor == KGRAPH_LITE) {
-                indexed_size = 0;
-                delete kg_index;
-                kg_index = nullptr;
+                set_segment(nullptr, 0);
+                resume_merger();
                 return;
             }
 
@@ -205,67 +905,119 @@ namespace donkey {
                 kg->build(oracle, index_params, NULL);
                 LOG(info) << "Swapping on new index...";
             }
-            indexed_size = entries.size();
-            std::swap(kg, kg_index);
-            if (kg) {
-                delete kg;
-            }
+            // too small to build: with segments the tail waits for the
+            // merger, otherwise it is all scanned
+            set_segment(kg, kg || !segment_size ? entries.size() : 0);
+            resume_merger();
         }
 
+        // The snapshot of segment i, saved to path (i = 0) or path.i, is
+        // listed in path.meta by its end, one per line; a snapshot of a
+        // single graph is just path and its size.
         virtual void recover (string const &path) {
-            KGraph *kg = nullptr;
-            if (flavor == KGRAPH_FULL) {
-                kg = KGraph::create();
-            }
-            else if (flavor == KGRAPH_LITE) {
-                kg = kgraph::create_kgraph_lite();
-            }
-            size_t sz = 0;
-            if (kg) {
+            features.finish();
+            sketches.finish();
+            update_pivots();
+            pause_merger();
+            vector<Segment> segs;
+            if (flavor != KGRAPH_LINEAR) {
                 try {
-                    kg->load(path.c_str());
                     string meta_path = path + ".meta";
                     std::ifstream is(meta_path.c_str());
                     if (!is) throw 0;
-                    is >> sz;
+                    size_t end;
+                    while (is >> end) {
+                        Segment seg;
+                        seg.begin = segs.empty() ? 0 : segs.back().end;
+                        seg.end = end;
+                        if (end <= seg.begin || end > entries.size()) throw 0;
+                        seg.graph.reset(flavor == KGRAPH_FULL ? KGraph::create() : kgraph::create_kgraph_lite(lite_compress));
+                        string graph_path = segs.empty() ? path : path + "." + std::to_string(segs.size());
+                        seg.graph->load(graph_path.c_str());
+                        segs.push_back(seg);
+                        if (flavor == KGRAPH_LITE) break;
+                    }
                 }
                 catch (...) {
-                    delete kg;
-                    kg = nullptr;
+                    // fail to load, rebuild
+                    segs.clear();
                 }
             }
-            if (kg) {
-                indexed_size = sz;
-                std::swap(kg, kg_index);
-                if (kg) {
-                    delete kg;
+            if (flavor == KGRAPH_LITE) {
+                try {
+                    reorder(segs.empty() ? nullptr : kgraph::kgraph_lite_order(segs[0].graph.get()),
+                            segs.empty() ? 0 : segs[0].end);
+                }
+                catch (std::exception const &e) {
+                    LOG(error) << "Cannot reorder entries: " << e.what();
+                    segs.clear();
                 }
             }
-            else {
-                // fail to load, rebuild
-                indexed_size = 0;
+            {
+                std::lock_guard<std::mutex> lock(segment_mutex);
+                ++segment_generation;
+                segments.swap(segs);
+                indexed_size = segments.empty() ? 0 : segments.back().end;
+                deferred = false;
             }
+            resume_merger();
         }
 
         virtual void snapshot (string const &path) const {
-            if (kg_index && flavor == KGRAPH_FULL) {
-                kg_index->save(path.c_str(), KGraph::FORMAT_NO_DIST);
-                string meta_path = path + ".meta";
-                std::ofstream os(meta_path.c_str());
-                os << indexed_size << std::endl;
+            if (flavor != KGRAPH_FULL) return;
+            vector<Segment> segs;
+            {
+                std::lock_guard<std::mutex> lock(segment_mutex);
+                segs = segments;
+            }
+            if (segs.empty()) return;
+            for (size_t i = 0; i < segs.size(); ++i) {
+                string graph_path = i ? path + "." + std::to_string(i) : path;
+                segs[i].graph->save(graph_path.c_str(), KGraph::FORMAT_NO_DIST);
+            }
+            string meta_path = path + ".meta";
+            std::ofstream os(meta_path.c_str());
+            for (auto const &seg: segs) {
+                os << seg.end << std::endl;
             }
         }
     };
 
+    template <typename C>
+    static Index *create_quantized (Config const &, int, std::integral_constant<int, VECTOR_NONE>) {
+        throw ConfigError("quantized storage needs float vector features with L1, L2 or cosine");
+    }
+
+    template <typename C, int METRIC>
+    static Index *create_quantized (Config const &config, int flavor, std::integral_constant<int, METRIC>) {
+        return new KGraphIndex<QuantizedStorage<C, METRIC>>(config, flavor);
+    }
+
+    // donkey.storage: float (default), float16 or int8
+    static Index *create_index (Config const &config, int flavor) {
+        string storage = config.get<string>("donkey.storage", "float");
+        typedef decltype(vector_metric(static_cast<FeatureSimilarity const *>(nullptr))) metric;
+        if (storage == "float") {
+            return new KGraphIndex<FloatStorage>(config, flavor);
+        }
+        else if (storage == "float16") {
+            return create_quantized<uint16_t>(config, flavor, metric());
+        }
+        else if (storage == "int8") {
+            return create_quantized<uint8_t>(config, flavor, metric());
+        }
+        throw ConfigError("unknown storage");
+    }
+
     Index *create_kgraph_index (Config const &config) {
-        return new KGraphIndex(config, KGRAPH_FULL);
+        return create_index(config, KGRAPH_FULL);
     }
 
     Index *create_kgraph_lite_index (Config const &config) {
-        return new KGraphIndex(config, KGRAPH_LITE);
+        return create_index(config, KGRAPH_LITE);
     }
 
     Index *create_linear_index (Config const &config) {
-        return new KGraphIndex(config, KGRAPH_LINEAR);
+        return create_index(config, KGRAPH_LINEAR);
     }
 }
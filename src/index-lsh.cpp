@@ -1,6 +1,9 @@
+#include <iomanip>
+#include <limits>
 #include <utility>
 #include "donkey.h"
 #include "lsh.h"
+#include "lsh-family.h"
 
 namespace donkey {
 
@@ -14,33 +17,54 @@ namespace donkey {
 
         struct Entry {
             Key key;
-            Feature const *feature;
+            uint32_t slot;      // feature slot in the arena
         };
 
+        typedef LSHHasher<LSHFamily<FeatureSimilarity>::type> Hasher;
+
+        FeatureArena<Feature> features;
+
         // lsh.h requires a config structure.
         struct LSHConfig {
-            typedef Feature QUERY_TYPE;
+            static unsigned constexpr BATCH = 64;
+            FeatureArena<Feature> const *features;
+            Hasher const *hasher;
+
+            // the query with its norm, computed once per search
+            struct QUERY_TYPE {
+                Feature const &feature;
+                float norm;
+            };
             typedef Entry RECORD_TYPE;
-            typedef Key KEY_TYPE;
+            typedef Entry KEY_TYPE;     // slot is needed to score the matches
             typedef FeatureSimilarity::Params SEARCH_PARAMS_TYPE;
             static int constexpr POLARITY = FeatureSimilarity::POLARITY;
 
-            // TODO, implement hash
-            static void hash (QUERY_TYPE const &q, unsigned tables, unsigned bits, uint32_t *hash) {
-                std::fill(hash, hash + tables, 0);
+            // tables and bits are fixed in the hasher
+            void hash (RECORD_TYPE const &rec, unsigned, unsigned, uint32_t *hash) const {
+                hasher->hash((*features)[rec.slot], hash);
             }
 
-            // TODO, implement hash
-            static void hash (RECORD_TYPE const &rec, unsigned tables, unsigned bits, uint32_t *hash) {
-                std::fill(hash, hash + tables, 0);
+            void probe (QUERY_TYPE const &q, unsigned, unsigned, unsigned P, uint32_t *buckets, unsigned *counts) const {
+                hasher->probe(q.feature, P, buckets, counts);
             }
 
-            static KEY_TYPE key (RECORD_TYPE const &r) {
-                return r.key;
+            KEY_TYPE key (RECORD_TYPE const &r) const {
+                return r;
             }
 
-            static float dist (RECORD_TYPE const &r, QUERY_TYPE const &q, SEARCH_PARAMS_TYPE const &params) {
-                return FeatureSimilarity::apply(*r.feature, q, params);
+            void dist_many (RECORD_TYPE const *records, unsigned n, QUERY_TYPE const &q, SEARCH_PARAMS_TYPE const &params, float bound, float *dists) const {
+                Feature const *ptrs[BATCH];
+                float norms[BATCH];
+                for (unsigned i = 0; i < n; i += BATCH) {
+                    unsigned m = std::min(n - i, BATCH);
+                    for (unsigned j = 0; j < m; ++j) {
+                        uint32_t slot = records[i + j].slot;
+                        ptrs[j] = features->at(slot);
+                        norms[j] = features->norm(slot);
+                    }
+                    apply_many_bounded<FeatureSimilarity>(q.feature, q.norm, ptrs, norms, m, params, bound, dists + i);
+                }
             }
         };
 
@@ -48,63 +72,111 @@ namespace donkey {
 
         Config config;
         size_t indexed_size;
+        unsigned num_tables;
+        unsigned hash_bits;
+        unsigned num_functions; // K
+        float width;            // w of p-stable families, part of the hash functions
+        unsigned default_P;     // buckets probed per table
+        bool huge_pages;
+        // Entries replayed from the journal are only stored until
+        // recover() has had a chance to load the tables from a snapshot.
+        bool deferred;
+        Hasher *hasher;
         LSHImpl *lsh_index;
         FeatureSimilarity::Params search_params_l1;
 
-        void create_index () {
-            unsigned num_tables = config.get("donkey.lsh.tables", 8);
-            unsigned hash_bits = config.get("donkey.lsh.bits", 24);
-            size_t allocate = config.get("donkey.lsh.allocate", 16LL * 1024 * 1024 * 1024);
-            lsh_index = new LSHImpl(num_tables, hash_bits, allocate);
-            if (!lsh_index) {
+        void create_hasher (uint32_t seed) {
+            delete hasher;
+            hasher = nullptr;
+            hasher = new Hasher(num_tables, num_functions, hash_bits, config, seed);
+        }
+
+        // an empty index hashing with the current hasher
+        LSHImpl *create_index () const {
+            LSHConfig lsh_config;
+            lsh_config.features = &features;
+            lsh_config.hasher = hasher;
+            LSHImpl *lsh = new LSHImpl(lsh_config, num_tables, hash_bits, huge_pages);
+            if (!lsh) {
                 throw InternalError("Cannot create LSH index.");
             }
+            return lsh;
+        }
+
+        // Move the entries of lsh_index from the first into a new index,
+        // hashed only if not deferred.  Entries already in the new index
+        // are kept.
+        void reindex_from (size_t first, LSHImpl *lsh) {
+            for (size_t i = first; i < lsh_index->size(); ++i) {
+                lsh->append(lsh_index->record(i), false);
+            }
+            if (!deferred) {
+                lsh->hash_pending();
+            }
+            delete lsh_index;
+            lsh_index = lsh;
+        }
+
+        // load the tables saved by snapshot(), if they cover a prefix of
+        // the entries we have
+        bool load (std::istream &is) {
+            LSHImpl *lsh = create_index();
+            bool ok = lsh->load(is) && lsh->size() <= lsh_index->size();
+            for (size_t i = 0; ok && i < lsh->size(); ++i) {
+                Entry const &a = lsh->record(i);
+                Entry const &b = lsh_index->record(i);
+                ok = a.key.object == b.key.object && a.key.tag == b.key.tag && a.slot == b.slot;
+            }
+            if (!ok) {
+                delete lsh;
+                return false;
+            }
+            LOG(info) << "LSH tables recovered for " << lsh->hashed() << " of " << lsh_index->size() << " features.";
+            reindex_from(lsh->size(), lsh);
+            return true;
         }
 
     public:
-        LSHIndex (Config const &config_): Index(config_), config(config_), indexed_size(0), lsh_index(nullptr) {
+        LSHIndex (Config const &config_): Index(config_), config(config_), indexed_size(0),
+            num_tables(config.get<unsigned>("donkey.lsh.tables", 8)),
+            hash_bits(config.get<unsigned>("donkey.lsh.bits", 18)),
+            num_functions(config.get<unsigned>("donkey.lsh.functions", Hasher::Family::DEFAULT_K)),
+            width(config.get<float>("donkey.lsh.w", 4.0)),
+            default_P(config.get<unsigned>("donkey.lsh.probes", 1)),
+            huge_pages(config.get<int>("donkey.lsh.huge_pages", 0) != 0),
+            deferred(true),
+            hasher(nullptr), lsh_index(nullptr) {
+            if (default_P == 0) throw ConfigError("invalid lsh.probes");
             string l1 = config.get<string>("donkey.lsh.search.params_l1", "");
             search_params_l1.decode(l1);
-            create_index();
+            create_hasher(config.get<uint32_t>("donkey.lsh.seed", 2016));
+            lsh_index = create_index();
         }
 
         ~LSHIndex () {
-            if (lsh_index) {
-                delete lsh_index;
-            }
+            delete lsh_index;
+            delete hasher;
         }
 
         virtual void search (Feature const &query, SearchRequest const &sp, std::vector<Match> *matches) const {
             matches->clear();
-            if (lsh_index) {
-                int K = sp.hint_K;
-                if (K <= 0) K = default_K;
-                float R = sp.hint_R;
-                if (!isnormal(R)) R = default_R;
-                vector<std::pair<Key, float>> m;
-                lsh_index->search(query, R, &m, sp.params_l1);
-                //TODO: use sp.hint_K, too
-                matches->resize(m.size());
-                for (unsigned i = 0; i < m.size(); ++i) {
-                    auto &to = matches->at(i);
-                    auto const &from = m[i];
-                    to.object = from.first.object;
-                    to.tag = from.first.tag;
-                    to.distance = from.second;
-                }
-                if (matches->size() > K) {
-                    if (FeatureSimilarity::POLARITY >= 0) {
-                        sort(matches->begin(),
-                             matches->end(),
-                             [](Match const &h1, Match const &h2) { return h1.distance > h2.distance;});
-                    }
-                    else {
-                        sort(matches->begin(),
-                             matches->end(),
-                             [](Match const &h1, Match const &h2) { return h1.distance < h2.distance;});
-                    }
-                    matches->resize(K);
-                }
+            int K = sp.hint_K;
+            if (K <= 0) K = default_K;
+            float R = sp.hint_R;
+            if (!isnormal(R)) R = default_R;
+            int P = sp.hint_P;
+            if (P <= 0) P = default_P;
+            vector<std::pair<Entry, float>> m;
+            LSHConfig::QUERY_TYPE q{query, FeatureSimilarityOps::norm(query)};
+            lsh_index->search(q, FeatureSimilarity::rank(R), K, P, &m, sp.params_l1);
+            matches->resize(m.size());
+            for (unsigned i = 0; i < m.size(); ++i) {
+                auto &to = matches->at(i);
+                auto const &from = m[i];
+                to.object = from.first.key.object;
+                to.tag = from.first.key.tag;
+                // exact value for the reported match
+                to.distance = FeatureSimilarity::apply(features[from.first.slot], query, sp.params_l1);
             }
         }
 
@@ -112,21 +184,58 @@ namespace donkey {
             Entry e;
             e.key.object = object;
             e.key.tag = tag;
-            e.feature = feature;
-            lsh_index->append(e);
+            e.slot = features.append(*feature, FeatureSimilarityOps::norm(*feature));
+            lsh_index->append(e, !deferred);
             ++indexed_size;
         }
 
+        // memory is given back, the hash functions stay
         virtual void clear () {
-            if (lsh_index) {
-                delete lsh_index;
-                lsh_index = nullptr;
-            }
+            lsh_index->clear();
+            features.clear();
             indexed_size = 0;
         }
 
         virtual void rebuild () {   // insert must not happen at this time
-            LOG(info) << "rebuild: we can do without rebuild for now.";
+            deferred = false;
+            lsh_index->hash_pending();
+        }
+
+        // The snapshot is a text line with what the hash functions are
+        // generated from, followed by the binary dump of lsh::Index.
+        // The hash functions are regenerated from the saved seed, so
+        // tables stay valid across restarts even if the configured seed
+        // changes; if the snapshot doesn't fit, entries are hashed again.
+        virtual void recover (string const &path) {
+            std::ifstream is(path.c_str(), std::ios::binary);
+            string magic, family;
+            uint32_t seed;
+            unsigned K;
+            float w;
+            if ((is >> magic >> family >> seed >> K >> w) && magic == "lsh" && family == Hasher::Family::name()) {
+                if (seed != hasher->get_seed()) {
+                    LOG(info) << "LSH seed " << seed << " recovered.";
+                    create_hasher(seed);
+                    // entries hashed so far are no longer valid
+                    LSHImpl *lsh = create_index();
+                    deferred = true;
+                    reindex_from(0, lsh);
+                }
+                is.ignore(1);   // end of line
+                if (!(K == num_functions && w == width && load(is))) {
+                    LOG(info) << "LSH tables not recovered, hashing " << indexed_size << " features.";
+                }
+            }
+            rebuild();
+        }
+
+        virtual void snapshot (string const &path) const {
+            std::ofstream os(path.c_str(), std::ios::binary);
+            // w in full, recover compares it exactly
+            os << "lsh " << Hasher::Family::name() << ' ' << hasher->get_seed()
+               << ' ' << num_functions << ' ' << std::setprecision(std::numeric_limits<float>::max_digits10)
+               << width << std::endl;
+            lsh_index->save(os);
         }
     };
 
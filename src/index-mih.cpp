@@ -0,0 +1,242 @@
+#include <algorithm>
+#include <unordered_map>
+#include "donkey.h"
+
+namespace donkey {
+
+    // only used in decltype
+    template <typename T, unsigned D>
+    std::true_type mih_supported (distance::Hamming<T, D> const *);
+    std::false_type mih_supported (void const *);
+
+    // Multi-index hashing (Norouzi et al., CVPR 2012) for exact Hamming
+    // search.  The B-bit codes are cut into m substrings (donkey.mih.m,
+    // 16-bit ones by default), each indexed by its own hash table.  By
+    // the pigeonhole principle a code within distance m (s + 1) - 1 of
+    // the query matches it within distance s on some substring, so
+    // probing every table with all keys within s of the query's
+    // substring, s = 0, 1, ..., finds all codes within that distance.
+    // Search stops as soon as the K best are known, or the radius
+    // hint_R is covered, so results are exact.  When probing the keys
+    // of the next s would cost more than a scan, the rest is scanned
+    // linearly.
+    //
+    // Insert is incremental, there is nothing to rebuild or save.
+    //
+    // Index is not mutex-protected.
+    class MIHIndex: public Index {
+        struct Entry {
+            uint32_t object;
+            uint32_t tag;
+        };
+
+        // Substrings of up to 16 bits index a flat array of buckets,
+        // longer ones a hash map.
+        struct Table {
+            unsigned begin;     // first bit
+            unsigned bits;      // <= 32
+            vector<vector<uint32_t>> flat;
+            std::unordered_map<uint32_t, vector<uint32_t>> map;
+
+            vector<uint32_t> const *find (uint32_t key) const {
+                if (bits <= 16) {
+                    return flat[key].empty() ? nullptr : &flat[key];
+                }
+                auto it = map.find(key);
+                return it == map.end() ? nullptr : &it->second;
+            }
+
+            void add (uint32_t key, uint32_t id) {
+                if (bits <= 16) {
+                    flat[key].push_back(id);
+                }
+                else {
+                    map[key].push_back(id);
+                }
+            }
+        };
+
+        typedef std::pair<float, uint32_t> Candidate;
+
+        static unsigned constexpr BATCH = 64;
+        // a probe (cache misses on the bucket and its codes) costs about
+        // as much as scanning this many codes
+        static unsigned constexpr PROBE_COST = 128;
+        static unsigned constexpr BYTES = sizeof(Feature::data);
+        static unsigned constexpr B = BYTES * 8;
+
+        vector<Entry> entries;
+        FeatureArena<Feature> features;
+        vector<Table> tables;
+
+        // bits [begin, begin + bits) of the code, bits counted from
+        // the lowest of the first chunk on (little endian)
+        static uint32_t substring (Feature const &f, unsigned begin, unsigned bits) {
+            uint8_t const *p = reinterpret_cast<uint8_t const *>(&f.data[0]);
+            unsigned first = begin / 8;
+            uint64_t v = 0;
+            memcpy(&v, p + first, std::min(BYTES - first, 8u));
+            v >>= begin % 8;
+            return uint32_t(v & ((uint64_t(1) << bits) - 1));
+        }
+
+        // C(n, k), saturated
+        static size_t choose (unsigned n, unsigned k) {
+            if (k > n) return 0;
+            double v = 1;
+            for (unsigned i = 0; i < k; ++i) {
+                v = v * (n - i) / (i + 1);
+            }
+            return v > 1e18 ? size_t(1e18) : size_t(v + 0.5);
+        }
+
+    public:
+        MIHIndex (Config const &config): Index(config) {
+            if (!decltype(mih_supported(static_cast<FeatureSimilarity const *>(nullptr)))::value) {
+                throw ConfigError("mih index needs Hamming distance");
+            }
+            unsigned m = config.get<unsigned>("donkey.mih.m", (B + 15) / 16);
+            if (m == 0 || m > B || (B + m - 1) / m > 32) {
+                throw ConfigError("invalid mih.m, substrings must have 1 to 32 bits");
+            }
+            tables.resize(m);
+            unsigned begin = 0;
+            for (unsigned i = 0; i < m; ++i) {
+                Table &t = tables[i];
+                t.begin = begin;
+                t.bits = B / m + (i < B % m);
+                if (t.bits <= 16) {
+                    t.flat.resize(size_t(1) << t.bits);
+                }
+                begin += t.bits;
+            }
+        }
+
+        virtual void search (Feature const &query, SearchRequest const &sp, std::vector<Match> *matches) const {
+            matches->clear();
+            int K = sp.hint_K;
+            float R = sp.hint_R;
+            if (K <= 0) K = default_K;
+            if (!isnormal(R)) R = default_R;
+            R = FeatureSimilarity::rank(R);
+            unsigned m = tables.size();
+            size_t N = entries.size();
+            vector<Candidate> heap;     // max-heap of the best K so far
+            vector<uint64_t> visited((N + 63) / 64, 0);
+            uint32_t ids[BATCH];
+            Feature const *ptrs[BATCH];
+            float dists[BATCH];
+            unsigned pending = 0;
+            auto flush = [&]() {
+                FeatureSimilarityOps::apply_many(query, ptrs, pending, sp.params_l1, dists);
+                for (unsigned j = 0; j < pending; ++j) {
+                    float d = dists[j];
+                    if (d > R) continue;
+                    if (heap.size() >= unsigned(K)) {
+                        if (!(d < heap.front().first)) continue;
+                        std::pop_heap(heap.begin(), heap.end());
+                        heap.pop_back();
+                    }
+                    heap.emplace_back(d, ids[j]);
+                    std::push_heap(heap.begin(), heap.end());
+                }
+                pending = 0;
+            };
+            auto add = [&](uint32_t id) {
+                uint64_t bit = uint64_t(1) << (id % 64);
+                if (visited[id / 64] & bit) return;
+                visited[id / 64] |= bit;
+                ids[pending] = id;
+                ptrs[pending] = features.at(id);
+                if (++pending == BATCH) flush();
+            };
+            vector<uint32_t> keys(m);
+            unsigned max_bits = 0;
+            for (unsigned i = 0; i < m; ++i) {
+                keys[i] = substring(query, tables[i].begin, tables[i].bits);
+                max_bits = std::max(max_bits, tables[i].bits);
+            }
+            for (unsigned s = 0; s <= max_bits && N; ++s) {
+                size_t probes = 0;
+                for (auto const &t: tables) {
+                    probes += choose(t.bits, s);
+                }
+                if (probes * PROBE_COST > N) {  // cheaper to scan the rest
+                    for (uint32_t id = 0; id < N; ++id) {
+                        add(id);
+                    }
+                    break;
+                }
+                for (unsigned i = 0; i < m; ++i) {
+                    Table const &t = tables[i];
+                    if (s > t.bits) continue;
+                    // all masks of s bits out of t.bits, in increasing order
+                    uint64_t end = uint64_t(1) << t.bits;
+                    for (uint64_t mask = (uint64_t(1) << s) - 1; mask < end;) {
+                        vector<uint32_t> const *bucket = t.find(keys[i] ^ uint32_t(mask));
+                        if (bucket) {
+                            for (uint32_t id: *bucket) {
+                                add(id);
+                            }
+                        }
+                        if (mask == 0) break;
+                        uint64_t c = mask & -mask;      // Gosper's hack
+                        uint64_t r = mask + c;
+                        mask = (((r ^ mask) >> 2) / c) | r;
+                    }
+                }
+                flush();
+                // every code within this distance has been seen
+                float covered = float(m) * (s + 1) - 1;
+                if (covered >= R) break;
+                if (heap.size() >= unsigned(K) && heap.front().first <= covered) break;
+            }
+            flush();
+            std::sort_heap(heap.begin(), heap.end());
+            matches->resize(heap.size());
+            for (unsigned i = 0; i < heap.size(); ++i) {
+                auto &mt = matches->at(i);
+                auto const &e = entries[heap[i].second];
+                mt.object = e.object;
+                mt.tag = e.tag;
+                mt.distance = FeatureSimilarity::apply(features[heap[i].second], query, sp.params_l1);
+            }
+        }
+
+        virtual void insert (uint32_t object, uint32_t tag, Feature const *feature) {
+            Entry e;
+            e.object = object;
+            e.tag = tag;
+            uint32_t id = entries.size();
+            entries.push_back(e);
+            features.append(*feature);
+            for (auto &t: tables) {
+                t.add(substring(*feature, t.begin, t.bits), id);
+            }
+        }
+
+        virtual void clear () {
+            vector<Entry>().swap(entries);
+            features.clear();
+            for (auto &t: tables) {
+                for (auto &b: t.flat) {
+                    vector<uint32_t>().swap(b);
+                }
+                t.map.clear();
+            }
+        }
+
+        virtual void rebuild () {
+        }
+
+        virtual void recover (string const &) {
+        }
+
+        virtual void snapshot (string const &) const {
+        }
+    };
+
+    Index *create_mih_index (Config const &config) {
+        return new MIHIndex(config);
+    }
+}
@@ -0,0 +1,462 @@
+#include <random>
+#include <algorithm>
+#include <type_traits>
+#include "donkey.h"
+
+namespace donkey {
+
+    // Product quantization (Jegou et al., PAMI 2011): a feature is split
+    // into M sub-vectors, each encoded by the nearest of 2^bits
+    // centroids of its own k-means codebook, so the index keeps M bytes
+    // (M/2 with 4-bit codes) per feature.  A query computes one table
+    // of distances to the centroids per sub-vector, and the estimated
+    // distance of a code is the sum of M table lookups (asymmetric
+    // distance).  4-bit codes are scanned 32 at a time with the pq4_scan
+    // SIMD kernel on tables quantized to bytes.
+    //
+    // The best donkey.pq.rerank estimates are re-ranked against the full
+    // precision features, which are not copied but kept in the DB
+    // records.  Cosine features are encoded normalized.
+    //
+    // Codebooks are trained by rebuild() once there are donkey.pq.min
+    // features; until then, and for features not encoded yet, search
+    // is exact.
+    //
+    // Index is not mutex-protected.
+    template <typename F, int METRIC>
+    class PQIndex: public Index {
+        static unsigned constexpr D = F::DIM;
+        static unsigned constexpr BATCH = 64;
+        static uint64_t constexpr MAGIC = 0x31305150;     // "PQ01"
+
+        struct Entry {
+            uint32_t object;
+            uint32_t tag;
+        };
+
+        typedef std::pair<float, uint32_t> Candidate;
+
+        unsigned M;             // sub-quantizers
+        unsigned bits;          // 4 or 8
+        unsigned KS;            // centroids per sub-quantizer
+        unsigned dsub;          // dimensions per sub-quantizer
+        unsigned rerank;
+        size_t min_train;
+        size_t max_sample;
+        unsigned iterations;
+        uint32_t seed;
+
+        vector<Entry> entries;
+        vector<F const *> features;     // full precision, in the DB records
+        vector<float> norms;
+        vector<float> codebooks;        // M * KS * dsub, empty if not trained
+        // 8 bits: M bytes per feature; 4 bits: the block layout of
+        // pq4_scan, 32 features per block
+        vector<uint8_t> codes;
+        size_t encoded;                 // features [0, encoded) have codes
+        // Features replayed from the journal are not encoded until
+        // recover() has had a chance to load the codes.
+        bool deferred;
+
+        static unsigned default_M () {
+            unsigned d = 8;
+            while (D % d) ++d;
+            return D / d;
+        }
+
+        // the vector that is quantized
+        void prepare (F const &f, float norm, float *x) const {
+            float s = 1;
+            if (METRIC == VECTOR_COSINE && norm > 0) {
+                s = 1 / std::sqrt(norm);
+            }
+            for (unsigned i = 0; i < D; ++i) {
+                x[i] = f.data[i] * s;
+            }
+        }
+
+        // distance of a sub-vector to a centroid in the tables
+        static float sub_distance (float const *a, float const *b, unsigned n) {
+            float v = 0;
+            for (unsigned i = 0; i < n; ++i) {
+                if (METRIC == VECTOR_L1) {
+                    v += std::abs(a[i] - b[i]);
+                }
+                else if (METRIC == VECTOR_L2) {
+                    float d = a[i] - b[i];
+                    v += d * d;
+                }
+                else {
+                    v -= a[i] * b[i];
+                }
+            }
+            return v;
+        }
+
+        // nearest centroid of a sub-quantizer codebook by L2, which is what the
+        // codebooks are trained for
+        unsigned encode_sub (float const *x, float const *book) const {
+            unsigned best = 0;
+            float best_d = std::numeric_limits<float>::max();
+            for (unsigned c = 0; c < KS; ++c) {
+                float const *y = book + c * dsub;
+                float d = 0;
+                for (unsigned i = 0; i < dsub; ++i) {
+                    float t = x[i] - y[i];
+                    d += t * t;
+                }
+                if (d < best_d) {
+                    best_d = d;
+                    best = c;
+                }
+            }
+            return best;
+        }
+
+        void encode (uint32_t id, uint8_t *code) const {
+            float x[D];
+            prepare(*features[id], norms[id], x);
+            for (unsigned k = 0; k < M; ++k) {
+                code[k] = encode_sub(x + k * dsub, &codebooks[size_t(k) * KS * dsub]);
+            }
+        }
+
+        void append_code (uint32_t id, uint8_t const *code) {
+            if (bits == 8) {
+                codes.insert(codes.end(), code, code + M);
+                return;
+            }
+            unsigned j = id % 32;
+            if (j == 0) {
+                codes.resize(codes.size() + M * 16, 0);
+            }
+            uint8_t *block = &codes[size_t(id / 32) * M * 16];
+            for (unsigned k = 0; k < M; ++k) {
+                block[k * 16 + (j & 15)] |= j < 16 ? code[k] : code[k] << 4;
+            }
+        }
+
+        // encode features [encoded, size)
+        void encode_pending () {
+            if (codebooks.empty()) return;
+            size_t n = features.size() - encoded;
+            vector<uint8_t> tmp(n * M);
+#pragma omp parallel for schedule(dynamic, 256)
+            for (size_t i = 0; i < n; ++i) {
+                encode(encoded + i, &tmp[i * M]);
+            }
+            for (size_t i = 0; i < n; ++i) {
+                append_code(encoded + i, &tmp[i * M]);
+            }
+            encoded = features.size();
+        }
+
+        // k-means of each sub-quantizer on a sample, in parallel
+        void train () {
+            size_t N = features.size();
+            vector<uint32_t> sample(N);
+            for (uint32_t i = 0; i < N; ++i) sample[i] = i;
+            std::mt19937 rng(seed);
+            std::shuffle(sample.begin(), sample.end(), rng);
+            if (sample.size() > max_sample) sample.resize(max_sample);
+            size_t S = sample.size();
+            vector<float> data(S * D);
+            for (size_t i = 0; i < S; ++i) {
+                prepare(*features[sample[i]], norms[sample[i]], &data[i * D]);
+            }
+            codebooks.resize(size_t(M) * KS * dsub);
+#pragma omp parallel for schedule(dynamic, 1)
+            for (unsigned k = 0; k < M; ++k) {
+                std::mt19937 krng(seed + k);
+                float *book = &codebooks[size_t(k) * KS * dsub];
+                for (unsigned c = 0; c < KS; ++c) {
+                    size_t s = krng() % S;
+                    std::copy(&data[s * D + k * dsub], &data[s * D + (k + 1) * dsub], book + c * dsub);
+                }
+                vector<unsigned> assign(S);
+                vector<double> sum(size_t(KS) * dsub);
+                vector<unsigned> count(KS);
+                for (unsigned it = 0; it < iterations; ++it) {
+                    std::fill(sum.begin(), sum.end(), 0);
+                    std::fill(count.begin(), count.end(), 0);
+                    for (size_t i = 0; i < S; ++i) {
+                        float const *x = &data[i * D + k * dsub];
+                        unsigned c = encode_sub(x, book);
+                        ++count[c];
+                        for (unsigned d = 0; d < dsub; ++d) {
+                            sum[c * dsub + d] += x[d];
+                        }
+                    }
+                    for (unsigned c = 0; c < KS; ++c) {
+                        if (count[c] == 0) {    // re-seed empty clusters
+                            size_t s = krng() % S;
+                            std::copy(&data[s * D + k * dsub], &data[s * D + (k + 1) * dsub], book + c * dsub);
+                            continue;
+                        }
+                        for (unsigned d = 0; d < dsub; ++d) {
+                            book[c * dsub + d] = sum[c * dsub + d] / count[c];
+                        }
+                    }
+                }
+            }
+            codes.clear();
+            encoded = 0;
+        }
+
+        // top n of the estimates, sorted
+        void scan (F const &query, unsigned n, vector<Candidate> *out) const {
+            float q[D];
+            for (unsigned i = 0; i < D; ++i) {
+                q[i] = query.data[i];
+            }
+            vector<float> tables(size_t(M) * KS);
+            for (unsigned k = 0; k < M; ++k) {
+                for (unsigned c = 0; c < KS; ++c) {
+                    tables[k * KS + c] = sub_distance(q + k * dsub, &codebooks[(size_t(k) * KS + c) * dsub], dsub);
+                }
+            }
+            vector<Candidate> &heap = *out;     // max-heap of the best n so far
+            heap.clear();
+            auto push = [&heap, n](float d, uint32_t id) {
+                if (heap.size() >= n) {
+                    if (!(d < heap.front().first)) return;
+                    std::pop_heap(heap.begin(), heap.end());
+                    heap.pop_back();
+                }
+                heap.emplace_back(d, id);
+                std::push_heap(heap.begin(), heap.end());
+            };
+            if (bits == 8) {
+                uint8_t const *code = codes.data();
+                for (uint32_t i = 0; i < encoded; ++i, code += M) {
+                    float d = 0;
+                    for (unsigned k = 0; k < M; ++k) {
+                        d += tables[k * KS + code[k]];
+                    }
+                    push(d, i);
+                }
+            }
+            else {
+                // tables quantized to bytes with one scale, so the sums
+                // of all sub-quantizers compare
+                float range = 0;
+                vector<float> base(M);
+                for (unsigned k = 0; k < M; ++k) {
+                    float const *t = &tables[k * KS];
+                    base[k] = *std::min_element(t, t + KS);
+                    range = std::max(range, *std::max_element(t, t + KS) - base[k]);
+                }
+                float scale = range > 0 ? 255 / range : 0;
+                vector<uint8_t> luts(size_t(M) * KS);
+                for (size_t i = 0; i < luts.size(); ++i) {
+                    luts[i] = uint8_t(std::lround((tables[i] - base[i / KS]) * scale));
+                }
+                static unsigned constexpr BLOCKS = 32;
+                uint16_t dists[BLOCKS * 32];
+                size_t blocks = (encoded + 31) / 32;
+                for (size_t b = 0; b < blocks; b += BLOCKS) {
+                    unsigned nb = std::min<size_t>(blocks - b, BLOCKS);
+                    simd::active->pq4_scan(&codes[b * M * 16], nb, M, &luts[0], dists);
+                    uint32_t first = b * 32;
+                    unsigned m = std::min<size_t>(encoded - first, nb * 32);
+                    for (unsigned i = 0; i < m; ++i) {
+                        push(dists[i], first + i);
+                    }
+                }
+            }
+            std::sort_heap(heap.begin(), heap.end());
+        }
+
+        template <typename T>
+        static void write (ostream &os, T const *p, size_t n) {
+            os.write(reinterpret_cast<char const *>(p), n * sizeof(T));
+        }
+
+        template <typename T>
+        static bool read (istream &is, T *p, size_t n) {
+            return bool(is.read(reinterpret_cast<char *>(p), n * sizeof(T)));
+        }
+
+        size_t code_bytes (size_t n) const {
+            return bits == 8 ? n * M : (n + 31) / 32 * M * 16;
+        }
+
+        // load codebooks and codes saved by snapshot() if they cover a
+        // prefix of the features we have
+        bool load (istream &is) {
+            uint64_t header[6];
+            if (!read(is, header, 6) || header[0] != MAGIC || header[1] != D
+                    || header[2] != M || header[3] != bits || header[4] != KS
+                    || header[5] > features.size()) {
+                return false;
+            }
+            size_t n = header[5];
+            vector<float> books(size_t(M) * KS * dsub);
+            vector<Entry> saved(n);
+            vector<uint8_t> saved_codes(code_bytes(n));
+            if (!read(is, &books[0], books.size()) || !read(is, saved.data(), n)
+                    || !read(is, saved_codes.data(), saved_codes.size())) {
+                return false;
+            }
+            for (size_t i = 0; i < n; ++i) {
+                if (saved[i].object != entries[i].object || saved[i].tag != entries[i].tag) {
+                    return false;
+                }
+            }
+            codebooks.swap(books);
+            codes.swap(saved_codes);
+            encoded = n;
+            return true;
+        }
+
+    public:
+        PQIndex (Config const &config):
+            Index(config),
+            M(config.get<unsigned>("donkey.pq.M", default_M())),
+            bits(config.get<unsigned>("donkey.pq.bits", 8)),
+            KS(1 << bits),
+            dsub(M ? D / M : 0),
+            rerank(config.get<unsigned>("donkey.pq.rerank", 100)),
+            min_train(config.get<size_t>("donkey.pq.min", 10000)),
+            max_sample(config.get<size_t>("donkey.pq.train.sample", 64 * 1024)),
+            iterations(config.get<unsigned>("donkey.pq.train.iterations", 16)),
+            seed(config.get<uint32_t>("donkey.pq.train.seed", 2016)),
+            encoded(0),
+            deferred(true) {
+            if (M == 0 || D % M) throw ConfigError("invalid pq.M, must divide the dimension");
+            if (bits != 4 && bits != 8) throw ConfigError("invalid pq.bits, must be 4 or 8");
+            if (bits == 4 && M > 257) throw ConfigError("invalid pq.M, at most 257 with 4 bits");
+        }
+
+        virtual void search (Feature const &query, SearchRequest const &sp, std::vector<Match> *matches) const {
+            matches->clear();
+            int K = sp.hint_K;
+            float R = sp.hint_R;
+            if (K <= 0) K = default_K;
+            if (!isnormal(R)) R = default_R;
+            R = FeatureSimilarity::rank(R);
+            if (FeatureSimilarity::POLARITY >= 0) {
+                R *= -1;
+            }
+            float query_norm = FeatureSimilarityOps::norm(query);
+            vector<Candidate> cands;
+            if (encoded) {
+                scan(query, std::max<unsigned>(rerank, K), &cands);
+            }
+            vector<uint32_t> ids(cands.size());
+            for (size_t i = 0; i < cands.size(); ++i) {
+                ids[i] = cands[i].second;
+            }
+            for (uint32_t i = encoded; i < features.size(); ++i) {
+                ids.push_back(i);
+            }
+            // exact re-rank
+            vector<Candidate> heap;
+            F const *ptrs[BATCH];
+            float ns[BATCH];
+            float dists[BATCH];
+            for (size_t i = 0; i < ids.size(); i += BATCH) {
+                unsigned m = std::min<size_t>(ids.size() - i, BATCH);
+                for (unsigned j = 0; j < m; ++j) {
+                    ptrs[j] = features[ids[i + j]];
+                    ns[j] = norms[ids[i + j]];
+                }
+                FeatureSimilarityOps::apply_many(query, query_norm, ptrs, ns, m, sp.params_l1, dists);
+                for (unsigned j = 0; j < m; ++j) {
+                    float d = FeatureSimilarity::POLARITY > 0 ? -dists[j] : dists[j];
+                    if (d > R) continue;
+                    if (heap.size() >= unsigned(K)) {
+                        if (!(d < heap.front().first)) continue;
+                        std::pop_heap(heap.begin(), heap.end());
+                        heap.pop_back();
+                    }
+                    heap.emplace_back(d, ids[i + j]);
+                    std::push_heap(heap.begin(), heap.end());
+                }
+            }
+            std::sort_heap(heap.begin(), heap.end());
+            matches->resize(heap.size());
+            for (unsigned i = 0; i < heap.size(); ++i) {
+                auto &m = matches->at(i);
+                auto const &e = entries[heap[i].second];
+                m.object = e.object;
+                m.tag = e.tag;
+                // exact value for the reported match
+                m.distance = FeatureSimilarity::apply(*features[heap[i].second], query, sp.params_l1);
+            }
+        }
+
+        // The feature lives in the DB record, which outlives the entry.
+        virtual void insert (uint32_t object, uint32_t tag, Feature const *feature) {
+            Entry e;
+            e.object = object;
+            e.tag = tag;
+            uint32_t id = entries.size();
+            entries.push_back(e);
+            features.push_back(feature);
+            norms.push_back(FeatureSimilarityOps::norm(*feature));
+            if (!deferred && codebooks.size()) {
+                vector<uint8_t> code(M);
+                encode(id, code.data());
+                append_code(id, code.data());
+                encoded = id + 1;
+            }
+        }
+
+        virtual void clear () {
+            vector<Entry>().swap(entries);
+            vector<F const *>().swap(features);
+            vector<float>().swap(norms);
+            vector<float>().swap(codebooks);
+            vector<uint8_t>().swap(codes);
+            encoded = 0;
+        }
+
+        // Train the codebooks if not yet, and encode what is not.
+        virtual void rebuild () {   // insert must not happen at this time
+            deferred = false;
+            if (codebooks.empty()) {
+                if (features.size() < std::max<size_t>(min_train, KS)) {
+                    if (features.size()) {
+                        LOG(info) << "PQ not trained for " << features.size() << " features, below pq.min.";
+                    }
+                    return;
+                }
+                LOG(info) << "Training PQ codebooks for " << features.size() << " features.";
+                train();
+            }
+            encode_pending();
+        }
+
+        virtual void recover (string const &path) {
+            std::ifstream is(path.c_str(), std::ios::binary);
+            if (is && encoded == 0 && load(is)) {
+                LOG(info) << "PQ codes recovered for " << encoded << " of " << features.size() << " features.";
+            }
+            rebuild();
+        }
+
+        virtual void snapshot (string const &path) const {
+            if (codebooks.empty()) return;
+            std::ofstream os(path.c_str(), std::ios::binary);
+            uint64_t header[] = {MAGIC, D, M, bits, KS, encoded};
+            write(os, header, 6);
+            write(os, &codebooks[0], codebooks.size());
+            write(os, entries.data(), encoded);
+            write(os, codes.data(), code_bytes(encoded));
+        }
+    };
+
+    static inline Index *create_pq (Config const &, std::integral_constant<int, VECTOR_NONE>) {
+        throw ConfigError("pq index needs float vector features with L1, L2 or cosine");
+    }
+
+    template <int METRIC>
+    static Index *create_pq (Config const &config, std::integral_constant<int, METRIC>) {
+        return new PQIndex<Feature, METRIC>(config);
+    }
+
+    Index *create_pq_index (Config const &config) {
+        return create_pq(config, decltype(vector_metric(static_cast<FeatureSimilarity const *>(nullptr)))());
+    }
+}
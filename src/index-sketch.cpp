@@ -0,0 +1,145 @@
+#include <algorithm>
+#include "donkey.h"
+#include "donkey-sketch.h"
+
+namespace donkey {
+
+    // Hamming prefilter with exact re-rank: a query ranks the binary
+    // sketches of all features (see SketchFilter) and only the
+    // donkey.sketch.pool features nearest by sketch are evaluated with
+    // the similarity.  The features are not copied but kept in the DB
+    // records, so the index costs one sketch per feature.
+    //
+    // Index is not mutex-protected.
+    class SketchIndex: public Index {
+        struct Entry {
+            uint32_t object;
+            uint32_t tag;
+        };
+
+        typedef std::pair<float, uint32_t> Candidate;
+        typedef SketchFilterOf<FeatureSimilarity, Feature>::type Filter;
+
+        static unsigned constexpr BATCH = 64;
+        static uint64_t constexpr MAGIC = 0x31544b53;   // "SKT1"
+
+        unsigned pool;
+        vector<Entry> entries;
+        vector<Feature const *> features;   // in the DB records
+        vector<float> norms;
+        Filter sketches;
+        // Features replayed from the journal are not sketched until
+        // recover() has had a chance to load the sketches.
+        bool deferred;
+
+    public:
+        SketchIndex (Config const &config):
+            Index(config),
+            pool(config.get<unsigned>("donkey.sketch.pool", 1000)),
+            sketches(config),
+            deferred(true) {
+            if (!Filter::ENABLED) throw ConfigError("sketch index needs float vector features with L1, L2 or cosine");
+        }
+
+        virtual void search (Feature const &query, SearchRequest const &sp, std::vector<Match> *matches) const {
+            matches->clear();
+            int K = sp.hint_K;
+            float R = sp.hint_R;
+            if (K <= 0) K = default_K;
+            if (!isnormal(R)) R = default_R;
+            R = FeatureSimilarity::rank(R);
+            if (FeatureSimilarity::POLARITY >= 0) {
+                R *= -1;
+            }
+            float query_norm = FeatureSimilarityOps::norm(query);
+            vector<uint32_t> ids;
+            sketches.select(query, 0, entries.size(), std::max<unsigned>(pool, K), &ids);
+            vector<Candidate> heap;     // max-heap of the best K so far
+            Feature const *ptrs[BATCH];
+            float ns[BATCH];
+            float dists[BATCH];
+            for (size_t i = 0; i < ids.size(); i += BATCH) {
+                unsigned m = std::min<size_t>(ids.size() - i, BATCH);
+                for (unsigned j = 0; j < m; ++j) {
+                    ptrs[j] = features[ids[i + j]];
+                    ns[j] = norms[ids[i + j]];
+                }
+                FeatureSimilarityOps::apply_many(query, query_norm, ptrs, ns, m, sp.params_l1, dists);
+                for (unsigned j = 0; j < m; ++j) {
+                    float d = FeatureSimilarity::POLARITY > 0 ? -dists[j] : dists[j];
+                    if (d > R) continue;
+                    if (heap.size() >= unsigned(K)) {
+                        if (!(d < heap.front().first)) continue;
+                        std::pop_heap(heap.begin(), heap.end());
+                        heap.pop_back();
+                    }
+                    heap.emplace_back(d, ids[i + j]);
+                    std::push_heap(heap.begin(), heap.end());
+                }
+            }
+            std::sort_heap(heap.begin(), heap.end());
+            matches->resize(heap.size());
+            for (unsigned i = 0; i < heap.size(); ++i) {
+                auto &m = matches->at(i);
+                auto const &e = entries[heap[i].second];
+                m.object = e.object;
+                m.tag = e.tag;
+                // exact value for the reported match
+                m.distance = FeatureSimilarity::apply(*features[heap[i].second], query, sp.params_l1);
+            }
+        }
+
+        // The feature lives in the DB record, which outlives the entry.
+        virtual void insert (uint32_t object, uint32_t tag, Feature const *feature) {
+            Entry e;
+            e.object = object;
+            e.tag = tag;
+            entries.push_back(e);
+            features.push_back(feature);
+            norms.push_back(FeatureSimilarityOps::norm(*feature));
+            sketches.append(&feature->data[0], deferred);
+        }
+
+        virtual void clear () {
+            vector<Entry>().swap(entries);
+            vector<Feature const *>().swap(features);
+            vector<float>().swap(norms);
+            sketches.clear();
+        }
+
+        virtual void rebuild () {   // insert must not happen at this time
+            deferred = false;
+            sketches.finish();
+        }
+
+        // load the sketches of a prefix of the entries we have
+        virtual void recover (string const &path) {
+            std::ifstream is(path.c_str(), std::ios::binary);
+            uint64_t header[2];
+            if (is && is.read(reinterpret_cast<char *>(header), sizeof(header))
+                    && header[0] == MAGIC && header[1] <= entries.size()) {
+                vector<Entry> saved(header[1]);
+                bool ok = bool(is.read(reinterpret_cast<char *>(saved.data()), saved.size() * sizeof(Entry)));
+                for (size_t i = 0; ok && i < saved.size(); ++i) {
+                    ok = saved[i].object == entries[i].object && saved[i].tag == entries[i].tag;
+                }
+                if (ok && sketches.load(is)) {
+                    LOG(info) << "Sketches recovered for " << sketches.sketched() << " of " << entries.size() << " features.";
+                }
+            }
+            rebuild();
+        }
+
+        virtual void snapshot (string const &path) const {
+            std::ofstream os(path.c_str(), std::ios::binary);
+            uint64_t header[] = {MAGIC, sketches.sketched()};
+            os.write(reinterpret_cast<char const *>(header), sizeof(header));
+            os.write(reinterpret_cast<char const *>(entries.data()), header[1] * sizeof(Entry));
+            sketches.save(os);
+        }
+    };
+
+    Index *create_sketch_index (Config const &config) {
+        return new SketchIndex(config);
+    }
+}
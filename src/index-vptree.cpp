@@ -0,0 +1,356 @@
+#include <random>
+#include <limits>
+#include <algorithm>
+#include "donkey.h"
+
+namespace donkey {
+
+    // Vantage-point tree (Yianilos, SODA 1993) for any metric distance.
+    // Each inner node splits its features at the median distance to a
+    // random vantage point and keeps, for both halves, the range of
+    // their distances to it; by the triangle inequality a subtree whose
+    // range is farther than the current search radius from d(q, vp)
+    // cannot hold a match.  Nodes are visited best bound first, and
+    // search stops once the bound exceeds the K-th best distance or
+    // hint_R, so results are exact.  The bounds only hold for the
+    // metric they were built with, so search, too, uses the params of
+    // donkey.vptree.params_l1 and ignores those of the request.
+    //
+    // Features are kept in tree order in one arena: an inner node's
+    // vantage point, then its inner and outer subtrees, so a leaf of up
+    // to donkey.vptree.leaf features is a contiguous batch.  The tree
+    // is built by rebuild() level by level, the distances to the
+    // vantage points of a level in parallel; features inserted later
+    // are appended to the arena and scanned linearly until the next
+    // rebuild().
+    //
+    // Index is not mutex-protected.
+    class VPTreeIndex: public Index {
+        struct Entry {
+            uint32_t object;
+            uint32_t tag;
+        };
+
+        struct Node {
+            uint32_t begin;     // leaf: first slot, inner node: slot of the vantage point
+            uint32_t end;       // leaf: past the last slot
+            uint32_t inner;     // children, 0 for a leaf
+            uint32_t outer;
+            float bounds[4];    // [min, max] distance to the vantage point of inner and outer
+        };
+
+        typedef std::pair<float, uint32_t> Candidate;
+
+        static unsigned constexpr BATCH = 64;
+        static unsigned constexpr CHUNK = 4096;     // distances evaluated by a thread at once
+        static uint64_t constexpr MAGIC = 0x31545056;   // "VPT1"
+
+        unsigned leaf_size;
+        uint32_t seed;
+        FeatureSimilarity::Params params_l1;
+
+        vector<Entry> entries;
+        FeatureArena<Feature> features;     // in tree order, then the tail
+        vector<uint32_t> ids;               // ids[slot] is the entry of features[slot]
+        vector<Node> nodes;                 // empty if not built
+        size_t built;                       // slots in the tree
+
+        // dists[i] <- distance of the query to features [begin, begin + n)
+        void distances (Feature const &query, FeatureArena<Feature> const &arena, size_t begin, unsigned n,
+                        FeatureSimilarity::Params const &params, float *dists) const {
+            Feature const *ptrs[BATCH];
+            for (unsigned i = 0; i < n; i += BATCH) {
+                unsigned m = n - i;
+                if (m > BATCH) m = BATCH;
+                for (unsigned j = 0; j < m; ++j) {
+                    ptrs[j] = arena.at(begin + i + j);
+                }
+                FeatureSimilarityOps::apply_many(query, ptrs, m, params, dists + i);
+            }
+        }
+
+        // Tree over the features in the arena; order[] gets the slots
+        // of the features in tree order.
+        void build (vector<uint32_t> *order) {
+            struct Segment {
+                uint32_t begin, end, node;
+            };
+            size_t N = features.size();
+            vector<Candidate> tree(N);     // distance to the vantage point, slot
+            for (uint32_t i = 0; i < N; ++i) {
+                tree[i] = Candidate(0, i);
+            }
+            nodes.clear();
+            nodes.resize(1);
+            vector<Segment> level{Segment{0, uint32_t(N), 0}};
+            std::mt19937 rng(seed);
+            while (level.size()) {
+                vector<Segment> split;
+                for (auto const &s: level) {
+                    Node &node = nodes[s.node];
+                    node.begin = s.begin;
+                    node.end = s.end;
+                    node.inner = node.outer = 0;
+                    uint32_t n = s.end - s.begin;
+                    if (n <= leaf_size) continue;
+                    std::swap(tree[s.begin], tree[s.begin + rng() % n]);
+                    node.inner = nodes.size();
+                    node.outer = nodes.size() + 1;
+                    split.push_back(s);
+                    nodes.resize(nodes.size() + 2);     // node is invalidated
+                }
+                // distances to the vantage points in chunks of all
+                // segments, so the first levels are parallel too
+                vector<Segment> chunks;
+                for (auto const &s: split) {
+                    for (uint32_t b = s.begin + 1; b < s.end; b += CHUNK) {
+                        chunks.push_back(Segment{b, std::min<uint32_t>(s.end, b + CHUNK), s.begin});
+                    }
+                }
+#pragma omp parallel for schedule(dynamic, 1)
+                for (size_t i = 0; i < chunks.size(); ++i) {
+                    Segment const &c = chunks[i];
+                    Feature const &vp = features[tree[c.node].second];
+                    Feature const *ptrs[BATCH];
+                    float dists[BATCH];
+                    for (uint32_t b = c.begin; b < c.end; b += BATCH) {
+                        unsigned m = std::min<uint32_t>(c.end - b, BATCH);
+                        for (unsigned j = 0; j < m; ++j) {
+                            ptrs[j] = features.at(tree[b + j].second);
+                        }
+                        FeatureSimilarityOps::apply_many(vp, ptrs, m, params_l1, dists);
+                        for (unsigned j = 0; j < m; ++j) {
+                            tree[b + j].first = dists[j];
+                        }
+                    }
+                }
+                // the inner half is at most as far as the outer one
+#pragma omp parallel for schedule(dynamic, 1)
+                for (size_t i = 0; i < split.size(); ++i) {
+                    Segment const &s = split[i];
+                    Node &node = nodes[s.node];
+                    auto begin = tree.begin() + s.begin + 1;
+                    auto mid = begin + (s.end - s.begin - 1) / 2;
+                    auto end = tree.begin() + s.end;
+                    std::nth_element(begin, mid, end);
+                    float *b = node.bounds;
+                    b[0] = b[2] = std::numeric_limits<float>::max();
+                    b[1] = b[3] = std::numeric_limits<float>::lowest();
+                    for (auto it = begin; it < end; ++it) {
+                        float *r = it < mid ? b : b + 2;
+                        r[0] = std::min(r[0], it->first);
+                        r[1] = std::max(r[1], it->first);
+                    }
+                }
+                level.clear();
+                for (auto const &s: split) {
+                    Node const &node = nodes[s.node];
+                    uint32_t mid = s.begin + 1 + (s.end - s.begin - 1) / 2;
+                    level.push_back(Segment{s.begin + 1, mid, node.inner});
+                    level.push_back(Segment{mid, s.end, node.outer});
+                }
+            }
+            order->resize(N);
+            for (size_t i = 0; i < N; ++i) {
+                order->at(i) = tree[i].second;
+            }
+        }
+
+        // Move the features into the order of the slots in order[],
+        // the first n of which are in the tree.
+        void arrange (vector<uint32_t> const &order, size_t n) {
+            FeatureArena<Feature> arena;
+            vector<uint32_t> arena_ids(order.size());
+            arena.reserve(order.size());
+            for (size_t i = 0; i < order.size(); ++i) {
+                arena.append(features[order[i]]);
+                arena_ids[i] = ids[order[i]];
+            }
+            features.swap(arena);
+            ids.swap(arena_ids);
+            built = n;
+        }
+
+    public:
+        VPTreeIndex (Config const &config):
+            Index(config),
+            leaf_size(config.get<unsigned>("donkey.vptree.leaf", 64)),
+            seed(config.get<uint32_t>("donkey.vptree.seed", 2016)),
+            built(0) {
+            if (FeatureSimilarity::POLARITY > 0) throw ConfigError("vptree index needs a metric distance");
+            if (leaf_size == 0) throw ConfigError("invalid vptree.leaf");
+            string l1 = config.get<string>("donkey.vptree.params_l1", "");
+            params_l1.decode(l1);
+        }
+
+        virtual void search (Feature const &query, SearchRequest const &sp, std::vector<Match> *matches) const {
+            matches->clear();
+            int K = sp.hint_K;
+            float R = sp.hint_R;
+            if (K <= 0) K = default_K;
+            if (!isnormal(R)) R = default_R;
+            vector<Candidate> heap;     // max-heap of the best K so far
+            auto radius = [&]() {
+                return heap.size() >= unsigned(K) ? std::min(R, heap.front().first) : R;
+            };
+            auto consider = [&](float d, uint32_t slot) {
+                if (d > R) return;
+                if (heap.size() >= unsigned(K)) {
+                    if (!(d < heap.front().first)) return;
+                    std::pop_heap(heap.begin(), heap.end());
+                    heap.pop_back();
+                }
+                heap.emplace_back(d, slot);
+                std::push_heap(heap.begin(), heap.end());
+            };
+            float dists[BATCH];
+            auto scan = [&](size_t begin, size_t end) {
+                for (; begin < end; begin += BATCH) {
+                    unsigned m = std::min<size_t>(end - begin, BATCH);
+                    distances(query, features, begin, m, params_l1, dists);
+                    for (unsigned i = 0; i < m; ++i) {
+                        consider(dists[i], begin + i);
+                    }
+                }
+            };
+            scan(built, features.size());
+            if (nodes.size()) {
+                vector<Candidate> queue{Candidate(0, 0)};   // min-heap of (bound, node)
+                auto later = [](Candidate const &a, Candidate const &b) {
+                    return a.first > b.first;
+                };
+                while (queue.size()) {
+                    std::pop_heap(queue.begin(), queue.end(), later);
+                    Candidate c = queue.back();
+                    queue.pop_back();
+                    if (c.first > radius()) break;
+                    Node const &node = nodes[c.second];
+                    if (node.inner == 0) {
+                        scan(node.begin, node.end);
+                        continue;
+                    }
+                    float d = FeatureSimilarityOps::apply(query, features[node.begin], params_l1);
+                    consider(d, node.begin);
+                    uint32_t children[] = {node.inner, node.outer};
+                    for (unsigned i = 0; i < 2; ++i) {
+                        float const *b = node.bounds + 2 * i;
+                        float bound = std::max(c.first, std::max(b[0] - d, d - b[1]));
+                        if (bound > radius()) continue;
+                        queue.emplace_back(bound, children[i]);
+                        std::push_heap(queue.begin(), queue.end(), later);
+                    }
+                }
+            }
+            std::sort_heap(heap.begin(), heap.end());
+            matches->resize(heap.size());
+            for (unsigned i = 0; i < heap.size(); ++i) {
+                auto &m = matches->at(i);
+                auto const &e = entries[ids[heap[i].second]];
+                m.object = e.object;
+                m.tag = e.tag;
+                m.distance = heap[i].first;
+            }
+        }
+
+        virtual void insert (uint32_t object, uint32_t tag, Feature const *feature) {
+            Entry e;
+            e.object = object;
+            e.tag = tag;
+            ids.push_back(entries.size());
+            entries.push_back(e);
+            features.append(*feature);
+        }
+
+        virtual void clear () {
+            vector<Entry>().swap(entries);
+            features.clear();
+            vector<uint32_t>().swap(ids);
+            vector<Node>().swap(nodes);
+            built = 0;
+        }
+
+        virtual void rebuild () {   // insert must not happen at this time
+            if (features.empty()) return;
+            LOG(info) << "Building vptree for " << features.size() << " features.";
+            vector<uint32_t> order;
+            build(&order);
+            arrange(order, order.size());
+            LOG(info) << "Vptree built with " << nodes.size() << " nodes.";
+        }
+
+        // Saved are the nodes and the entry of each slot in the tree;
+        // features replayed from the journal are put back in tree
+        // order, those not in the tree go to the tail.  Without a
+        // usable snapshot the tree is built again.
+        virtual void recover (string const &path) {
+            std::ifstream is(path.c_str(), std::ios::binary);
+            uint64_t header[5];
+            if (!is.read(reinterpret_cast<char *>(header), sizeof(header))
+                    || header[0] != MAGIC || header[1] != sizeof(Feature)
+                    || header[2] > entries.size() || header[3] == 0 || header[4] > header[2]) {
+                LOG(info) << "Vptree not recovered.";
+                rebuild();
+                return;
+            }
+            vector<Entry> saved_entries(header[2]);
+            vector<Node> saved_nodes(header[3]);
+            vector<uint32_t> saved_ids(header[4]);
+            if (!is.read(reinterpret_cast<char *>(saved_entries.data()), saved_entries.size() * sizeof(Entry))
+                    || !is.read(reinterpret_cast<char *>(saved_nodes.data()), saved_nodes.size() * sizeof(Node))
+                    || !is.read(reinterpret_cast<char *>(saved_ids.data()), saved_ids.size() * sizeof(uint32_t))) {
+                LOG(info) << "Vptree not recovered.";
+                rebuild();
+                return;
+            }
+            bool ok = true;
+            for (size_t i = 0; ok && i < saved_entries.size(); ++i) {
+                ok = saved_entries[i].object == entries[i].object && saved_entries[i].tag == entries[i].tag;
+            }
+            // slot of each entry, every saved one in the tree once
+            vector<uint32_t> slot(entries.size(), uint32_t(-1));
+            for (size_t i = 0; i < ids.size(); ++i) {
+                slot[ids[i]] = i;
+            }
+            vector<uint32_t> order;
+            vector<bool> seen(entries.size(), false);
+            for (size_t i = 0; ok && i < saved_ids.size(); ++i) {
+                uint32_t id = saved_ids[i];
+                ok = id < saved_entries.size() && !seen[id];
+                if (!ok) break;
+                seen[id] = true;
+                order.push_back(slot[id]);
+            }
+            for (auto const &node: saved_nodes) {
+                if (!ok) break;
+                ok = node.inner ? node.begin < header[4] && node.inner && node.inner < header[3]
+                                  && node.outer && node.outer < header[3]
+                                : node.begin <= node.end && node.end <= header[4];
+            }
+            if (!ok) {
+                LOG(info) << "Vptree not recovered.";
+                rebuild();
+                return;
+            }
+            for (size_t i = 0; i < ids.size(); ++i) {
+                if (!seen[ids[i]]) order.push_back(i);
+            }
+            arrange(order, saved_ids.size());
+            nodes.swap(saved_nodes);
+            LOG(info) << "Vptree recovered with " << built << " of " << entries.size() << " features.";
+        }
+
+        virtual void snapshot (string const &path) const {
+            if (nodes.empty()) return;
+            std::ofstream os(path.c_str(), std::ios::binary);
+            uint64_t header[] = {MAGIC, sizeof(Feature), entries.size(), nodes.size(), built};
+            os.write(reinterpret_cast<char const *>(header), sizeof(header));
+            os.write(reinterpret_cast<char const *>(entries.data()), entries.size() * sizeof(Entry));
+            os.write(reinterpret_cast<char const *>(nodes.data()), nodes.size() * sizeof(Node));
+            os.write(reinterpret_cast<char const *>(ids.data()), built * sizeof(uint32_t));
+        }
+    };
+
+    Index *create_vptree_index (Config const &config) {
+        return new VPTreeIndex(config);
+    }
+}
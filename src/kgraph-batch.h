@@ -0,0 +1,125 @@
+#ifndef AAALGO_KGRAPH_BATCH
+#define AAALGO_KGRAPH_BATCH
+
+#include <vector>
+#include <algorithm>
+#include <kgraph.h>
+#include "donkey-pool.h"
+
+// Extensions to the kgraph oracle interface.
+
+namespace kgraph {
+
+    // A search oracle that can also evaluate a batch of candidates
+    // with one virtual call.  Searchers that know about this interface
+    // (KGraphLite, linear scan) use the batched form; the plain KGraph
+    // library still sees an ordinary SearchOracle.
+    class BatchSearchOracle: public SearchOracle {
+    public:
+        static unsigned constexpr BATCH = 64;
+
+        using SearchOracle::operator ();
+        // dists[i] <- distance to candidate ids[i], i < n
+        virtual void operator () (unsigned const *ids, unsigned n, float *dists) const = 0;
+
+        // Same, but a distance known to be beyond the bound, the third
+        // argument, may be any value > bound, so evaluations can be
+        // abandoned early.  By default none is.
+        virtual void operator () (unsigned const *ids, unsigned n, float, float *dists) const {
+            operator () (ids, n, dists);
+        }
+
+        // Linear scan with batched evaluation, same contract as
+        // SearchOracle::search: up to K nearest within epsilon,
+        // sorted by distance, return the number found.
+        unsigned search (unsigned K, float epsilon, unsigned *ids, float *dists = nullptr) const {
+            return search(nullptr, size(), K, epsilon, ids, dists);
+        }
+
+        // Same over the candidates cands[0..n) only, or over [0, n)
+        // if cands is null.
+        unsigned search (unsigned const *cands, unsigned n, unsigned K, float epsilon, unsigned *ids, float *dists = nullptr) const {
+            std::vector<Pair> heap;
+            scan(cands, 0, n, K, epsilon, &heap);
+            return output(&heap, ids, dists);
+        }
+
+        // Same with the scan split into tasks of at least min_task
+        // candidates run on the pool, their best K merged at the end.
+        unsigned search (donkey::WorkerPool &pool, unsigned min_task, unsigned const *cands, unsigned n,
+                         unsigned K, float epsilon, unsigned *ids, float *dists = nullptr) const {
+            unsigned tasks = std::min(pool.concurrency(), n / std::max(min_task, 1u));
+            if (tasks <= 1) return search(cands, n, K, epsilon, ids, dists);
+            std::vector<std::vector<Pair>> heaps(tasks);
+            pool.run(tasks, [&](unsigned t) {
+                scan(cands, size_t(n) * t / tasks, size_t(n) * (t + 1) / tasks, K, epsilon, &heaps[t]);
+            });
+            std::vector<Pair> all;
+            for (auto const &h: heaps) {
+                all.insert(all.end(), h.begin(), h.end());
+            }
+            if (all.size() > K) {
+                std::nth_element(all.begin(), all.begin() + K, all.end());
+                all.resize(K);
+            }
+            std::make_heap(all.begin(), all.end());
+            return output(&all, ids, dists);
+        }
+
+    private:
+        typedef std::pair<float, unsigned> Pair;
+
+        // heap <- max-heap of the best K of the candidates [begin, end)
+        void scan (unsigned const *cands, unsigned begin, unsigned end, unsigned K, float epsilon, std::vector<Pair> *heap) const {
+            heap->clear();
+            if (K == 0) return;
+            heap->reserve(K + 1);
+            unsigned batch_ids[BATCH];
+            float batch_dists[BATCH];
+            for (; begin < end; begin += BATCH) {
+                unsigned m = end - begin;
+                if (m > BATCH) m = BATCH;
+                for (unsigned i = 0; i < m; ++i) {
+                    batch_ids[i] = cands ? cands[begin + i] : begin + i;
+                }
+                float bound = heap->size() >= K ? heap->front().first : epsilon;
+                operator () (batch_ids, m, bound, batch_dists);
+                for (unsigned i = 0; i < m; ++i) {
+                    float d = batch_dists[i];
+                    if (d > epsilon) continue;
+                    if (heap->size() >= K) {
+                        if (!(d < heap->front().first)) continue;
+                        std::pop_heap(heap->begin(), heap->end());
+                        heap->pop_back();
+                    }
+                    heap->push_back(std::make_pair(d, batch_ids[i]));
+                    std::push_heap(heap->begin(), heap->end());
+                }
+            }
+        }
+
+        // sort the heap into ids and dists, return the size
+        static unsigned output (std::vector<Pair> *heap, unsigned *ids, float *dists) {
+            std::sort_heap(heap->begin(), heap->end());
+            for (unsigned i = 0; i < heap->size(); ++i) {
+                if (ids) ids[i] = heap->at(i).second;
+                if (dists) dists[i] = heap->at(i).first;
+            }
+            return heap->size();
+        }
+    };
+
+    // compress: keep neighbor lists delta/varint packed in memory,
+    // about half the size, decoded as they are expanded.
+    KGraph *create_kgraph_lite (bool compress = false);
+
+    // Renumber the nodes of a graph of create_kgraph_lite breadth-first
+    // for locality; saved graphs keep the numbering.
+    void reorder_kgraph_lite (KGraph *graph);
+
+    // For a graph of create_kgraph_lite, node i stands for node
+    // order[i] of the graph as built; null if never renumbered.
+    unsigned const *kgraph_lite_order (KGraph const *graph);
+}
+
+#endif
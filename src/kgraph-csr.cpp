@@ -0,0 +1,67 @@
+#include <iostream>
+#include <memory>
+#include <boost/program_options.hpp>
+#include "kgraph.h"
+#include "kgraph-batch.h"
+
+using namespace std;
+
+namespace po = boost::program_options; 
+
+// Convert a KNNGRAPH index (kgraph_lite reads the FORMAT_NO_DIST
+// snapshots of the kgraph index) into the CSR layout kgraph_lite maps
+// in place, with packed neighbor lists if --compress.  With --reorder
+// the nodes are renumbered for locality, the file keeping the order the
+// server permutes its entries and features by when it loads the graph.
+// The output is written next to it and renamed, so it may replace the
+// input of a running server, which picks it up on reindex.
+int main (int argc, char *argv[]) {
+
+    string input;
+    string output;
+    bool compress = false;
+    bool reorder = false;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()
+    ("help,h", "produce help message.")
+    ("input,I", po::value(&input), "input file")
+    ("output,O", po::value(&output), "output file, the input if omitted")
+    ("compress,z", "pack neighbor lists (delta/varint)")
+    ("reorder,r", "renumber nodes breadth-first for locality")
+    ;
+
+    po::positional_options_description p;
+    p.add("input", 1);
+    p.add("output", 1);
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv).
+                     options(desc).positional(p).run(), vm);
+    po::notify(vm); 
+
+    if (vm.count("help") || (vm.count("input") == 0)) {
+        std::cerr << "usage: kgraph-csr <input> [output]" << std::endl;
+        std::cerr << desc;
+        return 1;
+    }
+    if (output.empty()) output = input;
+    compress = vm.count("compress") > 0;
+    reorder = vm.count("reorder") > 0;
+
+    try {
+        std::unique_ptr<kgraph::KGraph> graph(kgraph::create_kgraph_lite(compress));
+        graph->load(input.c_str());
+        if (reorder) kgraph::reorder_kgraph_lite(graph.get());
+        string tmp = output + ".tmp";
+        graph->save(tmp.c_str(), kgraph::KGraph::FORMAT_NO_DIST);
+        if (rename(tmp.c_str(), output.c_str()) != 0) {
+            throw runtime_error("cannot rename " + tmp);
+        }
+    }
+    catch (std::exception const &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -1,21 +1,27 @@
 #ifdef _OPENMP
 #include <omp.h>
 #endif
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
 #include <unordered_set>
 #include <mutex>
 #include <iostream>
 #include <fstream>
 #include <random>
 #include <algorithm>
+#include <memory>
 #include <stdexcept>
+#include <boost/assert.hpp>
 #include <boost/timer/timer.hpp>
 #define timer timer_for_boost_progress_t
 #include <boost/progress.hpp>
 #undef timer
-#include <boost/dynamic_bitset.hpp>
-#include <boost/container/pmr/vector.hpp>
-#include "fixed_monotonic_buffer_resource.hpp"
 #include "kgraph.h"
+#include "kgraph-batch.h"
+#include "donkey-simd.h"
 
 namespace kgraph {
 
@@ -59,8 +65,9 @@ namespace kgraph {
     struct NeighborX: public Neighbor {
         uint16_t m;
         uint16_t M; // actual M used
+        uint32_t list;  // where the list is decoded in the search context, if packed
         NeighborX () {}
-        NeighborX (unsigned i, float d): Neighbor(i, d, true), m(0), M(0) {
+        NeighborX (unsigned i, float d): Neighbor(i, d, true), m(0), M(0), list(0) {
         }
     };
 
@@ -117,35 +124,366 @@ namespace kgraph {
         return UpdateKnnListHelper<NeighborX>(addr, K, nn);
     }
 
+    // CSR layout of a graph saved by KGraphLite, searched in place
+    // through a read-only shared mapping, so the processes serving a DB
+    // share one copy in the page cache and loading costs no reads.
+    // Native byte order, every section starts on a page boundary:
+    //
+    //      CSRHeader
+    //      uint32_t M[N]                   the M of each node
+    //      uint64_t offsets[N + 1]         neighbors of node i are
+    //      uint32_t neighbors[edges]       neighbors[offsets[i], offsets[i + 1])
+    //
+    // With CSR_PACKED, the neighbors section is instead the bytes of
+    // the packed lists (see pack_list), offsets are byte offsets into
+    // it, and it is followed by SVB_PADDING zero bytes.  With
+    // CSR_ORDERED, the nodes were renumbered by reorder() and a last
+    // section uint32_t order[N] maps them back.  Version 1 files predate
+    // flags, the field is in their zero padding.
+    struct CSRHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t N;
+        uint64_t edges;
+        uint64_t M_pos;         // byte positions of the sections
+        uint64_t offsets_pos;
+        uint64_t neighbors_pos;
+        uint64_t size;          // of the file
+        uint32_t flags;
+        uint32_t reserved;
+        uint64_t order_pos;
+    };
+
+    static char const CSR_MAGIC[8] = {'K', 'G', 'R', 'A', 'P', 'H', 'C', 'S'};
+    static uint32_t constexpr CSR_VERSION = 2;
+    static uint32_t constexpr CSR_PACKED = 1;
+    static uint32_t constexpr CSR_ORDERED = 2;
+    static uint64_t constexpr CSR_PAGE = 4096;
+    static unsigned constexpr PADDING = donkey::simd::SVB_PADDING;
+
+    static uint64_t csr_align (uint64_t pos) {
+        return (pos + CSR_PAGE - 1) / CSR_PAGE * CSR_PAGE;
+    }
+
+    // A packed neighbor list is its degree as a LEB128 varint, then
+    // the StreamVByte control bytes and data of the list.  The first
+    // core entries, which default searches expand as a whole, are
+    // sorted by id and stored as the first id followed by the gaps, so
+    // mostly 1 or 2 bytes per entry instead of 4.  The rest stays in
+    // distance order, ids as they are, since a search with a larger M
+    // expands a prefix of it.
+    static void pack_list (uint32_t const *ids, unsigned degree, unsigned core, vector<uint8_t> *out) {
+        vector<uint32_t> v(ids, ids + degree);
+        sort(v.begin(), v.begin() + core);
+        for (unsigned i = core; i-- > 1;) {
+            v[i] -= v[i - 1];
+        }
+        unsigned d = degree;
+        do {
+            out->push_back((d & 0x7f) | (d >= 0x80 ? 0x80 : 0));
+            d >>= 7;
+        } while (d);
+        size_t ctrl = out->size();
+        out->resize(ctrl + (degree + 3) / 4, 0);
+        for (unsigned i = 0; i < degree; ++i) {
+            uint32_t x = v[i];
+            unsigned len = x < (1u << 8) ? 1 : x < (1u << 16) ? 2 : x < (1u << 24) ? 3 : 4;
+            (*out)[ctrl + i / 4] |= (len - 1) << (2 * (i % 4));
+            for (unsigned b = 0; b < len; ++b) {
+                out->push_back(x >> (8 * b));
+            }
+        }
+    }
+
     class KGraphLite: public KGraph {
     protected:
-        boost::container::pmr::fixed_monotonic_buffer_resource memory_resource;
-        vector<unsigned> M;
-        boost::container::pmr::vector_of<boost::container::pmr::vector<uint32_t>>::type graph;
+        // Scratch memory of one search, reused by later searches so
+        // that a search allocates nothing once warmed up.  Visited marks
+        // are tagged with an epoch, reset is a counter bump instead of
+        // clearing a mark per node.
+        struct Context {
+            vector<uint16_t> marks;
+            uint16_t epoch;
+            vector<NeighborX> knn;
+            vector<NeighborX> results;
+            vector<unsigned> cands;
+            vector<float> cand_dists;
+            vector<uint32_t> decoded;   // packed lists expanded by the search
+            vector<unsigned> random;
+            vector<unsigned> start;
+            vector<float> start_dists;
+            mt19937 rng;    // continued across searches with seed 0
+
+            Context (): epoch(0), rng(random_device()()) {
+            }
+
+            void reset (size_t n) {
+                if (marks.size() < n) {
+                    marks.resize(n, epoch);
+                }
+                if (++epoch == 0) {
+                    std::fill(marks.begin(), marks.end(), 0);
+                    epoch = 1;
+                }
+            }
+
+            bool visited (uint32_t i) const {
+                return marks[i] == epoch;
+            }
+
+            void visit (uint32_t i) {
+                marks[i] = epoch;
+            }
+        };
+
+        // The graph in CSR form, pointing either into the mapping of a
+        // CSR file or into the vectors a KNNGRAPH file is read into.
+        // Neighbor lists are either plain (neighbors) or packed (packed,
+        // with offsets in bytes).
+        uint32_t N;
+        uint32_t const *M;
+        uint64_t const *offsets;
+        uint32_t const *neighbors;
+        uint8_t const *packed;
+        uint32_t const *order;  // node i was node order[i] when built, or null
+        vector<uint32_t> loaded_M;
+        vector<uint64_t> loaded_offsets;
+        vector<uint32_t> loaded_neighbors;
+        vector<uint8_t> loaded_packed;
+        vector<uint32_t> loaded_order;
+        void *mapping;
+        size_t mapping_size;
+        bool compress;  // pack plain graphs on load
         static const bool no_dist = true;   // Distance & flag information in Neighbor is not valid.
+        mutable std::mutex pool_mutex;
+        mutable vector<std::unique_ptr<Context>> pool;
 
+        std::unique_ptr<Context> acquire () const {
+            std::lock_guard<std::mutex> lock(pool_mutex);
+            if (pool.empty()) {
+                return std::unique_ptr<Context>(new Context);
+            }
+            std::unique_ptr<Context> c(std::move(pool.back()));
+            pool.pop_back();
+            return c;
+        }
+
+        void release (std::unique_ptr<Context> c) const {
+            std::lock_guard<std::mutex> lock(pool_mutex);
+            pool.push_back(std::move(c));
+        }
+
+
+        // *d <- the degree of a packed list, return what follows it
+        static uint8_t const *packed_degree (uint8_t const *p, unsigned *d) {
+            *d = 0;
+            for (unsigned shift = 0;; shift += 7) {
+                *d |= unsigned(*p & 0x7f) << shift;
+                if (!(*p++ & 0x80)) return p;
+            }
+        }
+
+        unsigned degree (unsigned i) const {
+            if (!packed) return offsets[i + 1] - offsets[i];
+            unsigned d;
+            packed_degree(packed + offsets[i], &d);
+            return d;
+        }
+
+        // out[0..n) <- the first n neighbors of packed node i
+        void unpack_list (unsigned i, unsigned n, uint32_t *out) const {
+            unsigned d;
+            uint8_t const *p = packed_degree(packed + offsets[i], &d);
+            donkey::simd::active->svb_decode(p, p + (d + 3) / 4, n, out);
+            unsigned core = std::min(std::min(M[i], d), n);
+            for (unsigned m = 1; m < core; ++m) {
+                out[m] += out[m - 1];
+            }
+        }
+
+        // Replace plain neighbor lists by packed ones.
+        void pack () {
+            vector<uint32_t> new_M(M, M + N);
+            vector<uint32_t> new_order;
+            if (order) new_order.assign(order, order + N);
+            vector<uint64_t> new_offsets(N + 1);
+            vector<uint8_t> new_packed;
+            new_packed.reserve(offsets[N] * 2);
+            for (unsigned i = 0; i < N; ++i) {
+                new_offsets[i] = new_packed.size();
+                unsigned d = degree(i);
+                pack_list(neighbors + offsets[i], d, std::min(M[i], d), &new_packed);
+            }
+            new_offsets[N] = new_packed.size();
+            new_packed.resize(new_packed.size() + PADDING, 0);
+            clear();
+            loaded_M.swap(new_M);
+            loaded_offsets.swap(new_offsets);
+            loaded_packed.swap(new_packed);
+            loaded_order.swap(new_order);
+            N = loaded_M.size();
+            M = loaded_M.data();
+            offsets = loaded_offsets.data();
+            packed = loaded_packed.data();
+            if (loaded_order.size()) order = loaded_order.data();
+        }
+
+        void get_list (unsigned i, vector<uint32_t> *out) const {
+            unsigned d = degree(i);
+            out->resize(d);
+            if (d == 0) return;
+            if (packed) {
+                unpack_list(i, d, &out->at(0));
+            }
+            else {
+                std::copy(neighbors + offsets[i], neighbors + offsets[i + 1], out->begin());
+            }
+        }
 
         // actual M for a node that should be used in search time
         unsigned actual_M (unsigned pM, unsigned i) const {
-            return std::min(std::max(M[i], pM), unsigned(graph[i].size()));
+            return std::min(std::max(M[i], pM), degree(i));
         }
 
         void clear () {
-            graph.clear();
-            memory_resource.release();
+            if (mapping) {
+                munmap(mapping, mapping_size);
+                mapping = nullptr;
+                mapping_size = 0;
+            }
+            vector<uint32_t>().swap(loaded_M);
+            vector<uint64_t>().swap(loaded_offsets);
+            vector<uint32_t>().swap(loaded_neighbors);
+            vector<uint8_t>().swap(loaded_packed);
+            vector<uint32_t>().swap(loaded_order);
+            loaded_offsets.push_back(0);
+            N = 0;
+            M = loaded_M.data();
+            offsets = loaded_offsets.data();
+            neighbors = loaded_neighbors.data();
+            packed = nullptr;
+            order = nullptr;
+            pool.clear();
+        }
+
+        void map_csr (char const *path) {
+            int fd = ::open(path, O_RDONLY);
+            if (fd < 0) throw runtime_error("failed to open index");
+            struct stat st;
+            if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(CSRHeader)) {
+                ::close(fd);
+                throw runtime_error("error reading index file.");
+            }
+            void *mem = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);    // the mapping stays
+            if (mem == MAP_FAILED) throw runtime_error("failed to map index");
+            mapping = mem;
+            mapping_size = st.st_size;
+            char const *base = reinterpret_cast<char const *>(mem);
+            CSRHeader const *h = reinterpret_cast<CSRHeader const *>(base);
+            if (h->version < 1 || h->version > CSR_VERSION) throw runtime_error("data version not supported.");
+            bool is_packed = h->flags & CSR_PACKED;
+            bool is_ordered = h->flags & CSR_ORDERED;
+            if (h->size != mapping_size
+                    || h->M_pos % CSR_PAGE || h->offsets_pos % CSR_PAGE || h->neighbors_pos % CSR_PAGE
+                    || h->M_pos + uint64_t(h->N) * sizeof(uint32_t) > h->size
+                    || h->offsets_pos + (uint64_t(h->N) + 1) * sizeof(uint64_t) > h->size
+                    || (!is_packed && h->neighbors_pos + h->edges * sizeof(uint32_t) > h->size)
+                    || (is_ordered && (h->order_pos % CSR_PAGE
+                                       || h->order_pos + uint64_t(h->N) * sizeof(uint32_t) > h->size))) {
+                throw runtime_error("index corrupted.");
+            }
+            uint64_t const *o = reinterpret_cast<uint64_t const *>(base + h->offsets_pos);
+            if (o[0] != 0) throw runtime_error("index corrupted.");
+            if (is_packed ? h->neighbors_pos + o[h->N] + PADDING > h->size : o[h->N] != h->edges) {
+                throw runtime_error("index corrupted.");
+            }
+            N = h->N;
+            M = reinterpret_cast<uint32_t const *>(base + h->M_pos);
+            offsets = o;
+            if (is_packed) {
+                packed = reinterpret_cast<uint8_t const *>(base + h->neighbors_pos);
+            }
+            else {
+                neighbors = reinterpret_cast<uint32_t const *>(base + h->neighbors_pos);
+            }
+            if (is_ordered) {
+                order = reinterpret_cast<uint32_t const *>(base + h->order_pos);
+            }
         }
 
     public:
-        KGraphLite (): graph(&memory_resource) {
+        // Renumber the nodes in breadth-first order, neighbors in list
+        // order, so that the nodes a search expands together, and their
+        // features once the data is permuted alike, sit close in memory.
+        // order() tells where each node came from.
+        void reorder () {
+            vector<uint32_t> bfs;
+            vector<uint32_t> id(N, N);   // new id of each node
+            vector<uint32_t> list;
+            bfs.reserve(N);
+            for (unsigned s = 0; s < N; ++s) {
+                if (id[s] < N) continue;
+                id[s] = bfs.size();
+                bfs.push_back(s);
+                for (size_t head = bfs.size() - 1; head < bfs.size(); ++head) {
+                    get_list(bfs[head], &list);
+                    for (uint32_t v: list) {
+                        if (v >= N || id[v] < N) continue;
+                        id[v] = bfs.size();
+                        bfs.push_back(v);
+                    }
+                }
+            }
+            vector<uint32_t> new_M(N);
+            vector<uint64_t> new_offsets(N + 1, 0);
+            vector<uint32_t> new_neighbors;
+            vector<uint32_t> new_order(N);
+            new_neighbors.reserve(packed ? 0 : offsets[N]);
+            for (unsigned i = 0; i < N; ++i) {
+                unsigned old = bfs[i];
+                new_M[i] = M[old];
+                new_order[i] = order ? order[old] : old;
+                get_list(old, &list);
+                for (uint32_t v: list) {
+                    new_neighbors.push_back(v < N ? id[v] : v);
+                }
+                new_offsets[i + 1] = new_neighbors.size();
+            }
+            bool was_packed = packed;
+            clear();
+            loaded_M.swap(new_M);
+            loaded_offsets.swap(new_offsets);
+            loaded_neighbors.swap(new_neighbors);
+            loaded_order.swap(new_order);
+            N = loaded_M.size();
+            M = loaded_M.data();
+            offsets = loaded_offsets.data();
+            neighbors = loaded_neighbors.data();
+            order = loaded_order.data();
+            if (was_packed) pack();
+        }
+
+        uint32_t const *get_order () const {
+            return order;
+        }
+
+        KGraphLite (bool compress_ = false): mapping(nullptr), mapping_size(0), compress(compress_) {
+            clear();
         }
         virtual ~KGraphLite () {
             clear();
         }
+
+        // Either a CSR file written by save(), mapped, or a KNNGRAPH
+        // file of the kgraph library, read into memory.  With compress,
+        // plain lists end up packed in memory.
         virtual void load (char const *path) {
             static char const *KGRAPH_MAGIC = "KNNGRAPH";
             static unsigned constexpr KGRAPH_MAGIC_SIZE = 8;
             static uint32_t constexpr SIGNATURE_VERSION = 2;
             static_assert(sizeof(unsigned) == sizeof(uint32_t), "unsigned must be 32-bit");
+            clear();
             ifstream is(path, ios::binary);
             if (!is) throw runtime_error("failed to open index");
             char magic[KGRAPH_MAGIC_SIZE];
@@ -153,45 +491,99 @@ namespace kgraph {
             uint32_t sig_cap;
             uint32_t N;
             is.read(magic, sizeof(magic));
+            if (is && memcmp(magic, CSR_MAGIC, sizeof(magic)) == 0) {
+                is.close();
+                try {
+                    map_csr(path);
+                }
+                catch (...) {
+                    clear();
+                    throw;
+                }
+                if (compress && !packed) pack();
+                return;
+            }
             is.read(reinterpret_cast<char *>(&sig_version), sizeof(sig_version));
             is.read(reinterpret_cast<char *>(&sig_cap), sizeof(sig_cap));
             if (sig_version != SIGNATURE_VERSION) throw runtime_error("data version not supported.");
             is.read(reinterpret_cast<char *>(&N), sizeof(N));
-            if (!is) runtime_error("error reading index file.");
+            if (!is) throw runtime_error("error reading index file.");
             for (unsigned i = 0; i < KGRAPH_MAGIC_SIZE; ++i) {
-                if (KGRAPH_MAGIC[i] != magic[i]) runtime_error("index corrupted.");
+                if (KGRAPH_MAGIC[i] != magic[i]) throw runtime_error("index corrupted.");
             }
             bool load_no_dist = sig_cap & FORMAT_NO_DIST;
-            graph.resize(N);
-            M.resize(N);
-            vector<uint32_t> nids;
+            loaded_M.resize(N);
+            loaded_offsets.resize(N + 1);
             vector<Neighbor> nns;
-            for (unsigned i = 0; i < graph.size(); ++i) {
-                auto &knn = graph[i];
+            for (unsigned i = 0; i < N; ++i) {
                 unsigned K;
-                is.read(reinterpret_cast<char *>(&M[i]), sizeof(M[i]));
+                is.read(reinterpret_cast<char *>(&loaded_M[i]), sizeof(loaded_M[i]));
                 is.read(reinterpret_cast<char *>(&K), sizeof(K));
-                if (!is) runtime_error("error reading index file.");
-                knn.resize(K);
+                if (!is) throw runtime_error("error reading index file.");
+                size_t off = loaded_neighbors.size();
+                loaded_neighbors.resize(off + K);
                 if (load_no_dist) {
-                    nids.resize(K);
-                    is.read(reinterpret_cast<char *>(&nids[0]), K * sizeof(nids[0]));
-                    for (unsigned k = 0; k < K; ++k) {
-                        knn[k] = nids[k];
-                    }
+                    is.read(reinterpret_cast<char *>(&loaded_neighbors[off]), K * sizeof(uint32_t));
                 }
                 else {
                     nns.resize(K);
-                    is.read(reinterpret_cast<char *>(&nns[0]), K * sizeof(nns[0]));
+                    is.read(reinterpret_cast<char *>(nns.data()), K * sizeof(nns[0]));
                     for (unsigned k = 0; k < K; ++k) {
-                        knn[k] = nns[k].id;
+                        loaded_neighbors[off + k] = nns[k].id;
                     }
                 }
+                loaded_offsets[i + 1] = loaded_neighbors.size();
             }
+            if (!is) throw runtime_error("error reading index file.");
+            this->N = N;
+            M = loaded_M.data();
+            offsets = loaded_offsets.data();
+            neighbors = loaded_neighbors.data();
+            if (compress) pack();
         }
 
-        virtual void save (char const *path, int format) const  {
-            throw runtime_error("not implemented.");
+        // Always writes the CSR layout, whatever the format, packed if
+        // the lists are packed.
+        virtual void save (char const *path, int) const  {
+            CSRHeader h;
+            memset(&h, 0, sizeof(h));
+            memcpy(h.magic, CSR_MAGIC, sizeof(h.magic));
+            h.version = CSR_VERSION;
+            h.N = N;
+            h.flags = (packed ? CSR_PACKED : 0) | (order ? CSR_ORDERED : 0);
+            h.edges = 0;
+            for (unsigned i = 0; i < N; ++i) {
+                h.edges += degree(i);
+            }
+            uint64_t bytes = packed ? offsets[N] + PADDING : h.edges * sizeof(uint32_t);
+            h.M_pos = csr_align(sizeof(h));
+            h.offsets_pos = csr_align(h.M_pos + uint64_t(N) * sizeof(uint32_t));
+            h.neighbors_pos = csr_align(h.offsets_pos + (uint64_t(N) + 1) * sizeof(uint64_t));
+            h.size = h.neighbors_pos + bytes;
+            if (order) {
+                h.order_pos = csr_align(h.size);
+                h.size = h.order_pos + uint64_t(N) * sizeof(uint32_t);
+            }
+            ofstream os(path, ios::binary);
+            if (!os) throw runtime_error("failed to open index for writing");
+            vector<char> pad(CSR_PAGE, 0);
+            auto section = [&](uint64_t pos, void const *data, uint64_t bytes) {
+                os.write(&pad[0], pos - os.tellp());
+                os.write(reinterpret_cast<char const *>(data), bytes);
+            };
+            section(0, &h, sizeof(h));
+            section(h.M_pos, M, uint64_t(N) * sizeof(uint32_t));
+            section(h.offsets_pos, offsets, (uint64_t(N) + 1) * sizeof(uint64_t));
+            if (packed) {
+                section(h.neighbors_pos, packed, bytes);
+            }
+            else {
+                section(h.neighbors_pos, neighbors, bytes);
+            }
+            if (order) {
+                section(h.order_pos, order, uint64_t(N) * sizeof(uint32_t));
+            }
+            if (!os) throw runtime_error("error writing index file.");
         }
 
         virtual void build (IndexOracle const &oracle, IndexParams const &param, IndexInfo *info) {
@@ -245,38 +637,50 @@ namespace kgraph {
         */
 
         virtual unsigned search (SearchOracle const &oracle, SearchParams const &params, unsigned *ids, float *dists, SearchInfo *pinfo) const {
-            if (graph.size() > oracle.size()) {
+            if (N > oracle.size()) {
                 throw runtime_error("dataset larger than index");
             }
-            if (params.P >= graph.size()) {
+            // evaluate the new neighbors of a node in one call if possible
+            BatchSearchOracle const *batch = dynamic_cast<BatchSearchOracle const *>(&oracle);
+            if (params.P >= N) {
                 if (pinfo) {
                     pinfo->updates = 0;
                     pinfo->cost = 1.0;
                 }
+                if (batch) {
+                    return batch->search(params.K, params.epsilon, ids, dists);
+                }
                 return oracle.search(params.K, params.epsilon, ids, dists);
             }
-            vector<NeighborX> knn(params.K + params.P +1);
-            vector<NeighborX> results;
-            // flags access is totally random, so use small block to avoid
-            // extra memory access
-            boost::dynamic_bitset<> flags(graph.size(), false);
-
             if (params.init && params.T > 1) {
                 throw runtime_error("when init > 0, T must be 1.");
             }
 
-            unsigned seed = params.seed;
+            std::unique_ptr<Context> context = acquire();
+            Context &ctx = *context;
+            vector<NeighborX> &knn = ctx.knn;
+            vector<NeighborX> &results = ctx.results;
+            vector<unsigned> &cands = ctx.cands;
+            vector<float> &cand_dists = ctx.cand_dists;
+            knn.resize(params.K + params.P + 1);
+            results.clear();
+            cands.resize(params.S);
+            cand_dists.resize(params.S);
+            ctx.decoded.clear();
+            ctx.reset(N);
+
             unsigned updates = 0;
-            if (seed == 0) seed = time(NULL);
-            mt19937 rng(seed);
+            mt19937 &rng = ctx.rng;
+            if (params.seed) rng.seed(params.seed);
             unsigned n_comps = 0;
             for (unsigned trial = 0; trial < params.T; ++trial) {
                 unsigned L = params.init;
                 if (L == 0) {   // generate random starting points
-                    vector<unsigned> random(params.P);
-                    GenRandom(rng, &random[0], random.size(), graph.size());
+                    vector<unsigned> &random = ctx.random;
+                    random.resize(params.P);
+                    GenRandom(rng, random.data(), random.size(), N);
                     for (unsigned s: random) {
-                        if (!flags[s]) {
+                        if (!ctx.visited(s)) {
                             knn[L++].id = s;
                             //flags[s] = true;
                         }
@@ -289,11 +693,26 @@ namespace kgraph {
                         knn[l].id = ids[l];
                     }
                 }
+                vector<unsigned> &start = ctx.start;
+                vector<float> &start_dists = ctx.start_dists;
+                start.resize(L);
+                start_dists.resize(L);
+                for (unsigned k = 0; k < L; ++k) {
+                    start[k] = knn[k].id;
+                }
+                if (batch) {
+                    (*batch)(start.data(), L, start_dists.data());
+                }
+                else {
+                    for (unsigned k = 0; k < L; ++k) {
+                        start_dists[k] = oracle(start[k]);
+                    }
+                }
                 for (unsigned k = 0; k < L; ++k) {
                     auto &e = knn[k];
-                    flags[e.id] = true;
+                    ctx.visit(e.id);
                     e.flag = true;
-                    e.dist = oracle(e.id);
+                    e.dist = start_dists[k];
                     e.m = 0;
                     e.M = actual_M(params.M, e.id);
                 }
@@ -313,16 +732,41 @@ namespace kgraph {
                         endM = e.M;
                     }
                     e.m = endM;
+                    // a packed list is decoded once, at its first step
+                    if (packed && beginM == 0) {
+                        e.list = ctx.decoded.size();
+                        ctx.decoded.resize(e.list + e.M);
+                        unpack_list(e.id, e.M, ctx.decoded.data() + e.list);
+                    }
                     // all modification to knn[k] must have been done now,
                     // as we might be relocating knn[k] in the loop below
-                    auto const &neighbors = graph[e.id];
+                    uint32_t const *nbrs;
+                    if (packed) {
+                        nbrs = ctx.decoded.data() + e.list;
+                    }
+                    else {
+                        nbrs = neighbors + offsets[e.id];
+                    }
+                    unsigned nc = 0;
                     for (unsigned m = beginM; m < endM; ++m) {
-                        unsigned id = neighbors[m];
-                        //BOOST_VERIFY(id < graph.size());
-                        if (flags[id]) continue;
-                        flags[id] = true;
-                        ++n_comps;
-                        float dist = oracle(id);
+                        unsigned id = nbrs[m];
+                        //BOOST_VERIFY(id < N);
+                        if (ctx.visited(id)) continue;
+                        ctx.visit(id);
+                        cands[nc++] = id;
+                    }
+                    n_comps += nc;
+                    if (batch) {
+                        (*batch)(cands.data(), nc, cand_dists.data());
+                    }
+                    else {
+                        for (unsigned c = 0; c < nc; ++c) {
+                            cand_dists[c] = oracle(cands[c]);
+                        }
+                    }
+                    for (unsigned c = 0; c < nc; ++c) {
+                        unsigned id = cands[c];
+                        float dist = cand_dists[c];
                         NeighborX nn(id, dist);
                         unsigned r = UpdateKnnList(&knn[0], L, nn);
                         BOOST_VERIFY(r <= L);
@@ -382,8 +826,9 @@ namespace kgraph {
             }
             if (pinfo) {
                 pinfo->updates = updates;
-                pinfo->cost = float(n_comps) / graph.size();
+                pinfo->cost = float(n_comps) / N;
             }
+            release(std::move(context));
             return L;
         }
 
@@ -400,8 +845,19 @@ namespace kgraph {
         }
     };
 
-    KGraph *create_kgraph_lite () {
-        return new KGraphLite;
+    KGraph *create_kgraph_lite (bool compress) {
+        return new KGraphLite(compress);
+    }
+
+    void reorder_kgraph_lite (KGraph *graph) {
+        KGraphLite *lite = dynamic_cast<KGraphLite *>(graph);
+        if (!lite) throw invalid_argument("not a kgraph_lite graph");
+        lite->reorder();
+    }
+
+    unsigned const *kgraph_lite_order (KGraph const *graph) {
+        KGraphLite const *lite = dynamic_cast<KGraphLite const *>(graph);
+        return lite ? lite->get_order() : nullptr;
     }
 }
 
@@ -0,0 +1,364 @@
+#ifndef AAALGO_DONKEY_LSH_FAMILY
+#define AAALGO_DONKEY_LSH_FAMILY
+
+#include <cmath>
+#include <limits>
+#include <random>
+#include <vector>
+#include <algorithm>
+#include <functional>
+
+// LSH hash families for the similarities in donkey-common.h.
+//
+// A family draws tables * K random functions from a seed, and maps a
+// feature to one integer per function:
+//
+//      Family (unsigned tables, unsigned K, Config const &config, uint32_t seed);
+//      // values[i], i = t * K + k; if costs is not null, costs[2i] and
+//      // costs[2i+1] score how likely a near neighbor has values[i] - 1
+//      // and values[i] + 1 instead (lower is likelier, infinity if
+//      // impossible).  Multi-probe queries follow the costs.
+//      void hash (feature_type const &, int32_t *values, float *costs) const;
+//      static char const *name ();
+//      static unsigned constexpr DEFAULT_K;
+//
+// LSHHasher combines the K values of each table into a bucket.  The
+// family is picked from the similarity type with LSHFamily<S>::type,
+// so plugins deriving from the stock similarities get the right one.
+
+namespace donkey {
+
+    static constexpr float LSH_NO_PROBE = std::numeric_limits<float>::infinity();
+
+    // <a, x> with a random float projection a
+    template <typename T>
+    static inline float lsh_project (float const *a, T const *x, unsigned D) {
+        float v = 0;
+        for (unsigned i = 0; i < D; ++i) {
+            v += a[i] * x[i];
+        }
+        return v;
+    }
+
+    static inline float lsh_project (float const *a, float const *x, unsigned D) {
+        return simd::active->dot(a, x, D);
+    }
+
+    // p-stable projections, floor((<a,x> + b) / w), with a Gaussian
+    // for L2 and Cauchy for L1.  The bucket width w (donkey.lsh.w)
+    // should be around the distance of a good match.
+    template <typename T, unsigned D, typename DIST>
+    class PStableHash {
+        unsigned n;
+        float w;
+        std::vector<float> a;
+        std::vector<float> b;
+    public:
+        static unsigned constexpr DEFAULT_K = 4;
+        static char const *name () {
+            return "pstable";
+        }
+
+        PStableHash (unsigned tables, unsigned K, Config const &config, uint32_t seed)
+            : n(tables * K), w(config.get<float>("donkey.lsh.w", 4.0)), a(size_t(n) * D), b(n) {
+            if (!(w > 0)) throw ConfigError("invalid lsh.w");
+            std::mt19937 rng(seed);
+            DIST dist;
+            std::uniform_real_distribution<float> offset(0, w);
+            for (auto &v: a) v = dist(rng);
+            for (auto &v: b) v = offset(rng);
+        }
+
+        // cost is the squared distance to the slot boundary
+        void hash (VectorFeature<T, D> const &x, int32_t *values, float *costs) const {
+            for (unsigned i = 0; i < n; ++i) {
+                float f = (lsh_project(&a[size_t(i) * D], &x.data[0], D) + b[i]) / w;
+                float fl = std::floor(f);
+                values[i] = int32_t(fl);
+                if (costs) {
+                    float frac = f - fl;
+                    costs[2 * i] = frac * frac;
+                    costs[2 * i + 1] = (1 - frac) * (1 - frac);
+                }
+            }
+        }
+    };
+
+    // sign random projections for cosine
+    template <typename T, unsigned D>
+    class SignHash {
+        unsigned n;
+        std::vector<float> a;
+    public:
+        static unsigned constexpr DEFAULT_K = 16;
+        static char const *name () {
+            return "sign";
+        }
+
+        SignHash (unsigned tables, unsigned K, Config const &, uint32_t seed)
+            : n(tables * K), a(size_t(n) * D) {
+            std::mt19937 rng(seed);
+            std::normal_distribution<float> dist;
+            for (auto &v: a) v = dist(rng);
+        }
+
+        // cost of flipping a sign is the squared projection
+        void hash (VectorFeature<T, D> const &x, int32_t *values, float *costs) const {
+            for (unsigned i = 0; i < n; ++i) {
+                float p = lsh_project(&a[size_t(i) * D], &x.data[0], D);
+                values[i] = p >= 0;
+                if (costs) {
+                    costs[2 * i] = values[i] ? p * p : LSH_NO_PROBE;
+                    costs[2 * i + 1] = values[i] ? LSH_NO_PROBE : p * p;
+                }
+            }
+        }
+    };
+
+    // bit sampling for Hamming distance
+    template <typename T, unsigned D>
+    class BitSamplingHash {
+        static unsigned constexpr CHUNK_BITS = sizeof(T) * 8;
+        std::vector<uint32_t> bits;
+    public:
+        static unsigned constexpr DEFAULT_K = 16;
+        static char const *name () {
+            return "bits";
+        }
+
+        BitSamplingHash (unsigned tables, unsigned K, Config const &, uint32_t seed)
+            : bits(tables * K) {
+            std::mt19937 rng(seed);
+            std::uniform_int_distribution<uint32_t> dist(0, D * CHUNK_BITS - 1);
+            for (auto &v: bits) v = dist(rng);
+        }
+
+        // all bit flips are equally likely
+        void hash (VectorFeature<T, D> const &x, int32_t *values, float *costs) const {
+            for (unsigned i = 0; i < bits.size(); ++i) {
+                uint32_t b = bits[i];
+                values[i] = (x.data[b / CHUNK_BITS] >> (b % CHUNK_BITS)) & 1;
+                if (costs) {
+                    costs[2 * i] = values[i] ? 1 : LSH_NO_PROBE;
+                    costs[2 * i + 1] = values[i] ? LSH_NO_PROBE : 1;
+                }
+            }
+        }
+    };
+
+    // coordinate sampling for TypeHamming, the sampled value itself
+    // is the hash
+    template <typename T, unsigned D>
+    class ValueHash {
+        std::vector<uint32_t> dims;
+    public:
+        static unsigned constexpr DEFAULT_K = 4;
+        static char const *name () {
+            return "value";
+        }
+
+        ValueHash (unsigned tables, unsigned K, Config const &, uint32_t seed)
+            : dims(tables * K) {
+            std::mt19937 rng(seed);
+            std::uniform_int_distribution<uint32_t> dist(0, D - 1);
+            for (auto &v: dims) v = dist(rng);
+        }
+
+        // values have no neighbors, so only the home bucket is probed
+        void hash (VectorFeature<T, D> const &x, int32_t *values, float *costs) const {
+            std::hash<T> h;
+            for (unsigned i = 0; i < dims.size(); ++i) {
+                values[i] = int32_t(h(x.data[dims[i]]));
+                if (costs) {
+                    costs[2 * i] = costs[2 * i + 1] = LSH_NO_PROBE;
+                }
+            }
+        }
+    };
+
+    // any other similarity: every feature hashes to the same bucket,
+    // so search is a scan of all of them
+    class SingleBucketHash {
+        unsigned n;
+    public:
+        static unsigned constexpr DEFAULT_K = 1;
+        static char const *name () {
+            return "single";
+        }
+
+        SingleBucketHash (unsigned tables, unsigned K, Config const &, uint32_t)
+            : n(tables * K) {
+        }
+
+        template <typename F>
+        void hash (F const &, int32_t *values, float *costs) const {
+            for (unsigned i = 0; i < n; ++i) {
+                values[i] = 0;
+                if (costs) {
+                    costs[2 * i] = costs[2 * i + 1] = LSH_NO_PROBE;
+                }
+            }
+        }
+    };
+
+    // family selection, only used in decltype
+    template <typename T, unsigned D, bool S>
+    PStableHash<T, D, std::normal_distribution<float>> lsh_family (distance::L2<T, D, S> const *);
+    template <typename T, unsigned D>
+    PStableHash<T, D, std::cauchy_distribution<float>> lsh_family (distance::L1<T, D> const *);
+    template <typename T, unsigned D>
+    SignHash<T, D> lsh_family (Cosine<T, D> const *);
+    template <typename T, unsigned D>
+    BitSamplingHash<T, D> lsh_family (distance::Hamming<T, D> const *);
+    template <typename T, unsigned D>
+    ValueHash<T, D> lsh_family (distance::TypeHamming<T, D> const *);
+    SingleBucketHash lsh_family (void const *);
+
+    template <typename S>
+    struct LSHFamily {
+        typedef decltype(lsh_family(static_cast<S const *>(nullptr))) type;
+    };
+
+    // Family plus the universal hashing of the K values of a table
+    // into a bucket of hash_bits bits.
+    template <typename FAMILY>
+    class LSHHasher {
+    public:
+        typedef FAMILY Family;
+    private:
+        unsigned tables;
+        unsigned K;
+        unsigned bits;
+        uint32_t seed;
+        FAMILY family;
+        std::vector<uint32_t> mult;     // random odd multipliers
+    public:
+        LSHHasher (unsigned tables_, unsigned K_, unsigned bits_, Config const &config, uint32_t seed_)
+            : tables(tables_), K(K_), bits(bits_), seed(seed_),
+            family(tables, K, config, seed), mult(tables * K) {
+            if (K == 0) throw ConfigError("invalid lsh.functions");
+            if (bits > 32) throw ConfigError("invalid lsh.bits");
+            std::mt19937 rng(seed ^ 0x9e3779b9);
+            for (auto &v: mult) v = rng() | 1;
+        }
+
+        uint32_t get_seed () const {
+            return seed;
+        }
+
+        // bucket of table t from its K values
+        uint32_t bucket (unsigned t, int32_t const *v) const {
+            uint32_t const *m = &mult[t * K];
+            uint32_t h = 0;
+            for (unsigned i = 0; i < K; ++i) {
+                h += uint32_t(v[i]) * m[i];
+            }
+            h ^= h >> 16;
+            h *= 0x85ebca6b;
+            h ^= h >> 13;
+            return bits ? h >> (32 - bits) : 0;
+        }
+
+        template <typename F>
+        void hash (F const &x, uint32_t *buckets) const {
+            std::vector<int32_t> v(tables * K);
+            family.hash(x, v.data(), nullptr);
+            for (unsigned t = 0; t < tables; ++t) {
+                buckets[t] = bucket(t, &v[t * K]);
+            }
+        }
+
+        // Query-directed probing (Lv et al., Multi-Probe LSH): per table
+        // the perturbation sets of the K values are generated in order of
+        // total cost with the shift/expand heap; buckets[t * P + i],
+        // i < counts[t] <= P, the home bucket first.
+        template <typename F>
+        void probe (F const &x, unsigned P, uint32_t *buckets, unsigned *counts) const {
+            std::vector<int32_t> v(tables * K);
+            std::vector<float> costs(tables * K * 2);
+            family.hash(x, v.data(), costs.data());
+            for (unsigned t = 0; t < tables; ++t) {
+                buckets[t * P] = bucket(t, &v[t * K]);
+                counts[t] = 1;
+                if (P > 1) {
+                    counts[t] += perturb(t, &v[t * K], &costs[t * K * 2], P - 1, buckets + t * P + 1);
+                }
+            }
+        }
+
+    private:
+        struct Delta {
+            float cost;
+            unsigned fun;
+            int32_t delta;
+        };
+
+        struct Set {
+            float cost;
+            std::vector<unsigned> deltas;   // ascending indices into the sorted deltas
+            bool operator < (Set const &s) const {    // min-heap on cost
+                return cost > s.cost;
+            }
+        };
+
+        unsigned perturb (unsigned t, int32_t const *v, float const *costs, unsigned budget, uint32_t *out) const {
+            std::vector<Delta> deltas;
+            for (unsigned i = 0; i < K * 2; ++i) {
+                if (costs[i] < LSH_NO_PROBE) {
+                    Delta d;
+                    d.cost = costs[i];
+                    d.fun = i / 2;
+                    d.delta = (i % 2) ? 1 : -1;
+                    deltas.push_back(d);
+                }
+            }
+            if (deltas.empty()) return 0;
+            std::sort(deltas.begin(), deltas.end(), [](Delta const &a, Delta const &b) { return a.cost < b.cost; });
+            std::vector<Set> heap;
+            Set s;
+            s.cost = deltas[0].cost;
+            s.deltas.push_back(0);
+            heap.push_back(s);
+            std::vector<int32_t> pv(K);
+            std::vector<char> used(K);
+            unsigned n = 0;
+            while (n < budget && !heap.empty()) {
+                std::pop_heap(heap.begin(), heap.end());
+                s = heap.back();
+                heap.pop_back();
+                unsigned last = s.deltas.back();
+                if (last + 1 < deltas.size()) {
+                    Set shift = s;
+                    shift.cost += deltas[last + 1].cost - deltas[last].cost;
+                    shift.deltas.back() = last + 1;
+                    heap.push_back(shift);
+                    std::push_heap(heap.begin(), heap.end());
+                    Set expand = s;
+                    expand.cost += deltas[last + 1].cost;
+                    expand.deltas.push_back(last + 1);
+                    heap.push_back(expand);
+                    std::push_heap(heap.begin(), heap.end());
+                }
+                // a set moving one value both ways is not valid
+                std::copy(v, v + K, pv.begin());
+                std::fill(used.begin(), used.end(), 0);
+                bool valid = true;
+                for (unsigned i: s.deltas) {
+                    Delta const &d = deltas[i];
+                    if (used[d.fun]) {
+                        valid = false;
+                        break;
+                    }
+                    used[d.fun] = 1;
+                    pv[d.fun] += d.delta;
+                }
+                if (valid) {
+                    out[n++] = bucket(t, pv.data());
+                }
+            }
+            return n;
+        }
+    };
+}
+
+#endif
@@ -2,90 +2,177 @@
 #define WDONG_LSH
 
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <new>
+#include <vector>
+#include <istream>
+#include <ostream>
+#include <algorithm>
 // this is a simple lsh library
 
 namespace lsh {
+    // Config may carry state (e.g. where the features of the records
+    // live); the index keeps its own copy.
+    //
     // struct DATA {
-    //      typedef .. RECORD_TYPE;     // type of indexed record
+    //      typedef .. RECORD_TYPE;     // type of indexed record, plain data
     //      typedef .. QUERY_TYPE;
     //      typedef .. KEY_TYPE;
-    //      static void hash (RECORD_TYPE const &, uint32_t *);
-    //      static void hash (QUERY_TYPE const &, uint32_t *);
-    //      static KEY_TYPE key (RECORD_TYPE const &);
-    //      static float dist (RECORD_TYPE const &, QUERY_TYPE const &);
+    //      void hash (RECORD_TYPE const &, uint32_t *) const;
+    //      // up to P buckets per table to probe for the query, home bucket
+    //      // first: buckets[t * P + i], i < counts[t]
+    //      void probe (QUERY_TYPE const &, unsigned tables, unsigned bits, unsigned P,
+    //                  uint32_t *buckets, unsigned *counts) const;
+    //      KEY_TYPE key (RECORD_TYPE const &) const;
+    //      // dists[i] = dist(records[i], query), i < n, or any value
+    //      // worse than bound if it is
+    //      void dist_many (RECORD_TYPE const *records, unsigned n,
+    //                      QUERY_TYPE const &, SEARCH_PARAMS_TYPE const &,
+    //                      float bound, float *dists) const;
     // }
 
+    // Array growing by fixed segments of 2MB allocated on demand, so
+    // nothing is reserved up front and elements never move.  With
+    // huge pages on, segments are 2MB aligned and advised to be backed
+    // by transparent huge pages.
+    template <typename T>
+    class Segmented {
+        static size_t constexpr SEGMENT_BYTES = 2 * 1024 * 1024;
+        static size_t constexpr SEGMENT = SEGMENT_BYTES / sizeof(T);
+
+        std::vector<T *> segments;
+        size_t sz;
+        bool huge;
+
+        void add_segment () {
+            void *ptr = nullptr;
+            if (posix_memalign(&ptr, huge ? SEGMENT_BYTES : 4096, SEGMENT_BYTES) != 0) {
+                throw std::bad_alloc();
+            }
+#ifdef MADV_HUGEPAGE
+            if (huge) {
+                madvise(ptr, SEGMENT_BYTES, MADV_HUGEPAGE);
+            }
+#endif
+            segments.push_back(reinterpret_cast<T *>(ptr));
+        }
+
+    public:
+        Segmented (bool huge_ = false): sz(0), huge(huge_) {
+        }
+
+        ~Segmented () {
+            clear();
+        }
+
+        Segmented (Segmented const &) = delete;
+        Segmented &operator = (Segmented const &) = delete;
+
+        size_t size () const {
+            return sz;
+        }
+
+        // bytes allocated
+        size_t memory () const {
+            return segments.size() * SEGMENT_BYTES;
+        }
+
+        T &operator [] (size_t i) {
+            return segments[i / SEGMENT][i % SEGMENT];
+        }
+
+        T const &operator [] (size_t i) const {
+            return segments[i / SEGMENT][i % SEGMENT];
+        }
+
+        // return the index of the new element
+        size_t push_back (T const &v) {
+            if (sz == segments.size() * SEGMENT) {
+                add_segment();
+            }
+            (*this)[sz] = v;
+            return sz++;
+        }
+
+        // drop all elements and give memory back
+        void clear () {
+            for (T *p: segments) {
+                free(p);
+            }
+            segments.clear();
+            sz = 0;
+        }
+
+        void write (std::ostream &os) const {
+            for (size_t i = 0; i < sz; i += SEGMENT) {
+                size_t n = std::min(sz - i, SEGMENT);
+                os.write(reinterpret_cast<char const *>(segments[i / SEGMENT]), n * sizeof(T));
+            }
+        }
+
+        // replace the content with n elements from the stream,
+        // false and empty on a short read
+        bool read (std::istream &is, size_t n) {
+            clear();
+            while (sz < n) {
+                add_segment();
+                size_t m = std::min(n - sz, SEGMENT);
+                if (!is.read(reinterpret_cast<char *>(segments.back()), m * sizeof(T))) {
+                    clear();
+                    return false;
+                }
+                sz += m;
+            }
+            return true;
+        }
+    };
+
     template <typename Config>
     class Index {
-        // A simple object to wrap malloc/free
-        class Memory {
-            size_t sz;
-            void *ptr;
-            static const size_t ALIGNMENT = 4096;
-        public:
-            Memory (size_t size): sz(size) {
-                ptr = 0;
-                int r = posix_memalign(&ptr, ALIGNMENT, size);
-                BOOST_VERIFY(r == 0);
-                BOOST_VERIFY(ptr);
-            }
-            ~Memory () {
-                free(ptr);
-            }
-            void *get () {
-                return ptr;
-            }
-            size_t size () const {
-                return sz;
-            }
-        };
+        typedef typename Config::RECORD_TYPE Record;
 
         // block of hash table
         struct Block {
             static const unsigned MAX = 31;
             uint32_t data[MAX];
-            int32_t next;  // next bucket, -1 if this is the last bucket
+            uint32_t next;  // next block, 0 if this is the last block
         };
 
         struct Bucket { // a bucket is a linked list of blocks
                         // the last block might not be full, and the size is
                         // stored in "tail"
-            int32_t first, last;    // first & last block, -1 for null, append-only link list of blocks
+            uint32_t first, last;   // first & last block, 0 for an empty bucket
             uint32_t count;         // total records in the block
             uint32_t tail;          // # records in the last block
         };
-        
 
+        static uint64_t constexpr MAGIC = 0x3148534c;   // "LSH1"
+
+        Config config;
         unsigned num_tables;
         unsigned hash_bits;
         unsigned table_size;
-        Memory memory;
+        // A table is allocated with the first record hashed into it, and
+        // blocks with the first record of a bucket, so the memory used
+        // grows with the data.  Block 0 is never used, 0 is the null link.
         std::vector<std::vector<Bucket>> tables;
-
-        Block *blocks;
-        typename Config::RECORD_TYPE *records;
-
-        // Index memory usage:
-        // * Feature storage
-        // * Hash tables
-        // * hash buckets
-
-        size_t max_blocks;  // capacity
-        size_t max_records;
-        size_t n_records;   // already allocated
-        size_t n_blocks;
+        Segmented<Block> blocks;
+        Segmented<Record> records;
+        size_t n_hashed;    // records[0, n_hashed) are in the tables
 
         void addToBucket (Bucket *bucket, uint32_t i) {
-            if (bucket->tail >= Block::MAX) {  // the last block is full
+            if (bucket->first == 0 || bucket->tail >= Block::MAX) {
                 // allocate new block
-                if (n_blocks >= max_blocks) {
-                    throw std::bad_alloc();
+                Block block;
+                block.next = 0;
+                uint32_t n = blocks.push_back(block);
+                if (bucket->first == 0) {
+                    bucket->first = n;
+                }
+                else {
+                    blocks[bucket->last].next = n;  // add the chain
                 }
-                int n = n_blocks;
-                ++n_blocks;
-                blocks[bucket->last].next = n;  // add the chain
                 bucket->last = n;
-                blocks[bucket->last].next = -1;
                 bucket->tail = 0;
             }
             blocks[bucket->last].data[bucket->tail] = i;
@@ -93,111 +180,206 @@ namespace lsh {
             ++bucket->count;
         }
 
-    public:
-        size_t capacity () const {
-            return max_records;
+        void reset () {
+            records.clear();
+            blocks.clear();
+            blocks.push_back(Block());
+            for (auto &table: tables) {
+                std::vector<Bucket>().swap(table);
+            }
+            n_hashed = 0;
         }
-        
+
+    public:
         size_t size () const {
-            return n_records;
+            return records.size();
+        }
+
+        // records reachable through the tables, the rest are scanned
+        size_t hashed () const {
+            return n_hashed;
         }
 
-        Index (unsigned num_tables_, unsigned hash_bits_, size_t allocate) // allocate = # bytes to allocate
-            : num_tables(num_tables_),
+        // bytes allocated
+        size_t memory () const {
+            size_t sz = records.memory() + blocks.memory();
+            for (auto const &table: tables) {
+                sz += table.capacity() * sizeof(Bucket);
+            }
+            return sz;
+        }
+
+        Record const &record (size_t i) const {
+            return records[i];
+        }
+
+        Index (Config const &config_, unsigned num_tables_, unsigned hash_bits_, bool huge_pages = false)
+            : config(config_),
+            num_tables(num_tables_),
             hash_bits(hash_bits_),
             table_size(1 << hash_bits_),
-            memory(allocate), tables(num_tables)
+            tables(num_tables),
+            blocks(huge_pages),
+            records(huge_pages),
+            n_hashed(0)
         {
-            // compute capacities
-            // allocate >= sizeof(RECORD_TYPE) * max_records  + sizeof(Block) * max_blocks
-            // max_blocks = max_records / BLOCK_SIZE + NUM_TABLES * TABLE_SIZE
-            size_t block_overhead = num_tables * table_size;
-            size_t blocK_overhead_bytes = block_overhead * sizeof(Block);
+            blocks.push_back(Block());
+        }
 
-            max_records = (memory.size() - blocK_overhead_bytes) * Block::MAX
-                               / (sizeof(Block) * num_tables + sizeof(typename Config::RECORD_TYPE) * Block::MAX);
-            
-            max_blocks = block_overhead + max_records * num_tables / Block::MAX;
+        // With hash = false the record is only stored, and is hashed by
+        // the next hash_pending() or hashed append.  Until then
+        // searches scan it linearly.
+        void append (Record const &rec, bool hash = true) {
+            records.push_back(rec);
+            if (hash) {
+                hash_pending();
+            }
+        }
 
-            size_t block_memory = max_blocks * sizeof(Block);
-            size_t record_memory = max_records * sizeof(typename Config::RECORD_TYPE);
-            BOOST_VERIFY(block_memory + record_memory <= memory.size());
+        void hash_pending () {
+            std::vector<uint32_t> hash(num_tables);
+            for (; n_hashed < records.size(); ++n_hashed) {
+                config.hash(records[n_hashed], num_tables, hash_bits, hash.data());
+                for (unsigned i = 0; i < num_tables; ++i) {
+                    if (tables[i].empty()) {
+                        tables[i].resize(table_size);
+                    }
+                    addToBucket(&tables[i][hash[i]], n_hashed);
+                }
+            }
+        }
 
-            n_records = n_blocks = 0;
+        // drop all records and give memory back
+        void clear () {
+            reset();
+        }
 
-            blocks = reinterpret_cast<Block *>(memory.get());
-            records = reinterpret_cast<typename Config::RECORD_TYPE *>(reinterpret_cast<char *>(memory.get()) + block_memory);
+        // Dump records, blocks and tables as they are in memory.
+        void save (std::ostream &os) const {
+            uint64_t header[] = {MAGIC, num_tables, hash_bits, sizeof(Record), sizeof(Block),
+                                 records.size(), n_hashed, blocks.size()};
+            os.write(reinterpret_cast<char const *>(header), sizeof(header));
+            records.write(os);
+            blocks.write(os);
+            for (auto const &table: tables) {
+                uint64_t sz = table.size();
+                os.write(reinterpret_cast<char const *>(&sz), sizeof(sz));
+                os.write(reinterpret_cast<char const *>(table.data()), sz * sizeof(Bucket));
+            }
+        }
 
-            // setup tables to be empty
+        // Load what save() wrote.  The index must have the same
+        // tables and bits; otherwise, or if the stream is short,
+        // return false with the index empty.
+        bool load (std::istream &is) {
+            reset();
+            uint64_t header[8];
+            if (!is.read(reinterpret_cast<char *>(header), sizeof(header))
+                    || header[0] != MAGIC || header[1] != num_tables || header[2] != hash_bits
+                    || header[3] != sizeof(Record) || header[4] != sizeof(Block)
+                    || header[6] > header[5] || header[7] == 0) {
+                return false;
+            }
+            bool ok = records.read(is, header[5]) && blocks.read(is, header[7]);
             for (auto &table: tables) {
-                table.resize(table_size);
-                for (auto &e: table) {
-                    e.first = e.last = n_blocks;
-                    e.count = e.tail = 0;
-                    blocks[e.last].next = -1;
-                    ++n_blocks;
+                if (!ok) break;
+                uint64_t sz = 0;
+                if (!is.read(reinterpret_cast<char *>(&sz), sizeof(sz))
+                        || (sz != 0 && sz != table_size)) {
+                    ok = false;
+                    break;
+                }
+                table.resize(sz);
+                if (!is.read(reinterpret_cast<char *>(table.data()), sz * sizeof(Bucket))) {
+                    ok = false;
                 }
             }
+            if (!ok) {
+                reset();
+                return false;
+            }
+            n_hashed = header[6];
+            return true;
         }
 
-        void append (typename Config::RECORD_TYPE const &rec) {
-            try {
-                if (n_records >= max_records) throw std::bad_alloc();
-                int n = n_records;
-                ++n_records;
-                records[n] = rec;
-                uint32_t hash[num_tables];
-                Config::hash(rec, num_tables, hash_bits, hash);
-                for (unsigned i = 0; i < num_tables; ++i) {
-                    addToBucket(&tables[i][hash[i]],n);
+        // Multi-probe search: up to P buckets of each table are scanned,
+        // in the order given by Config::probe with the home bucket first,
+        // so fewer tables are needed for the same recall.  A record found
+        // in several buckets is scored only once, and only the best K
+        // within dist are kept.  Records not hashed yet are all scored.
+        // Keys are returned best first.
+        void search (typename Config::QUERY_TYPE const &query, float dist, unsigned K, unsigned P, std::vector<std::pair<typename Config::KEY_TYPE, float>> *keys, typename Config::SEARCH_PARAMS_TYPE const &params) const {
+            typedef std::pair<typename Config::KEY_TYPE, float> Pair;
+            // with this order the heap front is the worst kept
+            auto better = [](Pair const &a, Pair const &b) {
+                return Config::POLARITY > 0 ? a.second > b.second : a.second < b.second;
+            };
+            keys->clear();
+            if (K == 0) return;
+            if (P == 0) P = 1;
+            Record recs[Block::MAX];
+            float dists[Block::MAX];
+            // evaluate a batch of records gathered in recs
+            auto score = [&](unsigned c) {
+                // the worst distance still of use
+                float bound = keys->size() >= K ? keys->front().second : dist;
+                config.dist_many(recs, c, query, params, bound, dists);
+                for (unsigned j = 0; j < c; ++j) {
+                    float d = dists[j];
+                    bool good = false;
+                    if (Config::POLARITY > 0) {
+                        good = d >= dist;
+                    }
+                    else {
+                        good = d <= dist;
+                    }
+                    if (!good) continue;
+                    Pair e(config.key(recs[j]), d);
+                    if (keys->size() >= K) {
+                        if (!better(e, keys->front())) continue;
+                        std::pop_heap(keys->begin(), keys->end(), better);
+                        keys->pop_back();
+                    }
+                    keys->push_back(e);
+                    std::push_heap(keys->begin(), keys->end(), better);
                 }
-            }
-            catch (std::bad_alloc const &) {
-                throw;
-            }
-        }
-
-        void search (typename Config::QUERY_TYPE const &query, float dist, std::vector<std::pair<typename Config::KEY_TYPE, float>> *keys, typename Config::SEARCH_PARAMS_TYPE const &params) {
-            uint32_t hash[num_tables];
-            Config::hash(query, num_tables, hash_bits, hash);
-            // for each table
-            for (unsigned i = 0; i < num_tables; ++i) {
-                Bucket const &bucket = tables[i][hash[i]];
-                // scan bucket
-                int c = 0;
-                int n = bucket.first;
-                // n is the next block to search
-                while (n >= 0) {
-                    int m = (n == bucket.last) ? bucket.tail : Block::MAX;
-                    Block const &block = blocks[n];
-                    for (unsigned j = 0; j < m; ++j) { // scan the block
-                        unsigned r = block.data[j];
-                        float d = Config::dist(records[r], query, params);
-                        bool good = false;
-                        if (Config::POLARITY > 0) {
-                            good = d >= dist;
-                        }
-                        else {
-                            good = d <= dist;
-                        }
-                        if (good) {
-                            keys->push_back(std::make_pair(Config::key(records[r]), d));
+            };
+            if (n_hashed) {
+                std::vector<uint32_t> probes(num_tables * P);
+                std::vector<unsigned> counts(num_tables);
+                config.probe(query, num_tables, hash_bits, P, &probes[0], &counts[0]);
+                std::vector<uint64_t> visited((n_hashed + 63) / 64, 0);
+                for (unsigned i = 0; i < num_tables; ++i) {
+                    if (tables[i].empty()) continue;
+                    for (unsigned p = 0; p < counts[i]; ++p) {
+                        Bucket const &bucket = tables[i][probes[i * P + p]];
+                        uint32_t n = bucket.first;
+                        // n is the next block to search
+                        while (n) {
+                            unsigned m = (n == bucket.last) ? bucket.tail : Block::MAX;
+                            Block const &block = blocks[n];
+                            unsigned c = 0;
+                            for (unsigned j = 0; j < m; ++j) {
+                                uint32_t r = block.data[j];
+                                uint64_t bit = uint64_t(1) << (r % 64);
+                                if (visited[r / 64] & bit) continue;
+                                visited[r / 64] |= bit;
+                                recs[c++] = records[r];
+                            }
+                            score(c);
+                            n = block.next;
                         }
-                        ++c;
                     }
-                    n = block.next;
                 }
-                BOOST_VERIFY(c == bucket.count);
             }
-        }
-
-        void brutal (typename Config::QUERY_TYPE const &query, float dist, std::vector<typename Config::KEY_TYPE> *keys) {
-            unsigned n = n_records; // as n_records is append only, we don't need to lock the index
-            for (unsigned r = 0; r < n; ++r) {
-                if (Config::dist(records[r], query) >= dist) {
-                    keys->push_back(Config::key(records[r]));
+            for (size_t r = n_hashed; r < records.size(); r += Block::MAX) {
+                unsigned c = std::min<size_t>(records.size() - r, Block::MAX);
+                for (unsigned j = 0; j < c; ++j) {
+                    recs[j] = records[r + j];
                 }
+                score(c);
             }
+            std::sort_heap(keys->begin(), keys->end(), better);
         }
     };
 }
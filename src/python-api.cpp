@@ -48,6 +48,7 @@ namespace donkey {
             req.R = py::extract<float>(dict.get("R", 1e38));
             req.hint_K = py::extract<int>(dict.get("hint_K", req.K));
             req.hint_R = py::extract<float>(dict.get("hint_R", req.R));
+            req.hint_P = py::extract<int>(dict.get("hint_P", -1));
 
             SearchResponse resp;
             Server::search(req, &resp);
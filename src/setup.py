@@ -35,7 +35,7 @@ donkey = Extension('donkey',
         libraries = libraries,
         library_dirs = ['/usr/local/lib'],
 
-        sources = ['python-api.cpp', 'donkey.cpp', 'logging.cpp', 'index-kgraph.cpp', 'index-lsh.cpp', 'kgraph_lite.cpp', 'fixed_monotonic_buffer_resource.cpp', 'kgraph/kgraph.cpp', 'kgraph/metric.cpp'],
+        sources = ['python-api.cpp', 'donkey.cpp', 'logging.cpp', 'simd.cpp', 'index-kgraph.cpp', 'index-lsh.cpp', 'index-hnsw.cpp', 'index-ivf.cpp', 'index-pq.cpp', 'index-sketch.cpp', 'index-mih.cpp', 'index-vptree.cpp', 'kgraph_lite.cpp', 'fixed_monotonic_buffer_resource.cpp', 'kgraph/kgraph.cpp', 'kgraph/metric.cpp'],
         undef_macros = [ "NDEBUG" ]
         )
 
@@ -0,0 +1,993 @@
+#include <cmath>
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#define DONKEY_SIMD_X86 1
+#include <immintrin.h>
+#endif
+#include "donkey-simd.h"
+
+namespace donkey {
+    namespace simd {
+
+        // number of candidates ahead to prefetch in batched kernels
+        static constexpr unsigned PREFETCH_AHEAD = 2;
+        // cache lines of each candidate to prefetch
+        static constexpr unsigned PREFETCH_LINES = 4;
+
+        // p points to n 4-byte elements (floats or bit vector words)
+        static inline void prefetch (void const *p, unsigned n) {
+            char const *c = reinterpret_cast<char const *>(p);
+            unsigned lines = (n * 4 + 63) / 64;
+            if (lines > PREFETCH_LINES) lines = PREFETCH_LINES;
+            for (unsigned l = 0; l < lines; ++l) {
+                __builtin_prefetch(c + l * 64);
+            }
+        }
+
+        // The batched kernels are instantiated from the single-pair
+        // kernels within each instruction set namespace, so the pair
+        // kernel is inlined and the table is consulted once per batch.
+#define DONKEY_SIMD_MANY(TARGET, NAME, FUN) \
+        TARGET \
+        static void NAME (float const *q, float const *const *x, unsigned m, unsigned n, float *out) { \
+            for (unsigned i = 0; i < m; ++i) { \
+                if (i + PREFETCH_AHEAD < m) prefetch(x[i + PREFETCH_AHEAD], n); \
+                out[i] = FUN(q, x[i], n); \
+            } \
+        }
+
+#define DONKEY_SIMD_COSINE_MANY(TARGET) \
+        TARGET \
+        static void cosine_many (float const *q, float const *const *x, unsigned m, unsigned n, float *out) { \
+            for (unsigned i = 0; i < m; ++i) { \
+                if (i + PREFETCH_AHEAD < m) prefetch(x[i + PREFETCH_AHEAD], n); \
+                float r[3]; \
+                dot_norms(q, x[i], n, r); \
+                out[i] = r[0] / (std::sqrt(r[1]) * std::sqrt(r[2])); \
+            } \
+        }
+
+        // The early abandoning kernels check the bound every
+        // BOUNDED_BLOCK dimensions, between calls to the pair kernel.
+        // They are left without target on purpose: with AVX-512 GCC
+        // keeps the sum in zmm16 and up, whose dirty upper halves
+        // vzeroupper does not clear, slowing down the caller's SSE code.
+        static constexpr unsigned BOUNDED_BLOCK = 128;
+
+#define DONKEY_SIMD_BOUNDED(NAME, FUN) \
+        static float NAME (float const *a, float const *b, unsigned n, float bound) { \
+            float v = 0; \
+            for (unsigned i = 0; i < n; i += BOUNDED_BLOCK) { \
+                v += FUN(a + i, b + i, n - i < BOUNDED_BLOCK ? n - i : BOUNDED_BLOCK); \
+                if (v > bound) break; \
+            } \
+            return v; \
+        }
+
+#define DONKEY_SIMD_NO_TARGET
+
+        // scalar reference, same accumulation as the original loops
+        namespace scalar {
+            static float l1 (float const *a, float const *b, unsigned n) {
+                double v = 0;
+                for (unsigned i = 0; i < n; ++i) {
+                    v += std::abs(a[i] - b[i]);
+                }
+                return v;
+            }
+
+            static float l2sqr (float const *a, float const *b, unsigned n) {
+                double v = 0;
+                for (unsigned i = 0; i < n; ++i) {
+                    double x = a[i] - b[i];
+                    v += x * x;
+                }
+                return v;
+            }
+
+            static float dot (float const *a, float const *b, unsigned n) {
+                float v = 0;
+                for (unsigned i = 0; i < n; ++i) {
+                    v += a[i] * b[i];
+                }
+                return v;
+            }
+
+            static void dot_norms (float const *a, float const *b, unsigned n, float *out) {
+                float v = 0, m1 = 0, m2 = 0;
+                for (unsigned i = 0; i < n; ++i) {
+                    v += a[i] * b[i];
+                    m1 += a[i] * a[i];
+                    m2 += b[i] * b[i];
+                }
+                out[0] = v;
+                out[1] = m1;
+                out[2] = m2;
+            }
+
+            // 64 bits at a time, whatever the chunk size of the feature
+            static unsigned hamming (uint32_t const *a, uint32_t const *b, unsigned n) {
+                unsigned v = 0;
+                unsigned i = 0;
+                for (; i + 2 <= n; i += 2) {
+                    uint64_t x, y;
+                    memcpy(&x, a + i, sizeof(x));
+                    memcpy(&y, b + i, sizeof(y));
+                    v += __builtin_popcountll(x ^ y);
+                }
+                if (i < n) {
+                    v += __builtin_popcount(a[i] ^ b[i]);
+                }
+                return v;
+            }
+
+            static void hamming_many (uint32_t const *q, uint32_t const *const *x, unsigned m, unsigned n, float *out) {
+                for (unsigned i = 0; i < m; ++i) {
+                    if (i + PREFETCH_AHEAD < m) prefetch(x[i + PREFETCH_AHEAD], n);
+                    out[i] = hamming(q, x[i], n);
+                }
+            }
+
+            static void pq4_scan (uint8_t const *codes, unsigned blocks, unsigned m, uint8_t const *luts, uint16_t *out) {
+                for (unsigned b = 0; b < blocks; ++b, codes += m * 16, out += 32) {
+                    for (unsigned j = 0; j < 32; ++j) {
+                        unsigned s = 0;
+                        for (unsigned k = 0; k < m; ++k) {
+                            uint8_t c = codes[k * 16 + (j & 15)];
+                            s += luts[k * 16 + (j < 16 ? c & 15 : c >> 4)];
+                        }
+                        out[j] = s;
+                    }
+                }
+            }
+
+            static void f16_dot_many (float const *q, uint16_t const *const *x, unsigned m, unsigned n, float *out) {
+                for (unsigned i = 0; i < m; ++i) {
+                    if (i + PREFETCH_AHEAD < m) prefetch(x[i + PREFETCH_AHEAD], n / 2);
+                    float v = 0;
+                    for (unsigned j = 0; j < n; ++j) {
+                        v += q[j] * half_to_float(x[i][j]);
+                    }
+                    out[i] = v;
+                }
+            }
+
+            static void f16_l1_many (float const *q, uint16_t const *const *x, unsigned m, unsigned n, float *out) {
+                for (unsigned i = 0; i < m; ++i) {
+                    if (i + PREFETCH_AHEAD < m) prefetch(x[i + PREFETCH_AHEAD], n / 2);
+                    float v = 0;
+                    for (unsigned j = 0; j < n; ++j) {
+                        v += std::abs(q[j] - half_to_float(x[i][j]));
+                    }
+                    out[i] = v;
+                }
+            }
+
+            static void u8_dot_many (float const *q, uint8_t const *const *x, unsigned m, unsigned n, float *out) {
+                for (unsigned i = 0; i < m; ++i) {
+                    if (i + PREFETCH_AHEAD < m) prefetch(x[i + PREFETCH_AHEAD], n / 4);
+                    float v = 0;
+                    for (unsigned j = 0; j < n; ++j) {
+                        v += q[j] * x[i][j];
+                    }
+                    out[i] = v;
+                }
+            }
+
+            static void u8_l1_many (float const *q, float const *w, uint8_t const *const *x, unsigned m, unsigned n, float *out) {
+                for (unsigned i = 0; i < m; ++i) {
+                    if (i + PREFETCH_AHEAD < m) prefetch(x[i + PREFETCH_AHEAD], n / 4);
+                    float v = 0;
+                    for (unsigned j = 0; j < n; ++j) {
+                        v += w[j] * std::abs(q[j] - x[i][j]);
+                    }
+                    out[i] = v;
+                }
+            }
+
+            static unsigned svb_decode (uint8_t const *ctrl, uint8_t const *data, unsigned n, uint32_t *out) {
+                uint8_t const *p = data;
+                for (unsigned i = 0; i < n; ++i) {
+                    unsigned len = ((ctrl[i / 4] >> (2 * (i % 4))) & 3) + 1;
+                    uint32_t v = 0;
+                    for (unsigned b = 0; b < len; ++b) {
+                        v |= uint32_t(p[b]) << (8 * b);
+                    }
+                    out[i] = v;
+                    p += len;
+                }
+                return p - data;
+            }
+
+            DONKEY_SIMD_BOUNDED(l1_bounded, l1)
+            DONKEY_SIMD_BOUNDED(l2sqr_bounded, l2sqr)
+            DONKEY_SIMD_MANY(DONKEY_SIMD_NO_TARGET, l1_many, l1)
+            DONKEY_SIMD_MANY(DONKEY_SIMD_NO_TARGET, l2sqr_many, l2sqr)
+            DONKEY_SIMD_MANY(DONKEY_SIMD_NO_TARGET, dot_many, dot)
+            DONKEY_SIMD_COSINE_MANY(DONKEY_SIMD_NO_TARGET)
+
+            static Kernels const kernels = {"scalar", l1, l2sqr, dot, dot_norms,
+                                            l1_bounded, l2sqr_bounded,
+                                            l1_many, l2sqr_many, dot_many, cosine_many,
+                                            hamming_many, pq4_scan,
+                                            f16_dot_many, f16_l1_many, u8_dot_many, u8_l1_many,
+                                            svb_decode};
+        }
+
+#ifdef DONKEY_SIMD_X86
+        // SSE2 is part of x86-64, so no target attribute is needed.
+        namespace sse {
+            static inline float hsum (__m128 v) {
+                __m128 s = _mm_add_ps(v, _mm_movehl_ps(v, v));
+                s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+                return _mm_cvtss_f32(s);
+            }
+
+            static float l1 (float const *a, float const *b, unsigned n) {
+                __m128 const mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+                __m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+                unsigned i = 0;
+                for (; i + 8 <= n; i += 8) {
+                    s0 = _mm_add_ps(s0, _mm_and_ps(mask, _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i))));
+                    s1 = _mm_add_ps(s1, _mm_and_ps(mask, _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4))));
+                }
+                for (; i + 4 <= n; i += 4) {
+                    s0 = _mm_add_ps(s0, _mm_and_ps(mask, _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i))));
+                }
+                float v = hsum(_mm_add_ps(s0, s1));
+                for (; i < n; ++i) {
+                    v += std::abs(a[i] - b[i]);
+                }
+                return v;
+            }
+
+            static float l2sqr (float const *a, float const *b, unsigned n) {
+                __m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+                unsigned i = 0;
+                for (; i + 8 <= n; i += 8) {
+                    __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+                    __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+                    s0 = _mm_add_ps(s0, _mm_mul_ps(d0, d0));
+                    s1 = _mm_add_ps(s1, _mm_mul_ps(d1, d1));
+                }
+                for (; i + 4 <= n; i += 4) {
+                    __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+                    s0 = _mm_add_ps(s0, _mm_mul_ps(d0, d0));
+                }
+                float v = hsum(_mm_add_ps(s0, s1));
+                for (; i < n; ++i) {
+                    float d = a[i] - b[i];
+                    v += d * d;
+                }
+                return v;
+            }
+
+            static float dot (float const *a, float const *b, unsigned n) {
+                __m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+                unsigned i = 0;
+                for (; i + 8 <= n; i += 8) {
+                    s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+                    s1 = _mm_add_ps(s1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+                }
+                for (; i + 4 <= n; i += 4) {
+                    s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+                }
+                float v = hsum(_mm_add_ps(s0, s1));
+                for (; i < n; ++i) {
+                    v += a[i] * b[i];
+                }
+                return v;
+            }
+
+            static void dot_norms (float const *a, float const *b, unsigned n, float *out) {
+                __m128 v = _mm_setzero_ps(), m1 = _mm_setzero_ps(), m2 = _mm_setzero_ps();
+                unsigned i = 0;
+                for (; i + 4 <= n; i += 4) {
+                    __m128 x = _mm_loadu_ps(a + i);
+                    __m128 y = _mm_loadu_ps(b + i);
+                    v = _mm_add_ps(v, _mm_mul_ps(x, y));
+                    m1 = _mm_add_ps(m1, _mm_mul_ps(x, x));
+                    m2 = _mm_add_ps(m2, _mm_mul_ps(y, y));
+                }
+                out[0] = hsum(v);
+                out[1] = hsum(m1);
+                out[2] = hsum(m2);
+                for (; i < n; ++i) {
+                    out[0] += a[i] * b[i];
+                    out[1] += a[i] * a[i];
+                    out[2] += b[i] * b[i];
+                }
+            }
+
+            DONKEY_SIMD_BOUNDED(l1_bounded, l1)
+            DONKEY_SIMD_BOUNDED(l2sqr_bounded, l2sqr)
+            DONKEY_SIMD_MANY(DONKEY_SIMD_NO_TARGET, l1_many, l1)
+            DONKEY_SIMD_MANY(DONKEY_SIMD_NO_TARGET, l2sqr_many, l2sqr)
+            DONKEY_SIMD_MANY(DONKEY_SIMD_NO_TARGET, dot_many, dot)
+            DONKEY_SIMD_COSINE_MANY(DONKEY_SIMD_NO_TARGET)
+
+            // popcnt and pshufb are not implied by SSE2, bit vectors,
+            // PQ codes, quantized vectors and StreamVByte use the scalar
+            // code
+            static Kernels const kernels = {"sse", l1, l2sqr, dot, dot_norms,
+                                            l1_bounded, l2sqr_bounded,
+                                            l1_many, l2sqr_many, dot_many, cosine_many,
+                                            scalar::hamming_many, scalar::pq4_scan,
+                                            scalar::f16_dot_many, scalar::f16_l1_many,
+                                            scalar::u8_dot_many, scalar::u8_l1_many,
+                                            scalar::svb_decode};
+        }
+
+#define DONKEY_TARGET_AVX2 __attribute__((target("avx2,fma")))
+        namespace avx2 {
+            DONKEY_TARGET_AVX2
+            static inline float hsum (__m256 v) {
+                __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+                s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+                s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+                return _mm_cvtss_f32(s);
+            }
+
+            DONKEY_TARGET_AVX2
+            static float l1 (float const *a, float const *b, unsigned n) {
+                __m256 const mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+                __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+                __m256 s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+                unsigned i = 0;
+                for (; i + 32 <= n; i += 32) {
+                    s0 = _mm256_add_ps(s0, _mm256_and_ps(mask, _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i))));
+                    s1 = _mm256_add_ps(s1, _mm256_and_ps(mask, _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8))));
+                    s2 = _mm256_add_ps(s2, _mm256_and_ps(mask, _mm256_sub_ps(_mm256_loadu_ps(a + i + 16), _mm256_loadu_ps(b + i + 16))));
+                    s3 = _mm256_add_ps(s3, _mm256_and_ps(mask, _mm256_sub_ps(_mm256_loadu_ps(a + i + 24), _mm256_loadu_ps(b + i + 24))));
+                }
+                for (; i + 8 <= n; i += 8) {
+                    s0 = _mm256_add_ps(s0, _mm256_and_ps(mask, _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i))));
+                }
+                float v = hsum(_mm256_add_ps(_mm256_add_ps(s0, s1), _mm256_add_ps(s2, s3)));
+                for (; i < n; ++i) {
+                    v += std::abs(a[i] - b[i]);
+                }
+                return v;
+            }
+
+            DONKEY_TARGET_AVX2
+            static float l2sqr (float const *a, float const *b, unsigned n) {
+                __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+                __m256 s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+                unsigned i = 0;
+                for (; i + 32 <= n; i += 32) {
+                    __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+                    __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+                    __m256 d2 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 16), _mm256_loadu_ps(b + i + 16));
+                    __m256 d3 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 24), _mm256_loadu_ps(b + i + 24));
+                    s0 = _mm256_fmadd_ps(d0, d0, s0);
+                    s1 = _mm256_fmadd_ps(d1, d1, s1);
+                    s2 = _mm256_fmadd_ps(d2, d2, s2);
+                    s3 = _mm256_fmadd_ps(d3, d3, s3);
+                }
+                for (; i + 8 <= n; i += 8) {
+                    __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+                    s0 = _mm256_fmadd_ps(d0, d0, s0);
+                }
+                float v = hsum(_mm256_add_ps(_mm256_add_ps(s0, s1), _mm256_add_ps(s2, s3)));
+                for (; i < n; ++i) {
+                    float d = a[i] - b[i];
+                    v += d * d;
+                }
+                return v;
+            }
+
+            DONKEY_TARGET_AVX2
+            static float dot (float const *a, float const *b, unsigned n) {
+                __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+                __m256 s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+                unsigned i = 0;
+                for (; i + 32 <= n; i += 32) {
+                    s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), s0);
+                    s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), s1);
+                    s2 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 16), _mm256_loadu_ps(b + i + 16), s2);
+                    s3 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 24), _mm256_loadu_ps(b + i + 24), s3);
+                }
+                for (; i + 8 <= n; i += 8) {
+                    s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), s0);
+                }
+                float v = hsum(_mm256_add_ps(_mm256_add_ps(s0, s1), _mm256_add_ps(s2, s3)));
+                for (; i < n; ++i) {
+                    v += a[i] * b[i];
+                }
+                return v;
+            }
+
+            DONKEY_TARGET_AVX2
+            static void dot_norms (float const *a, float const *b, unsigned n, float *out) {
+                __m256 v0 = _mm256_setzero_ps(), v1 = _mm256_setzero_ps();
+                __m256 m10 = _mm256_setzero_ps(), m11 = _mm256_setzero_ps();
+                __m256 m20 = _mm256_setzero_ps(), m21 = _mm256_setzero_ps();
+                unsigned i = 0;
+                for (; i + 16 <= n; i += 16) {
+                    __m256 x0 = _mm256_loadu_ps(a + i), x1 = _mm256_loadu_ps(a + i + 8);
+                    __m256 y0 = _mm256_loadu_ps(b + i), y1 = _mm256_loadu_ps(b + i + 8);
+                    v0 = _mm256_fmadd_ps(x0, y0, v0);
+                    v1 = _mm256_fmadd_ps(x1, y1, v1);
+                    m10 = _mm256_fmadd_ps(x0, x0, m10);
+                    m11 = _mm256_fmadd_ps(x1, x1, m11);
+                    m20 = _mm256_fmadd_ps(y0, y0, m20);
+                    m21 = _mm256_fmadd_ps(y1, y1, m21);
+                }
+                for (; i + 8 <= n; i += 8) {
+                    __m256 x0 = _mm256_loadu_ps(a + i);
+                    __m256 y0 = _mm256_loadu_ps(b + i);
+                    v0 = _mm256_fmadd_ps(x0, y0, v0);
+                    m10 = _mm256_fmadd_ps(x0, x0, m10);
+                    m20 = _mm256_fmadd_ps(y0, y0, m20);
+                }
+                out[0] = hsum(_mm256_add_ps(v0, v1));
+                out[1] = hsum(_mm256_add_ps(m10, m11));
+                out[2] = hsum(_mm256_add_ps(m20, m21));
+                for (; i < n; ++i) {
+                    out[0] += a[i] * b[i];
+                    out[1] += a[i] * a[i];
+                    out[2] += b[i] * b[i];
+                }
+            }
+
+            DONKEY_SIMD_BOUNDED(l1_bounded, l1)
+            DONKEY_SIMD_BOUNDED(l2sqr_bounded, l2sqr)
+            DONKEY_SIMD_MANY(DONKEY_TARGET_AVX2, l1_many, l1)
+            DONKEY_SIMD_MANY(DONKEY_TARGET_AVX2, l2sqr_many, l2sqr)
+            DONKEY_SIMD_MANY(DONKEY_TARGET_AVX2, dot_many, dot)
+            DONKEY_SIMD_COSINE_MANY(DONKEY_TARGET_AVX2)
+
+            // Bit counting with the nibble lookup table in a byte
+            // shuffle; byte counts are summed into 64-bit lanes by SAD.
+            DONKEY_TARGET_AVX2
+            static inline __m256i popcount64 (__m256i v) {
+                __m256i const lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                                     0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+                __m256i const low = _mm256_set1_epi8(0x0f);
+                __m256i lo = _mm256_and_si256(v, low);
+                __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low);
+                __m256i c = _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo), _mm256_shuffle_epi8(lut, hi));
+                return _mm256_sad_epu8(c, _mm256_setzero_si256());
+            }
+
+            DONKEY_TARGET_AVX2
+            static inline unsigned hsum64 (__m256i v) {
+                __m128i s = _mm_add_epi64(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+                s = _mm_add_epi64(s, _mm_unpackhi_epi64(s, s));
+                return _mm_cvtsi128_si32(s);
+            }
+
+            DONKEY_TARGET_AVX2
+            static inline __m256i tail_mask (unsigned r) {
+                return _mm256_cmpgt_epi32(_mm256_set1_epi32(r), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+            }
+
+            DONKEY_TARGET_AVX2
+            static unsigned hamming (uint32_t const *a, uint32_t const *b, unsigned n) {
+                __m256i s = _mm256_setzero_si256();
+                unsigned i = 0;
+                for (; i + 8 <= n; i += 8) {
+                    __m256i v = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<__m256i const *>(a + i)),
+                                                 _mm256_loadu_si256(reinterpret_cast<__m256i const *>(b + i)));
+                    s = _mm256_add_epi64(s, popcount64(v));
+                }
+                if (i < n) {
+                    __m256i mk = tail_mask(n - i);
+                    __m256i v = _mm256_xor_si256(_mm256_maskload_epi32(reinterpret_cast<int const *>(a + i), mk),
+                                                 _mm256_maskload_epi32(reinterpret_cast<int const *>(b + i), mk));
+                    s = _mm256_add_epi64(s, popcount64(v));
+                }
+                return hsum64(s);
+            }
+
+            // 128-bit sketches (nise) are packed two per register,
+            // four candidates per iteration.
+            DONKEY_TARGET_AVX2
+            static void hamming_many_128 (uint32_t const *q, uint32_t const *const *x, unsigned m, float *out) {
+                __m256i qv = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<__m128i const *>(q)));
+                __m256i const perm = _mm256_setr_epi32(0, 4, 1, 5, 0, 0, 0, 0);
+                unsigned i = 0;
+                for (; i + 4 <= m; i += 4) {
+                    __m256i v0 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<__m128i const *>(x[i]))),
+                                                         _mm_loadu_si128(reinterpret_cast<__m128i const *>(x[i + 1])), 1);
+                    __m256i v1 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<__m128i const *>(x[i + 2]))),
+                                                         _mm_loadu_si128(reinterpret_cast<__m128i const *>(x[i + 3])), 1);
+                    __m256i c0 = popcount64(_mm256_xor_si256(v0, qv));
+                    __m256i c1 = popcount64(_mm256_xor_si256(v1, qv));
+                    // the two qwords of each lane to the low one: dwords 0, 4
+                    c0 = _mm256_add_epi64(c0, _mm256_shuffle_epi32(c0, _MM_SHUFFLE(1, 0, 3, 2)));
+                    c1 = _mm256_add_epi64(c1, _mm256_shuffle_epi32(c1, _MM_SHUFFLE(1, 0, 3, 2)));
+                    // candidates i, i+2, i+1, i+3 at dwords 0, 1, 4, 5
+                    __m256i c = _mm256_blend_epi32(c0, _mm256_slli_si256(c1, 4), 0x22);
+                    c = _mm256_permutevar8x32_epi32(c, perm);
+                    _mm_storeu_ps(out + i, _mm_cvtepi32_ps(_mm256_castsi256_si128(c)));
+                }
+                for (; i < m; ++i) {
+                    out[i] = hamming(q, x[i], 4);
+                }
+            }
+
+            DONKEY_TARGET_AVX2
+            static void hamming_many (uint32_t const *q, uint32_t const *const *x, unsigned m, unsigned n, float *out) {
+                if (n == 4) {
+                    hamming_many_128(q, x, m, out);
+                    return;
+                }
+                for (unsigned i = 0; i < m; ++i) {
+                    if (i + PREFETCH_AHEAD < m) prefetch(x[i + PREFETCH_AHEAD], n);
+                    out[i] = hamming(q, x[i], n);
+                }
+            }
+
+            // The 16-entry tables are looked up with pshufb, two
+            // sub-quantizers per register, one per lane.
+            DONKEY_TARGET_AVX2
+            static void pq4_scan (uint8_t const *codes, unsigned blocks, unsigned m, uint8_t const *luts, uint16_t *out) {
+                __m256i const low = _mm256_set1_epi8(0x0f);
+                for (unsigned b = 0; b < blocks; ++b, codes += m * 16, out += 32) {
+                    __m256i acc0 = _mm256_setzero_si256();  // vectors 0-15
+                    __m256i acc1 = _mm256_setzero_si256();  // vectors 16-31
+                    unsigned k = 0;
+                    for (; k + 2 <= m; k += 2) {
+                        __m256i c = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(codes + k * 16));
+                        __m256i t = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(luts + k * 16));
+                        __m256i lo = _mm256_shuffle_epi8(t, _mm256_and_si256(c, low));
+                        __m256i hi = _mm256_shuffle_epi8(t, _mm256_and_si256(_mm256_srli_epi16(c, 4), low));
+                        acc0 = _mm256_add_epi16(acc0, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(lo)));
+                        acc0 = _mm256_add_epi16(acc0, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(lo, 1)));
+                        acc1 = _mm256_add_epi16(acc1, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(hi)));
+                        acc1 = _mm256_add_epi16(acc1, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(hi, 1)));
+                    }
+                    if (k < m) {
+                        __m128i c = _mm_loadu_si128(reinterpret_cast<__m128i const *>(codes + k * 16));
+                        __m128i t = _mm_loadu_si128(reinterpret_cast<__m128i const *>(luts + k * 16));
+                        __m128i lo = _mm_shuffle_epi8(t, _mm_and_si128(c, _mm256_castsi256_si128(low)));
+                        __m128i hi = _mm_shuffle_epi8(t, _mm_and_si128(_mm_srli_epi16(c, 4), _mm256_castsi256_si128(low)));
+                        acc0 = _mm256_add_epi16(acc0, _mm256_cvtepu8_epi16(lo));
+                        acc1 = _mm256_add_epi16(acc1, _mm256_cvtepu8_epi16(hi));
+                    }
+                    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out), acc0);
+                    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + 16), acc1);
+                }
+            }
+
+            // Quantized vectors are widened to floats 8 at a time, by
+            // F16C for half precision and zero extension for bytes.
+#define DONKEY_TARGET_F16C __attribute__((target("avx2,fma,f16c")))
+            DONKEY_TARGET_F16C
+            static inline __m256 load_f16 (uint16_t const *p) {
+                return _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<__m128i const *>(p)));
+            }
+
+            DONKEY_TARGET_AVX2
+            static inline __m256 load_u8 (uint8_t const *p) {
+                return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<__m128i const *>(p))));
+            }
+
+            DONKEY_TARGET_F16C
+            static void f16_dot_many (float const *q, uint16_t const *const *x, unsigned m, unsigned n, float *out) {
+                for (unsigned i = 0; i < m; ++i) {
+                    if (i + PREFETCH_AHEAD < m) prefetch(x[i + PREFETCH_AHEAD], n / 2);
+                    uint16_t const *p = x[i];
+                    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+                    unsigned j = 0;
+                    for (; j + 16 <= n; j += 16) {
+                        s0 = _mm256_fmadd_ps(_mm256_loadu_ps(q + j), load_f16(p + j), s0);
+                        s1 = _mm256_fmadd_ps(_mm256_loadu_ps(q + j + 8), load_f16(p + j + 8), s1);
+                    }
+                    for (; j + 8 <= n; j += 8) {
+                        s0 = _mm256_fmadd_ps(_mm256_loadu_ps(q + j), load_f16(p + j), s0);
+                    }
+                    float v = hsum(_mm256_add_ps(s0, s1));
+                    for (; j < n; ++j) {
+                        v += q[j] * half_to_float(p[j]);
+                    }
+                    out[i] = v;
+                }
+            }
+
+            DONKEY_TARGET_F16C
+            static void f16_l1_many (float const *q, uint16_t const *const *x, unsigned m, unsigned n, float *out) {
+                __m256 const mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+                for (unsigned i = 0; i < m; ++i) {
+                    if (i + PREFETCH_AHEAD < m) prefetch(x[i + PREFETCH_AHEAD], n / 2);
+                    uint16_t const *p = x[i];
+                    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+                    unsigned j = 0;
+                    for (; j + 16 <= n; j += 16) {
+                        s0 = _mm256_add_ps(s0, _mm256_and_ps(mask, _mm256_sub_ps(_mm256_loadu_ps(q + j), load_f16(p + j))));
+                        s1 = _mm256_add_ps(s1, _mm256_and_ps(mask, _mm256_sub_ps(_mm256_loadu_ps(q + j + 8), load_f16(p + j + 8))));
+                    }
+                    for (; j + 8 <= n; j += 8) {
+                        s0 = _mm256_add_ps(s0, _mm256_and_ps(mask, _mm256_sub_ps(_mm256_loadu_ps(q + j), load_f16(p + j))));
+                    }
+                    float v = hsum(_mm256_add_ps(s0, s1));
+                    for (; j < n; ++j) {
+                        v += std::abs(q[j] - half_to_float(p[j]));
+                    }
+                    out[i] = v;
+                }
+            }
+
+            DONKEY_TARGET_AVX2
+            static void u8_dot_many (float const *q, uint8_t const *const *x, unsigned m, unsigned n, float *out) {
+                for (unsigned i = 0; i < m; ++i) {
+                    if (i + PREFETCH_AHEAD < m) prefetch(x[i + PREFETCH_AHEAD], n / 4);
+                    uint8_t const *p = x[i];
+                    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+                    unsigned j = 0;
+                    for (; j + 16 <= n; j += 16) {
+                        s0 = _mm256_fmadd_ps(_mm256_loadu_ps(q + j), load_u8(p + j), s0);
+                        s1 = _mm256_fmadd_ps(_mm256_loadu_ps(q + j + 8), load_u8(p + j + 8), s1);
+                    }
+                    for (; j + 8 <= n; j += 8) {
+                        s0 = _mm256_fmadd_ps(_mm256_loadu_ps(q + j), load_u8(p + j), s0);
+                    }
+                    float v = hsum(_mm256_add_ps(s0, s1));
+                    for (; j < n; ++j) {
+                        v += q[j] * p[j];
+                    }
+                    out[i] = v;
+                }
+            }
+
+            DONKEY_TARGET_AVX2
+            static void u8_l1_many (float const *q, float const *w, uint8_t const *const *x, unsigned m, unsigned n, float *out) {
+                __m256 const mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+                for (unsigned i = 0; i < m; ++i) {
+                    if (i + PREFETCH_AHEAD < m) prefetch(x[i + PREFETCH_AHEAD], n / 4);
+                    uint8_t const *p = x[i];
+                    __m256 s0 = _mm256_setzero_ps();
+                    unsigned j = 0;
+                    for (; j + 8 <= n; j += 8) {
+                        __m256 d = _mm256_and_ps(mask, _mm256_sub_ps(_mm256_loadu_ps(q + j), load_u8(p + j)));
+                        s0 = _mm256_fmadd_ps(_mm256_loadu_ps(w + j), d, s0);
+                    }
+                    float v = hsum(s0);
+                    for (; j < n; ++j) {
+                        v += w[j] * std::abs(q[j] - p[j]);
+                    }
+                    out[i] = v;
+                }
+            }
+
+            // StreamVByte shuffles: the bytes of four values selected by a
+            // control byte spread into four 32-bit lanes, 0x80 zeroing
+            struct SVBTables {
+                uint8_t shuffle[256][16];
+                uint8_t length[256];
+
+                SVBTables () {
+                    for (unsigned c = 0; c < 256; ++c) {
+                        unsigned pos = 0;
+                        for (unsigned k = 0; k < 4; ++k) {
+                            unsigned len = ((c >> (2 * k)) & 3) + 1;
+                            for (unsigned b = 0; b < 4; ++b) {
+                                shuffle[c][4 * k + b] = b < len ? pos + b : 0x80;
+                            }
+                            pos += len;
+                        }
+                        length[c] = pos;
+                    }
+                }
+            };
+
+            static SVBTables const svb_tables;
+
+            DONKEY_TARGET_AVX2
+            static unsigned svb_decode (uint8_t const *ctrl, uint8_t const *data, unsigned n, uint32_t *out) {
+                uint8_t const *p = data;
+                unsigned i = 0;
+                for (; i + 4 <= n; i += 4) {
+                    uint8_t c = ctrl[i / 4];
+                    __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(p));
+                    __m128i s = _mm_loadu_si128(reinterpret_cast<__m128i const *>(svb_tables.shuffle[c]));
+                    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_shuffle_epi8(v, s));
+                    p += svb_tables.length[c];
+                }
+                p += scalar::svb_decode(ctrl + i / 4, p, n - i, out + i);
+                return p - data;
+            }
+
+            static Kernels const kernels = {"avx2", l1, l2sqr, dot, dot_norms,
+                                            l1_bounded, l2sqr_bounded,
+                                            l1_many, l2sqr_many, dot_many, cosine_many,
+                                            hamming_many, pq4_scan,
+                                            f16_dot_many, f16_l1_many, u8_dot_many, u8_l1_many,
+                                            svb_decode};
+        }
+
+#define DONKEY_TARGET_AVX512 __attribute__((target("avx512f")))
+        // the tail is done with a masked load, so there's no scalar loop
+        namespace avx512 {
+            DONKEY_TARGET_AVX512
+            static inline __mmask16 tail_mask (unsigned r) {
+                return __mmask16((1u << r) - 1);
+            }
+
+            DONKEY_TARGET_AVX512
+            static float l1 (float const *a, float const *b, unsigned n) {
+                __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+                __m512 s2 = _mm512_setzero_ps(), s3 = _mm512_setzero_ps();
+                unsigned i = 0;
+                for (; i + 64 <= n; i += 64) {
+                    s0 = _mm512_add_ps(s0, _mm512_abs_ps(_mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i))));
+                    s1 = _mm512_add_ps(s1, _mm512_abs_ps(_mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16))));
+                    s2 = _mm512_add_ps(s2, _mm512_abs_ps(_mm512_sub_ps(_mm512_loadu_ps(a + i + 32), _mm512_loadu_ps(b + i + 32))));
+                    s3 = _mm512_add_ps(s3, _mm512_abs_ps(_mm512_sub_ps(_mm512_loadu_ps(a + i + 48), _mm512_loadu_ps(b + i + 48))));
+                }
+                for (; i + 16 <= n; i += 16) {
+                    s0 = _mm512_add_ps(s0, _mm512_abs_ps(_mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i))));
+                }
+                if (i < n) {
+                    __mmask16 m = tail_mask(n - i);
+                    s1 = _mm512_add_ps(s1, _mm512_abs_ps(_mm512_sub_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i))));
+                }
+                return _mm512_reduce_add_ps(_mm512_add_ps(_mm512_add_ps(s0, s1), _mm512_add_ps(s2, s3)));
+            }
+
+            DONKEY_TARGET_AVX512
+            static float l2sqr (float const *a, float const *b, unsigned n) {
+                __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+                __m512 s2 = _mm512_setzero_ps(), s3 = _mm512_setzero_ps();
+                unsigned i = 0;
+                for (; i + 64 <= n; i += 64) {
+                    __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+                    __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+                    __m512 d2 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 32), _mm512_loadu_ps(b + i + 32));
+                    __m512 d3 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 48), _mm512_loadu_ps(b + i + 48));
+                    s0 = _mm512_fmadd_ps(d0, d0, s0);
+                    s1 = _mm512_fmadd_ps(d1, d1, s1);
+                    s2 = _mm512_fmadd_ps(d2, d2, s2);
+                    s3 = _mm512_fmadd_ps(d3, d3, s3);
+                }
+                for (; i + 16 <= n; i += 16) {
+                    __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+                    s0 = _mm512_fmadd_ps(d0, d0, s0);
+                }
+                if (i < n) {
+                    __mmask16 m = tail_mask(n - i);
+                    __m512 d1 = _mm512_sub_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i));
+                    s1 = _mm512_fmadd_ps(d1, d1, s1);
+                }
+                return _mm512_reduce_add_ps(_mm512_add_ps(_mm512_add_ps(s0, s1), _mm512_add_ps(s2, s3)));
+            }
+
+            DONKEY_TARGET_AVX512
+            static float dot (float const *a, float const *b, unsigned n) {
+                __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+                __m512 s2 = _mm512_setzero_ps(), s3 = _mm512_setzero_ps();
+                unsigned i = 0;
+                for (; i + 64 <= n; i += 64) {
+                    s0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), s0);
+                    s1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), s1);
+                    s2 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 32), _mm512_loadu_ps(b + i + 32), s2);
+                    s3 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 48), _mm512_loadu_ps(b + i + 48), s3);
+                }
+                for (; i + 16 <= n; i += 16) {
+                    s0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), s0);
+                }
+                if (i < n) {
+                    __mmask16 m = tail_mask(n - i);
+                    s1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i), s1);
+                }
+                return _mm512_reduce_add_ps(_mm512_add_ps(_mm512_add_ps(s0, s1), _mm512_add_ps(s2, s3)));
+            }
+
+            DONKEY_TARGET_AVX512
+            static void dot_norms (float const *a, float const *b, unsigned n, float *out) {
+                __m512 v0 = _mm512_setzero_ps(), v1 = _mm512_setzero_ps();
+                __m512 m10 = _mm512_setzero_ps(), m11 = _mm512_setzero_ps();
+                __m512 m20 = _mm512_setzero_ps(), m21 = _mm512_setzero_ps();
+                unsigned i = 0;
+                for (; i + 32 <= n; i += 32) {
+                    __m512 x0 = _mm512_loadu_ps(a + i), x1 = _mm512_loadu_ps(a + i + 16);
+                    __m512 y0 = _mm512_loadu_ps(b + i), y1 = _mm512_loadu_ps(b + i + 16);
+                    v0 = _mm512_fmadd_ps(x0, y0, v0);
+                    v1 = _mm512_fmadd_ps(x1, y1, v1);
+                    m10 = _mm512_fmadd_ps(x0, x0, m10);
+                    m11 = _mm512_fmadd_ps(x1, x1, m11);
+                    m20 = _mm512_fmadd_ps(y0, y0, m20);
+                    m21 = _mm512_fmadd_ps(y1, y1, m21);
+                }
+                for (; i < n; i += 16) {
+                    __mmask16 m = (n - i >= 16) ? __mmask16(0xffff) : tail_mask(n - i);
+                    __m512 x0 = _mm512_maskz_loadu_ps(m, a + i);
+                    __m512 y0 = _mm512_maskz_loadu_ps(m, b + i);
+                    v0 = _mm512_fmadd_ps(x0, y0, v0);
+                    m10 = _mm512_fmadd_ps(x0, x0, m10);
+                    m20 = _mm512_fmadd_ps(y0, y0, m20);
+                }
+                out[0] = _mm512_reduce_add_ps(_mm512_add_ps(v0, v1));
+                out[1] = _mm512_reduce_add_ps(_mm512_add_ps(m10, m11));
+                out[2] = _mm512_reduce_add_ps(_mm512_add_ps(m20, m21));
+            }
+
+            // With n <= 64 the whole query is held in four registers
+            // across the batch; longer vectors use the pair kernel.
+#define DONKEY_AVX512_MANY(NAME, FUN, ACC) \
+            DONKEY_TARGET_AVX512 \
+            static void NAME (float const *q, float const *const *x, unsigned m, unsigned n, float *out) { \
+                if (n > 64) { \
+                    for (unsigned i = 0; i < m; ++i) { \
+                        if (i + PREFETCH_AHEAD < m) prefetch(x[i + PREFETCH_AHEAD], n); \
+                        out[i] = FUN(q, x[i], n); \
+                    } \
+                    return; \
+                } \
+                __mmask16 mk[4]; \
+                __m512 qv[4]; \
+                unsigned blocks = (n + 15) / 16; \
+                for (unsigned b = 0; b < blocks; ++b) { \
+                    unsigned r = n - b * 16; \
+                    mk[b] = r >= 16 ? __mmask16(0xffff) : tail_mask(r); \
+                    qv[b] = _mm512_maskz_loadu_ps(mk[b], q + b * 16); \
+                } \
+                for (unsigned i = 0; i < m; ++i) { \
+                    if (i + PREFETCH_AHEAD < m) prefetch(x[i + PREFETCH_AHEAD], n); \
+                    float const *p = x[i]; \
+                    __m512 s = _mm512_setzero_ps(); \
+                    for (unsigned b = 0; b < blocks; ++b) { \
+                        __m512 v = _mm512_maskz_loadu_ps(mk[b], p + b * 16); \
+                        ACC; \
+                    } \
+                    out[i] = _mm512_reduce_add_ps(s); \
+                } \
+            }
+
+            DONKEY_SIMD_BOUNDED(l1_bounded, l1)
+            DONKEY_SIMD_BOUNDED(l2sqr_bounded, l2sqr)
+            DONKEY_AVX512_MANY(l1_many, l1, s = _mm512_add_ps(s, _mm512_abs_ps(_mm512_sub_ps(qv[b], v))))
+            DONKEY_AVX512_MANY(l2sqr_many, l2sqr, __m512 d = _mm512_sub_ps(qv[b], v); s = _mm512_fmadd_ps(d, d, s))
+            DONKEY_AVX512_MANY(dot_many, dot, s = _mm512_fmadd_ps(qv[b], v, s))
+#undef DONKEY_AVX512_MANY
+            DONKEY_SIMD_COSINE_MANY(DONKEY_TARGET_AVX512)
+
+            // VPOPCNTDQ is a separate extension (Ice Lake and later),
+            // without it bit vectors go through the AVX2 kernel.
+#define DONKEY_TARGET_VPOPCNT __attribute__((target("avx512f,avx512vpopcntdq")))
+            namespace vpopcnt {
+                // with n <= 64 the query is held in registers
+                DONKEY_TARGET_VPOPCNT
+                static void hamming_many_any (uint32_t const *q, uint32_t const *const *x, unsigned m, unsigned n, float *out) {
+                    __mmask16 mk[4];
+                    __m512i qv[4];
+                    unsigned blocks = (n + 15) / 16;
+                    bool hold = blocks <= 4;
+                    if (hold) {
+                        for (unsigned b = 0; b < blocks; ++b) {
+                            unsigned r = n - b * 16;
+                            mk[b] = r >= 16 ? __mmask16(0xffff) : tail_mask(r);
+                            qv[b] = _mm512_maskz_loadu_epi32(mk[b], q + b * 16);
+                        }
+                    }
+                    for (unsigned i = 0; i < m; ++i) {
+                        if (i + PREFETCH_AHEAD < m) prefetch(x[i + PREFETCH_AHEAD], n);
+                        uint32_t const *p = x[i];
+                        __m512i s = _mm512_setzero_si512();
+                        for (unsigned b = 0; b < blocks; ++b) {
+                            unsigned r = n - b * 16;
+                            __mmask16 k = hold ? mk[b] : (r >= 16 ? __mmask16(0xffff) : tail_mask(r));
+                            __m512i u = hold ? qv[b] : _mm512_maskz_loadu_epi32(k, q + b * 16);
+                            __m512i v = _mm512_maskz_loadu_epi32(k, p + b * 16);
+                            s = _mm512_add_epi64(s, _mm512_popcnt_epi64(_mm512_xor_si512(u, v)));
+                        }
+                        out[i] = _mm512_reduce_add_epi64(s);
+                    }
+                }
+
+                // 128-bit sketches, four per register, eight candidates
+                // per iteration
+                DONKEY_TARGET_VPOPCNT
+                static void hamming_many_128 (uint32_t const *q, uint32_t const *const *x, unsigned m, float *out) {
+                    __m512i qv = _mm512_broadcast_i32x4(_mm_loadu_si128(reinterpret_cast<__m128i const *>(q)));
+                    __m512i const even = _mm512_setr_epi64(0, 2, 4, 6, 8, 10, 12, 14);
+                    unsigned i = 0;
+                    for (; i + 8 <= m; i += 8) {
+                        __m512i v[2];
+                        for (unsigned j = 0; j < 2; ++j) {
+                            uint32_t const *const *p = x + i + j * 4;
+                            __m512i t = _mm512_castsi128_si512(_mm_loadu_si128(reinterpret_cast<__m128i const *>(p[0])));
+                            t = _mm512_inserti32x4(t, _mm_loadu_si128(reinterpret_cast<__m128i const *>(p[1])), 1);
+                            t = _mm512_inserti32x4(t, _mm_loadu_si128(reinterpret_cast<__m128i const *>(p[2])), 2);
+                            t = _mm512_inserti32x4(t, _mm_loadu_si128(reinterpret_cast<__m128i const *>(p[3])), 3);
+                            t = _mm512_popcnt_epi64(_mm512_xor_si512(t, qv));
+                            // sum the two qwords of each 128-bit lane
+                            v[j] = _mm512_add_epi64(t, _mm512_shuffle_epi32(t, _MM_PERM_BADC));
+                        }
+                        __m512i c = _mm512_permutex2var_epi64(v[0], even, v[1]);
+                        _mm256_storeu_ps(out + i, _mm256_cvtepi32_ps(_mm512_cvtepi64_epi32(c)));
+                    }
+                    if (i < m) {
+                        hamming_many_any(q, x + i, m - i, 4, out + i);
+                    }
+                }
+
+                DONKEY_TARGET_VPOPCNT
+                static void hamming_many (uint32_t const *q, uint32_t const *const *x, unsigned m, unsigned n, float *out) {
+                    if (n == 4) {
+                        hamming_many_128(q, x, m, out);
+                    }
+                    else {
+                        hamming_many_any(q, x, m, n, out);
+                    }
+                }
+            }
+
+            static bool detect_vpopcnt () {
+                __builtin_cpu_init();
+                return __builtin_cpu_supports("avx512vpopcntdq");
+            }
+
+            static bool const has_vpopcnt = detect_vpopcnt();
+
+            static void hamming_many (uint32_t const *q, uint32_t const *const *x, unsigned m, unsigned n, float *out) {
+                if (has_vpopcnt) {
+                    vpopcnt::hamming_many(q, x, m, n, out);
+                }
+                else {
+                    avx2::hamming_many(q, x, m, n, out);
+                }
+            }
+
+            // AVX-512F has no byte shuffle, PQ codes and StreamVByte use
+            // the AVX2 code; half precision and byte vectors also use the
+            // AVX2 kernels, which keep the query in float.
+            static Kernels const kernels = {"avx512", l1, l2sqr, dot, dot_norms,
+                                            l1_bounded, l2sqr_bounded,
+                                            l1_many, l2sqr_many, dot_many, cosine_many,
+                                            hamming_many, avx2::pq4_scan,
+                                            avx2::f16_dot_many, avx2::f16_l1_many,
+                                            avx2::u8_dot_many, avx2::u8_l1_many,
+                                            avx2::svb_decode};
+        }
+#endif
+
+        Kernels const *active = &scalar::kernels;
+
+        bool l2_dot_expansion = false;
+
+        Kernels const *lookup (char const *name) {
+            if (strcmp(name, "scalar") == 0) {
+                return &scalar::kernels;
+            }
+#ifdef DONKEY_SIMD_X86
+            __builtin_cpu_init();
+            if (strcmp(name, "sse") == 0) {
+                return &sse::kernels;
+            }
+            if (strcmp(name, "avx2") == 0) {
+                if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")
+                        && __builtin_cpu_supports("f16c")) {
+                    return &avx2::kernels;
+                }
+            }
+            if (strcmp(name, "avx512") == 0) {
+                if (__builtin_cpu_supports("avx512f")) {
+                    return &avx512::kernels;
+                }
+            }
+#endif
+            return nullptr;
+        }
+
+        bool select (char const *name) {
+            Kernels const *k = lookup(name);
+            if (!k) return false;
+            active = k;
+            return true;
+        }
+
+        // pick the best kernels at startup; until this runs the
+        // statically initialized scalar table is used.
+        static struct Detector {
+            Detector () {
+                static char const *preference[] = {"avx512", "avx2", "sse"};
+                for (char const *name: preference) {
+                    if (select(name)) break;
+                }
+            }
+        } detector;
+    }
+}
@@ -269,6 +269,7 @@ int main (int argc, char *argv[]) {
         (",R", po::value(&search.R)->default_value(NAN), "")
         ("hint_K", po::value(&search.hint_K)->default_value(-1), "")
         ("hint_R", po::value(&search.hint_R)->default_value(NAN), "")
+        ("hint_P", po::value(&search.hint_P)->default_value(-1), "probe budget")
         ("once", "")
         ("no-keepalive", "")
         ;